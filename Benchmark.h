@@ -0,0 +1,1901 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "Clock.h"
+#include "Cohort.h"
+#include "CoWard.h"
+#include "Controller.h"
+#include "EventLog.h"
+#include "GlycemiaStats.h"
+#include "LiveState.h"
+#include "Mailbox.h"
+#include "Message.h"
+#include "Model.h"
+#include "Patient.h"
+#include "Periodic.h"
+#include "Realtime.h"
+#include "Simulation.h"
+#include "Syringe.h"
+#include "SyringeBank.h"
+#include "Telemetry.h"
+#include "TimerWheel.h"
+#include "Trace.h"
+#include "Ward.h"
+
+// number of messages sent through a channel by the transport benchmark
+#define BENCH_MESSAGES 200000
+// duration of each run of the patient contention benchmark
+#define BENCH_PATIENT_NS 200000000LL
+// size of the cohort and number of cycles of the cohort benchmark
+#define BENCH_COHORT 1000000
+#define BENCH_COHORT_CYCLES 100
+// control cycle of the model benchmark, in seconds of patient time, and
+// cycles of the comparison of the Bergman kernels
+#define BENCH_MODEL_DT 0.5
+#define BENCH_MODEL_CYCLES 20
+// pumps of the syringe benchmark and pause between two pumps in us
+#define BENCH_PUMPS 500
+#define BENCH_PUMP_US 100
+// cartridges, pumping threads and doses per thread of the bank stress test
+#define BENCH_CARTRIDGES 6
+#define BENCH_PUMPERS 4
+#define BENCH_DOSES 200000
+// recurring doses of the timer benchmark, their interval and the duration
+// of the run in nanoseconds
+#define BENCH_TIMERS 1000000
+#define BENCH_TIMER_INTERVAL 1000000000LL
+#define BENCH_TIMER_NS 3000000000LL
+// period of the timer due on the level boundaries of the wheel and end of
+// that test, in ticks
+#define BENCH_BOUNDARY_PERIOD 128
+#define BENCH_BOUNDARY_END 8192
+// updates per thread of the telemetry benchmark
+#define BENCH_RECORDS 2000000
+// size of a display message before the frames, one Message per send
+#define BENCH_OLD_MSG_SIZE 4096
+// control period, cycles (one hour) and seeds of the edge trigger check
+#define BENCH_EDGE_PERIOD 50000000LL
+#define BENCH_EDGE_CYCLES 72000
+#define BENCH_EDGE_SEEDS 8
+#define BENCH_EDGE_HEARTBEAT 20
+// events per thread of the event log benchmark
+#define BENCH_EVENTS 500000
+// decisions per policy of the decision benchmark, and size of the table of
+// glycemias they are made on (a power of two)
+#define BENCH_DECISIONS 20000000
+#define BENCH_GLYCEMIAS 4096
+// cycles of the policy scenario (one hour of 50 ms cycles), cycles between
+// two meals and glucose steps of a meal
+#define BENCH_SCENARIO_CYCLES 72000
+#define BENCH_MEAL_CYCLES 12000
+#define BENCH_MEAL_STEPS 40
+// records per thread and recording threads of the trace benchmark, and the
+// file it writes
+#define BENCH_TRACE_RECORDS 4000000
+#define BENCH_TRACE_THREADS 4
+#define BENCH_TRACE_PATH "/tmp/bench.trace"
+// period and cycles of the controller of the live state benchmark, its
+// readers and their polling period in us
+#define BENCH_LIVE_PERIOD 1000000
+#define BENCH_LIVE_CYCLES 2000
+#define BENCH_LIVE_READERS 10
+#define BENCH_LIVE_POLL_US 100
+#define BENCH_LIVE_NAME "/glycemia_bench"
+// patients, controller cycles and shards of the coroutine ward runs,
+// patients of the one thread per task design and round trips of the
+// switch measures
+#define BENCH_CO_PATIENTS 10000
+#define BENCH_CO_CYCLES 40
+#define BENCH_CO_PERIOD 50000000LL
+#define BENCH_CO_SHARDS 4
+#define BENCH_CO_THREADED 200
+#define BENCH_CO_ROUNDS 200000
+// patients and back to back cycles of the ward scaling runs, up to
+// BENCH_STEAL_WORKERS workers
+#define BENCH_STEAL_PATIENTS 10000
+#define BENCH_STEAL_CYCLES 200
+#define BENCH_STEAL_WORKERS 64
+// period and cycles of the wakeup latency test, load threads per core and
+// the buffer each of them walks
+#define BENCH_LAT_PERIOD 1000000
+#define BENCH_LAT_CYCLES 3000
+#define BENCH_LAT_LOAD 2
+#define BENCH_LAT_BUFFER (8 * 1024 * 1024)
+// rounds of the priority inversion test and their period, cpu time the low
+// task holds the lock, times the high and middle tasks wake up after it
+// took it and time the middle task spins, in nanoseconds
+#define BENCH_INV_ROUNDS 50
+#define BENCH_INV_PERIOD 20000000LL
+#define BENCH_INV_HOLD 1000000LL
+#define BENCH_INV_HIGH 200000LL
+#define BENCH_INV_MIDDLE 300000LL
+#define BENCH_INV_SPIN 10000000LL
+// cycles and period of the controller of the flood test, time the display
+// takes for a message and how many times slower it is made
+#define BENCH_FLOOD_CYCLES 1000
+#define BENCH_FLOOD_PERIOD 1000000LL
+#define BENCH_FLOOD_DISPLAY 20000LL
+#define BENCH_FLOOD_SLOWDOWN 100
+// patients of the idle ward test, one out of BENCH_IDLE_ACTIVE of them gets
+// a meal every cycle, cycles to let the others rest and cycles measured,
+// simulated seconds per cycle as CYCLE_TIME
+#define BENCH_IDLE_PATIENTS 10000
+#define BENCH_IDLE_ACTIVE 20
+#define BENCH_IDLE_SETTLE 300
+#define BENCH_IDLE_CYCLES 300
+#define BENCH_IDLE_CYCLE_S 0.5
+// patients of the statistics benchmark and glycemia samples of each one
+#define BENCH_STATS_PATIENTS 100000
+#define BENCH_STATS_SAMPLES 200
+
+struct TransportBench {
+    Channel *channel;
+    long long *sentNs;
+    int n;
+};
+
+// producer side of the transport benchmark, stamps every message at send
+void *benchSender(void *args) {
+    TransportBench *bench = (TransportBench *) args;
+    for (int i = 0; i < bench->n; ++i) {
+        Message msg = GLYCEMIA_NORMAL;
+        bench->sentNs[i] = monotonicNs();
+        if (bench->channel->send(&msg, sizeof(msg), NORMAL) == -1) {
+            std::cerr << "Error sending bench msg" << std::endl;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// messages/sec and p99 send to receive latency of one channel backend
+void benchChannel(const char *name, Transport transport, std::ostream &os) {
+    Channel *channel = openChannel(transport, "q_bench", MSG_MAX, MSG_SIZE);
+    long long *sentNs = new long long[BENCH_MESSAGES];
+    long long *latency = new long long[BENCH_MESSAGES];
+    TransportBench bench = {channel, sentNs, BENCH_MESSAGES};
+
+    long long start = monotonicNs();
+    pthread_t th_sender;
+    pthread_create(&th_sender, NULL, benchSender, &bench);
+    int received = 0;
+    for (; received < BENCH_MESSAGES; ++received) {
+        Message msg = NONE;
+        if (channel->receive(&msg, sizeof(msg)) == -1) {
+            std::cerr << "Error receiving bench msg" << std::endl;
+            break;
+        }
+        // messages of one priority are received in the order they were sent
+        latency[received] = monotonicNs() - sentNs[received];
+    }
+    long long duration = monotonicNs() - start;
+    pthread_join(th_sender, NULL);
+    CHECK(received == BENCH_MESSAGES, name << ": " << received << " of "
+            << BENCH_MESSAGES << " messages received");
+
+    if (received > 0) {
+        std::sort(latency, latency + received);
+        os << name << ": " << (long long) (received * 1e9 / duration)
+           << " msg/s, p50 " << latency[received / 2] << " ns, p99 "
+           << latency[received * 99 / 100] << " ns" << std::endl;
+    }
+    delete[] sentNs;
+    delete[] latency;
+    delete channel;
+}
+
+void benchTransport(std::ostream &os) {
+    benchChannel("mqueue", MQUEUE, os);
+    benchChannel("ring", RING, os);
+}
+
+// the patient state as it was protected before the atomic snapshot: the
+// reader takes both mutexes in a row, each writer takes one of them
+class LockedPatient {
+public:
+    LockedPatient() : glucose(63), insuline(0) {
+        pthread_mutex_init(&m_glucose, NULL);
+        pthread_mutex_init(&m_insuline, NULL);
+    }
+
+    ~LockedPatient() {
+        pthread_mutex_destroy(&m_glucose);
+        pthread_mutex_destroy(&m_insuline);
+    }
+
+    double computeGlycemia() {
+        pthread_mutex_lock(&m_glucose);
+        pthread_mutex_lock(&m_insuline);
+        double glycemia = Patient::Kg * glucose - Patient::Ki * insuline;
+        pthread_mutex_unlock(&m_insuline);
+        pthread_mutex_unlock(&m_glucose);
+        return glycemia;
+    }
+
+    void injectGlucose() {
+        pthread_mutex_lock(&m_glucose);
+        glucose += Patient::glucose_step;
+        pthread_mutex_unlock(&m_glucose);
+    }
+
+    void injectInsuline() {
+        pthread_mutex_lock(&m_insuline);
+        insuline += Patient::insuline_step;
+        pthread_mutex_unlock(&m_insuline);
+    }
+
+private:
+    pthread_mutex_t m_glucose;
+    pthread_mutex_t m_insuline;
+    int glucose;
+    int insuline;
+};
+
+template <typename P>
+struct PatientBench {
+    P *patient;
+    volatile bool stopping;
+    // operations done by each thread, index 0 is the reader
+    long long ops[9];
+    int next;
+};
+
+// injects glucose on even writers and insuline on odd ones until stopped
+template <typename P>
+void *benchInjector(void *args) {
+    PatientBench<P> *bench = (PatientBench<P> *) args;
+    int id = __sync_add_and_fetch(&bench->next, 1);
+    long long n = 0;
+    while (!bench->stopping) {
+        if (id % 2 == 0)
+            bench->patient->injectGlucose();
+        else
+            bench->patient->injectInsuline();
+        ++n;
+    }
+    bench->ops[id] = n;
+    return NULL;
+}
+
+template <typename P>
+void *benchReader(void *args) {
+    PatientBench<P> *bench = (PatientBench<P> *) args;
+    long long n = 0;
+    volatile double glycemia = 0;
+    while (!bench->stopping) {
+        glycemia = bench->patient->computeGlycemia();
+        ++n;
+    }
+    (void) glycemia;
+    bench->ops[0] = n;
+    return NULL;
+}
+
+// reads and injections per second with 1 reader and nWriters writers
+template <typename P>
+void benchContention(const char *name, int nWriters, std::ostream &os) {
+    P patient;
+    PatientBench<P> bench;
+    bench.patient = &patient;
+    bench.stopping = false;
+    bench.next = 0;
+
+    pthread_t threads[9];
+    pthread_create(&threads[0], NULL, benchReader<P>, &bench);
+    for (int i = 1; i <= nWriters; ++i)
+        pthread_create(&threads[i], NULL, benchInjector<P>, &bench);
+    long long start = monotonicNs();
+    usleep(BENCH_PATIENT_NS / 1000);
+    bench.stopping = true;
+    for (int i = 0; i <= nWriters; ++i)
+        pthread_join(threads[i], NULL);
+    long long duration = monotonicNs() - start;
+
+    long long injections = 0;
+    for (int i = 1; i <= nWriters; ++i)
+        injections += bench.ops[i];
+    os << name << ", 1 reader " << nWriters << " writers: "
+       << (long long) (bench.ops[0] * 1e9 / duration) << " reads/s, "
+       << (long long) (injections * 1e9 / duration) << " injections/s"
+       << std::endl;
+}
+
+void benchPatient(std::ostream &os) {
+    for (int nWriters = 2; nWriters <= 8; nWriters *= 2) {
+        benchContention<LockedPatient>("mutexes", nWriters, os);
+        benchContention<Patient>("snapshot", nWriters, os);
+    }
+}
+
+// patients per second of the kernel of step() and of the scalar one, the
+// two cohorts must end in the same state. Without AVX2 both run the scalar
+// loop
+void benchCohort(std::ostream &os) {
+    Cohort vector(BENCH_COHORT);
+    Cohort scalar(BENCH_COHORT);
+
+    long long start = monotonicNs();
+    for (int c = 0; c < BENCH_COHORT_CYCLES; ++c)
+        vector.step();
+    long long vectorNs = monotonicNs() - start;
+
+    start = monotonicNs();
+    for (int c = 0; c < BENCH_COHORT_CYCLES; ++c)
+        scalar.stepScalar(0, BENCH_COHORT);
+    long long scalarNs = monotonicNs() - start;
+
+    int mismatches = 0;
+    for (int k = 0; k < BENCH_COHORT; ++k) {
+        if (vector.glucose[k] != scalar.glucose[k]
+                || vector.insuline[k] != scalar.insuline[k]
+                || vector.level[k] != scalar.level[k]
+                || vector.active[k] != scalar.active[k])
+            ++mismatches;
+    }
+
+    double steps = (double) BENCH_COHORT * BENCH_COHORT_CYCLES;
+#if defined(__AVX2__)
+    const char *kernel = "avx2";
+#else
+    const char *kernel = "scalar";
+#endif
+    os << "cohort of " << BENCH_COHORT << ": step (" << kernel << ") "
+       << (long long) (steps * 1e9 / vectorNs) << " patients/s, scalar "
+       << (long long) (steps * 1e9 / scalarNs) << " patients/s, "
+       << mismatches << " mismatches" << std::endl;
+}
+
+// patients per second of a model evaluated for a whole cohort
+void benchModelThroughput(const char *name, GlycemiaModel *model,
+        std::ostream &os) {
+    Cohort cohort(BENCH_COHORT);
+    cohort.setModel(model, BENCH_MODEL_DT);
+
+    long long start = monotonicNs();
+    for (int c = 0; c < BENCH_COHORT_CYCLES; ++c)
+        cohort.step();
+    long long duration = monotonicNs() - start;
+
+    double steps = (double) BENCH_COHORT * BENCH_COHORT_CYCLES;
+    os << name << ": " << (long long) (steps * 1e9 / duration)
+       << " patients/s, " << (long long) (steps * 50e6 / duration)
+       << " patients in a 50 ms cycle" << std::endl;
+}
+
+// patients per second of the vector and scalar kernels of the Bergman
+// model fed the same doses, and the largest difference of their glycemia
+void benchBergmanKernels(std::ostream &os) {
+    BergmanModel vector(BENCH_COHORT);
+    BergmanModel scalar(BENCH_COHORT);
+    int *glucose = new int[BENCH_COHORT];
+    int *insuline = new int[BENCH_COHORT];
+    double *vectorGlycemia = new double[BENCH_COHORT];
+    double *scalarGlycemia = new double[BENCH_COHORT];
+    for (int k = 0; k < BENCH_COHORT; ++k)
+        glucose[k] = insuline[k] = 0;
+
+    long long vectorNs = 0, scalarNs = 0;
+    double difference = 0;
+    for (int c = 0; c < BENCH_MODEL_CYCLES; ++c) {
+        // a dose every few cycles, shifted from one patient to the next
+        for (int k = 0; k < BENCH_COHORT; ++k) {
+            if ((c + k) % 3 == 0)
+                ++insuline[k];
+            if ((c + k) % 5 == 0)
+                ++glucose[k];
+        }
+        long long start = monotonicNs();
+        vector.evaluate(BENCH_COHORT, glucose, insuline, BENCH_MODEL_DT,
+                vectorGlycemia);
+        vectorNs += monotonicNs() - start;
+        start = monotonicNs();
+        scalar.evaluateScalar(BENCH_COHORT, glucose, insuline,
+                BENCH_MODEL_DT, scalarGlycemia);
+        scalarNs += monotonicNs() - start;
+        for (int k = 0; k < BENCH_COHORT; ++k)
+            difference = std::max(difference,
+                    fabs(vectorGlycemia[k] - scalarGlycemia[k]));
+    }
+
+    double steps = (double) BENCH_COHORT * BENCH_MODEL_CYCLES;
+    os << "bergman rk4 kernels: vector "
+       << (long long) (steps * 1e9 / vectorNs) << " patients/s, scalar "
+       << (long long) (steps * 1e9 / scalarNs) << " patients/s, "
+       << "largest difference " << difference << " mg/dL" << std::endl;
+    delete[] glucose;
+    delete[] insuline;
+    delete[] vectorGlycemia;
+    delete[] scalarGlycemia;
+}
+
+// derivative of the Bergman model as BergmanModel writes it, for the
+// reference solutions
+void benchBergmanDerivative(const BergmanParams &p, const double *z,
+        double ra, double u, double *dz) {
+    dz[0] = -(p.p1 + z[1]) * z[0] + p.p1 * p.Gb + ra;
+    dz[1] = -p.p2 * z[1] + p.p3 * (z[2] - p.Ib);
+    dz[2] = z[4] / (p.tmax * p.VI) - p.clearance * (z[2] - p.Ib);
+    dz[3] = u - z[3] / p.tmax;
+    dz[4] = (z[3] - z[4]) / p.tmax;
+}
+
+// advance z by the minutes with the Dormand-Prince 5(4) pair, the step
+// adapted to a relative error of 1e-10 per step
+void benchDormandPrince(const BergmanParams &p, double *z, double ra,
+        double u, double minutes) {
+    static const double a[7][6] = {
+        { 0 },
+        { 1.0 / 5 },
+        { 3.0 / 40, 9.0 / 40 },
+        { 44.0 / 45, -56.0 / 15, 32.0 / 9 },
+        { 19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729 },
+        { 9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176,
+          -5103.0 / 18656 },
+        { 35.0 / 384, 0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784,
+          11.0 / 84 },
+    };
+    // 5th order weights minus the 4th order ones
+    static const double e[7] = {
+        35.0 / 384 - 5179.0 / 57600, 0, 500.0 / 1113 - 7571.0 / 16695,
+        125.0 / 192 - 393.0 / 640, -2187.0 / 6784 + 92097.0 / 339200,
+        11.0 / 84 - 187.0 / 2100, -1.0 / 40
+    };
+    double h = minutes;
+    double done = 0;
+    while (done < minutes) {
+        if (done + h > minutes)
+            h = minutes - done;
+        double k[7][BERGMAN_STATES], t[BERGMAN_STATES];
+        benchBergmanDerivative(p, z, ra, u, k[0]);
+        for (int s = 1; s < 7; ++s) {
+            for (int v = 0; v < BERGMAN_STATES; ++v) {
+                t[v] = z[v];
+                for (int j = 0; j < s; ++j)
+                    t[v] += h * a[s][j] * k[j][v];
+            }
+            benchBergmanDerivative(p, t, ra, u, k[s]);
+        }
+        // t is the 5th order solution, the error is against the 4th order
+        double error = 0;
+        for (int v = 0; v < BERGMAN_STATES; ++v) {
+            double d = 0;
+            for (int s = 0; s < 7; ++s)
+                d += h * e[s] * k[s][v];
+            error = std::max(error, fabs(d) / (1e-12 + 1e-10 * fabs(t[v])));
+        }
+        if (error <= 1) {
+            for (int v = 0; v < BERGMAN_STATES; ++v)
+                z[v] = t[v];
+            done += h;
+        }
+        h *= std::min(5.0, std::max(0.2,
+                    0.9 * pow(error > 1e-30 ? error : 1e-30, -0.2)));
+    }
+}
+
+// advance the linear insuline compartments S1, S2 and I of z by the
+// minutes in closed form, the insuline infusion u being constant
+void benchInsulineExact(const BergmanParams &p, double *z, double u,
+        double minutes) {
+    double a = 1 / p.tmax;
+    double b = 1 / (p.tmax * p.VI);
+    double c = p.clearance;
+    double d = c - a;
+    // distances to the steady state of the infusion
+    double s1 = z[3] - u / a;
+    double s2 = z[4] - u / a;
+    double i = z[2] - p.Ib - b * u / (a * c);
+    double ea = exp(-a * minutes), ec = exp(-c * minutes);
+    double slope = a * s1;
+    z[3] = u / a + s1 * ea;
+    z[4] = u / a + (s2 + slope * minutes) * ea;
+    z[2] = p.Ib + b * u / (a * c) + i * ec
+        + b * (((s2 + slope * minutes) / d - slope / (d * d)) * ea
+               - (s2 / d - slope / (d * d)) * ec);
+}
+
+// largest errors of the Bergman model evaluated every dt seconds, against
+// solutions that do not use its RK4: the insuline in closed form and the
+// glycemia from an adaptive Dormand-Prince integration. The patient gets
+// one insuline dose a minute during the first hour and one glucose dose a
+// minute during the second one
+void benchModelAccuracy(double dt, std::ostream &os) {
+    BergmanParams p = bergmanDefaults();
+    BergmanModel model(1, dt, p);
+    double reference[BERGMAN_STATES] = { p.Gb, 0, p.Ib, 0, 0 };
+    double exact[BERGMAN_STATES] = { p.Gb, 0, p.Ib, 0, 0 };
+    int glucose = 0, insuline = 0, lastGlucose = 0, lastInsuline = 0;
+    double glycemiaError = 0, insulineError = 0, referenceError = 0;
+    double minutes = dt / 60;
+
+    for (double t = 0; t < 4 * 3600; t += dt) {
+        if (t < 3600)
+            insuline = (int) (t / 60);
+        else if (t < 2 * 3600)
+            glucose = (int) ((t - 3600) / 60);
+        double glycemia = 0;
+        model.evaluate(1, &glucose, &insuline, dt, &glycemia);
+
+        double ra = (glucose - lastGlucose) * p.glucoseDose / p.VG / minutes;
+        double u = (insuline - lastInsuline) * p.insulineDose / minutes;
+        lastGlucose = glucose;
+        lastInsuline = insuline;
+        benchDormandPrince(p, reference, ra, u, minutes);
+        benchInsulineExact(p, exact, u, minutes);
+
+        glycemiaError = std::max(glycemiaError,
+                fabs(glycemia - reference[0]));
+        insulineError = std::max(insulineError,
+                fabs(model.state(2, 0) - exact[2]));
+        referenceError = std::max(referenceError,
+                fabs(reference[2] - exact[2]));
+    }
+    os << "bergman rk4, dt " << dt << " s, over 4 h: glycemia within "
+       << glycemiaError << " mg/dL of dormand-prince, insuline within "
+       << insulineError << " mU/L of the closed form (dormand-prince "
+       << referenceError << ")" << std::endl;
+}
+
+void benchModel(std::ostream &os) {
+    LinearModel linear;
+    benchModelThroughput("linear", &linear, os);
+    BergmanModel bergman(BENCH_COHORT);
+    benchModelThroughput("bergman rk4", &bergman, os);
+    benchBergmanKernels(os);
+
+    benchModelAccuracy(BENCH_MODEL_DT, os);
+    benchModelAccuracy(60, os);
+    benchModelAccuracy(300, os);
+}
+
+// the syringe observer as it was before the thresholds: a condvar signaled
+// after every pump, the observer checks the level at each wakeup
+struct SignaledSyringe {
+    pthread_mutex_t m_syringe;
+    pthread_cond_t cv_syringe;
+    double level;
+    bool stopped;
+    long wakeups;
+};
+
+void *benchSignaledObserver(void *args) {
+    SignaledSyringe *s = (SignaledSyringe *) args;
+    pthread_mutex_lock(&s->m_syringe);
+    while (!s->stopped) {
+        pthread_cond_wait(&s->cv_syringe, &s->m_syringe);
+        ++s->wakeups;
+        if (s->level == Syringe::level_critical)
+            s->level = 100;
+    }
+    pthread_mutex_unlock(&s->m_syringe);
+    return NULL;
+}
+
+struct ObservedSyringe {
+    Syringe *syringe;
+    int id;
+};
+
+void *benchThresholdObserver(void *args) {
+    ObservedSyringe *o = (ObservedSyringe *) args;
+    Syringe::Crossing crossing;
+    while (o->syringe->waitCrossing(o->id, crossing)) {
+        if (crossing.threshold == Syringe::level_critical) {
+            o->syringe->syringeSwitch();
+            o->syringe->reset();
+        }
+    }
+    return NULL;
+}
+
+// wakeups of the syringe observer per pump, with a signal per pump and with
+// the threshold subscription of t_syringe
+void benchSyringe(std::ostream &os) {
+    SignaledSyringe signaled;
+    pthread_mutex_init(&signaled.m_syringe, NULL);
+    pthread_cond_init(&signaled.cv_syringe, NULL);
+    signaled.level = 100;
+    signaled.stopped = false;
+    signaled.wakeups = 0;
+    pthread_t th_observer;
+    pthread_create(&th_observer, NULL, benchSignaledObserver, &signaled);
+    for (int i = 0; i < BENCH_PUMPS; ++i) {
+        usleep(BENCH_PUMP_US);
+        pthread_mutex_lock(&signaled.m_syringe);
+        signaled.level -= Syringe::s_step;
+        pthread_cond_signal(&signaled.cv_syringe);
+        pthread_mutex_unlock(&signaled.m_syringe);
+    }
+    pthread_mutex_lock(&signaled.m_syringe);
+    signaled.stopped = true;
+    pthread_cond_signal(&signaled.cv_syringe);
+    pthread_mutex_unlock(&signaled.m_syringe);
+    pthread_join(th_observer, NULL);
+    pthread_mutex_destroy(&signaled.m_syringe);
+    pthread_cond_destroy(&signaled.cv_syringe);
+    os << "signal per pump: " << BENCH_PUMPS << " pumps, "
+       << signaled.wakeups << " wakeups, "
+       << (double) signaled.wakeups / BENCH_PUMPS << " per pump" << std::endl;
+
+    Syringe syringe;
+    double thresholds[] = { Syringe::level_weak, Syringe::level_critical };
+    ObservedSyringe observed = { &syringe, syringe.subscribe(thresholds, 2) };
+    pthread_create(&th_observer, NULL, benchThresholdObserver, &observed);
+    for (int i = 0; i < BENCH_PUMPS; ++i) {
+        usleep(BENCH_PUMP_US);
+        syringe.pump();
+    }
+    syringe.stop();
+    pthread_join(th_observer, NULL);
+    long wakeups = syringe.wakeupCount(observed.id);
+    os << "thresholds: " << syringe.pumpCount() << " pumps, "
+       << wakeups << " wakeups, "
+       << (double) wakeups / syringe.pumpCount() << " per pump" << std::endl;
+}
+
+struct BankStress {
+    SyringeBank *bank;
+    volatile bool stopping;
+    long doses[BENCH_PUMPERS];
+    long dry;
+    int next;
+};
+
+// pumps BENCH_DOSES doses, counting the ones the bank says it gave
+void *benchPumper(void *args) {
+    BankStress *stress = (BankStress *) args;
+    int id = __sync_fetch_and_add(&stress->next, 1);
+    long doses = 0;
+    while (doses < BENCH_DOSES) {
+        if (stress->bank->pump() >= 0)
+            ++doses;
+        else {
+            // let the nurse refill the bank
+            __sync_fetch_and_add(&stress->dry, 1);
+            sched_yield();
+        }
+    }
+    stress->doses[id] = doses;
+    return NULL;
+}
+
+// refills the empty cartridges and forces switches while the pumps run
+void *benchNurse(void *args) {
+    BankStress *stress = (BankStress *) args;
+    SyringeBank *bank = stress->bank;
+    unsigned i = 0;
+    while (!stress->stopping) {
+        int c = i++ % bank->size();
+        if (bank->level(c) == 0)
+            bank->reset(c);
+        if (i % 64 == 0)
+            bank->switchCartridge(bank->activeCartridge());
+        sched_yield();
+    }
+    return NULL;
+}
+
+// hammer pump/switch/reset from several threads and check that the doses
+// the pumps got are exactly the doses drawn from the cartridges
+void benchBankPolicy(const char *name, SelectionPolicy *policy,
+        std::ostream &os) {
+    SyringeBank bank(BENCH_CARTRIDGES, 100, policy);
+    BankStress stress;
+    stress.bank = &bank;
+    stress.stopping = false;
+    stress.dry = 0;
+    stress.next = 0;
+
+    long long start = monotonicNs();
+    pthread_t th_nurse, th_pumpers[BENCH_PUMPERS];
+    pthread_create(&th_nurse, NULL, benchNurse, &stress);
+    for (int i = 0; i < BENCH_PUMPERS; ++i)
+        pthread_create(&th_pumpers[i], NULL, benchPumper, &stress);
+    for (int i = 0; i < BENCH_PUMPERS; ++i)
+        pthread_join(th_pumpers[i], NULL);
+    long long duration = monotonicNs() - start;
+    stress.stopping = true;
+    pthread_join(th_nurse, NULL);
+
+    long doses = 0;
+    for (int i = 0; i < BENCH_PUMPERS; ++i)
+        doses += stress.doses[i];
+    long drawn = bank.drawn();
+    os << name << ": " << doses << " doses pumped, " << drawn
+       << " drawn, " << bank.switchCount() << " switches, " << stress.dry
+       << " dry pumps, " << (long long) (doses * 1e9 / duration)
+       << " pumps/s" << (doses == drawn ? "" : ", MISMATCH") << std::endl;
+}
+
+void benchBank(std::ostream &os) {
+    benchBankPolicy("round robin", NULL, os);
+    FullestFirst fullest;
+    benchBankPolicy("fullest first", &fullest, os);
+}
+
+struct TimerBench {
+    TimerService *service;
+    long long *jitter;
+    long n;
+    long max;
+};
+
+// records how late the dose fired, runs on the timer thread
+void benchDose(void *args, long long time) {
+    TimerBench *bench = (TimerBench *) args;
+    if (bench->n < bench->max)
+        bench->jitter[bench->n++] = bench->service->elapsed() - time;
+}
+
+struct BoundaryTimer {
+    // expiry expected for the next call, and its period
+    long long due;
+    long long interval;
+    long long fired;
+    long n;
+    long late;
+};
+
+// checks the timer fires on the tick it was due
+void benchBoundaryDose(void *args, long long time) {
+    BoundaryTimer *timer = (BoundaryTimer *) args;
+    if (time != timer->due)
+        ++timer->late;
+    timer->fired = time;
+    timer->due += timer->interval;
+    ++timer->n;
+}
+
+// timers due on the level boundaries of a wheel, 64 and 4096 ticks, and a
+// periodic one on every other boundary of the first level, on a virtual
+// clock of one tick per nanosecond. Each must fire on its own tick
+void benchTimerBoundaries(std::ostream &os) {
+    TimerWheel wheel(1);
+    Timer timers[3];
+    BoundaryTimer bench[3] = {
+        { WHEEL_SLOTS, 0, -1, 0, 0 },
+        { WHEEL_SLOTS * WHEEL_SLOTS, 0, -1, 0, 0 },
+        { BENCH_BOUNDARY_PERIOD, BENCH_BOUNDARY_PERIOD, -1, 0, 0 },
+    };
+    for (int i = 0; i < 3; ++i)
+        wheel.schedule(&timers[i], bench[i].due, bench[i].interval,
+                benchBoundaryDose, &bench[i]);
+
+    wheel.advance(WHEEL_SLOTS);
+    bool first = bench[0].n == 1;
+    wheel.advance(WHEEL_SLOTS * WHEEL_SLOTS);
+    bool second = bench[1].n == 1;
+    wheel.advance(BENCH_BOUNDARY_END);
+    wheel.cancel(&timers[2]);
+
+    long periods = BENCH_BOUNDARY_END / BENCH_BOUNDARY_PERIOD;
+    os << "boundaries: due at " << WHEEL_SLOTS << " fired at "
+       << bench[0].fired << ", due at " << WHEEL_SLOTS * WHEEL_SLOTS
+       << " fired at " << bench[1].fired << ", every "
+       << BENCH_BOUNDARY_PERIOD << " ticks " << bench[2].n << " of "
+       << periods << " expiries, " << bench[2].late << " late" << std::endl;
+    CHECK(first && second && bench[0].late + bench[1].late == 0,
+            "timers due on a level boundary fired late");
+    CHECK(bench[2].n == periods && bench[2].late == 0,
+            "periodic timer on the level boundaries drifted");
+}
+
+// schedule BENCH_TIMERS recurring doses at random offsets on one timer
+// thread, report the cost of schedule/cancel and the expiry jitter. The
+// boundary cases run first on a virtual clock
+void benchTimers(std::ostream &os) {
+    benchTimerBoundaries(os);
+    Timer *timers = new Timer[BENCH_TIMERS];
+    long max = BENCH_TIMERS * (BENCH_TIMER_NS / BENCH_TIMER_INTERVAL + 1);
+    TimerService service(1000000);
+    TimerBench bench = { &service, new long long[max], 0, max };
+
+    unsigned rng = 1;
+    long long start = monotonicNs();
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        service.schedule(&timers[i], rng % BENCH_TIMER_INTERVAL,
+                BENCH_TIMER_INTERVAL, benchDose, &bench);
+    }
+    long long scheduleNs = monotonicNs() - start;
+
+    usleep(BENCH_TIMER_NS / 1000);
+
+    start = monotonicNs();
+    for (int i = 0; i < BENCH_TIMERS; ++i)
+        service.cancel(&timers[i]);
+    long long cancelNs = monotonicNs() - start;
+
+    // the doses are cancelled, the timer thread does not write any more
+    long n = bench.n;
+    os << "schedule " << scheduleNs / BENCH_TIMERS << " ns, cancel "
+       << cancelNs / BENCH_TIMERS << " ns per timer" << std::endl;
+    if (n > 0) {
+        std::sort(bench.jitter, bench.jitter + n);
+        os << n << " expiries, jitter p50 " << bench.jitter[n / 2]
+           << " ns, p99 " << bench.jitter[n * 99 / 100] << " ns, max "
+           << bench.jitter[n - 1] << " ns" << std::endl;
+    }
+    delete[] bench.jitter;
+    delete[] timers;
+}
+
+struct TelemetryBench {
+    Telemetry *telemetry;
+    long long ns;
+};
+
+// records the queue residency of stamped messages, like t_display does
+void *benchRecorder(void *args) {
+    TelemetryBench *bench = (TelemetryBench *) args;
+    long long start = monotonicNs();
+    for (int i = 0; i < BENCH_RECORDS; ++i)
+        bench->telemetry->received(NORMAL, monotonicNs());
+    bench->ns = monotonicNs() - start;
+    return NULL;
+}
+
+// cost of one telemetry update, a stamp and a histogram record, with 1 to 4
+// tasks updating the same histogram
+void benchTelemetry(std::ostream &os) {
+    Telemetry *telemetry = new Telemetry;
+    for (int nThreads = 1; nThreads <= 4; nThreads *= 2) {
+        TelemetryBench bench[4];
+        pthread_t th_recorders[4];
+        for (int i = 0; i < nThreads; ++i) {
+            bench[i].telemetry = telemetry;
+            pthread_create(&th_recorders[i], NULL, benchRecorder, &bench[i]);
+        }
+        long long ns = 0;
+        for (int i = 0; i < nThreads; ++i) {
+            pthread_join(th_recorders[i], NULL);
+            ns += bench[i].ns;
+        }
+        os << nThreads << " tasks: " << ns / nThreads / BENCH_RECORDS
+           << " ns per update" << std::endl;
+    }
+    os << "p50 " << telemetry->residency[NORMAL].percentile(0.5)
+       << " ns, p99 " << telemetry->residency[NORMAL].percentile(0.99)
+       << " ns between stamp and record" << std::endl;
+    delete telemetry;
+}
+
+struct LogBench {
+    EventLog *log;
+    std::ostream *os;
+    long long ns;
+};
+
+// logs BENCH_EVENTS events in binary records, a buffer at a time. Only the
+// time spent in log() is counted, not the waits for the writer
+void *benchBinaryLogger(void *args) {
+    LogBench *bench = (LogBench *) args;
+    bench->ns = 0;
+    for (int i = 0; i < BENCH_EVENTS; i += LOG_BUFFER) {
+        long long start = monotonicNs();
+        for (int j = i; j < i + LOG_BUFFER && j < BENCH_EVENTS; ++j)
+            bench->log->log(j, GLYCEMIA_NORMAL, 120);
+        bench->ns += monotonicNs() - start;
+        usleep(2 * LOG_FLUSH_NS / 1000);
+    }
+    return NULL;
+}
+
+// prints BENCH_EVENTS events as t_display did
+void *benchTextLogger(void *args) {
+    LogBench *bench = (LogBench *) args;
+    long long start = monotonicNs();
+    for (int i = 0; i < BENCH_EVENTS; ++i)
+        *bench->os << messageText(GLYCEMIA_NORMAL) << std::endl;
+    bench->ns = monotonicNs() - start;
+    return NULL;
+}
+
+// ns per event of the binary log and of the text with a flush per line, one
+// thread each, to /dev/null so only the producer side is measured
+void benchLog(std::ostream &os) {
+    EventLog *log = new EventLog("/dev/null");
+    std::ofstream devnull("/dev/null");
+    LogBench bench = { log, &devnull, 0 };
+    pthread_t th_logger;
+    pthread_create(&th_logger, NULL, benchBinaryLogger, &bench);
+    pthread_join(th_logger, NULL);
+    os << "binary: " << bench.ns / BENCH_EVENTS << " ns per event, "
+       << log->dropCount() << " dropped" << std::endl;
+    delete log;
+
+    pthread_create(&th_logger, NULL, benchTextLogger, &bench);
+    pthread_join(th_logger, NULL);
+    os << "text: " << bench.ns / BENCH_EVENTS << " ns per event" << std::endl;
+}
+
+struct FrameBench {
+    Channel *channel;
+    size_t eventSize;
+    int perSend;
+};
+
+// sends BENCH_MESSAGES events, perSend of them in each message
+void *benchFrameSender(void *args) {
+    FrameBench *bench = (FrameBench *) args;
+    char msg[MSG_SIZE];
+    memset(msg, 0, sizeof(msg));
+    for (int i = 0; i < BENCH_MESSAGES; i += bench->perSend) {
+        if (bench->channel->send(msg, bench->perSend * bench->eventSize,
+                    NORMAL) == -1) {
+            std::cerr << "Error sending bench msg" << std::endl;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// events per second, channel calls per event and bytes per event of the
+// display channel with messages of msgsize bytes carrying perSend events of
+// eventSize bytes. Each call is a system call on an mqueue
+void benchFrameFormat(const char *name, Transport transport, long msgsize,
+        size_t eventSize, int perSend, std::ostream &os) {
+    Channel *channel = openChannel(transport, "q_bench", MSG_MAX, msgsize);
+    FrameBench bench = { channel, eventSize, perSend };
+    char *msg = new char[msgsize];
+
+    long long start = monotonicNs();
+    pthread_t th_sender;
+    pthread_create(&th_sender, NULL, benchFrameSender, &bench);
+    long events = 0, receives = 0;
+    while (events < BENCH_MESSAGES) {
+        int r = channel->receive(msg, msgsize);
+        if (r == -1) {
+            std::cerr << "Error receiving bench msg" << std::endl;
+            break;
+        }
+        events += r / eventSize;
+        ++receives;
+    }
+    long long duration = monotonicNs() - start;
+    pthread_join(th_sender, NULL);
+    CHECK(events == BENCH_MESSAGES, name << ": " << events << " of "
+            << BENCH_MESSAGES << " events received");
+
+    if (events > 0) {
+        // one send per message sent and one receive per message received
+        os << (transport == RING ? "ring " : "mqueue ") << name << ": "
+           << (long long) (events * 1e9 / duration) << " events/s, "
+           << 2.0 * receives / events << " calls per event, " << eventSize
+           << " bytes per event, "
+           << msgsize / perSend << " bytes of queue per event" << std::endl;
+    }
+    delete[] msg;
+    delete channel;
+}
+
+// the display channel with one Message per 4096 bytes message, and with
+// batches of frames in messages of MSG_SIZE, on both backends
+void benchFrames(std::ostream &os) {
+    static const Transport transports[] = { MQUEUE, RING };
+    for (int t = 0; t < 2; ++t) {
+        benchFrameFormat("message", transports[t], BENCH_OLD_MSG_SIZE,
+                sizeof(Message), 1, os);
+        benchFrameFormat("frame", transports[t], MSG_SIZE, sizeof(Frame), 1,
+                os);
+        benchFrameFormat("frame batch", transports[t], MSG_SIZE,
+                sizeof(Frame), FRAME_BATCH, os);
+    }
+}
+
+// run one simulated hour, return the actuator trace and add the commands
+// sent by the controller to sent
+unsigned long long benchTrigger(unsigned seed, bool edge, int heartbeat,
+        long &sent) {
+    std::ostream null(NULL);
+    Simulation sim(BENCH_EDGE_PERIOD, BENCH_EDGE_CYCLES, seed, null);
+    Bed *bed = sim.patientBed();
+    bed->setTrigger(edge, heartbeat);
+    sim.run();
+    sent += bed->glucoseOut.sentCount() + bed->insulineOut.sentCount()
+        + bed->alarmOut.sentCount();
+    return sim.actuatorTrace();
+}
+
+// commands per simulated hour of the level and edge triggered controller,
+// and check that the pumps injected at the same times in both modes
+void benchEdge(std::ostream &os) {
+    long level = 0, edge = 0, beat = 0;
+    int mismatches = 0;
+    for (unsigned seed = 0; seed < BENCH_EDGE_SEEDS; ++seed) {
+        unsigned long long reference = benchTrigger(seed, false, 0, level);
+        if (benchTrigger(seed, true, 0, edge) != reference)
+            ++mismatches;
+        if (benchTrigger(seed, true, BENCH_EDGE_HEARTBEAT, beat) != reference)
+            ++mismatches;
+    }
+    os << "level: " << level / BENCH_EDGE_SEEDS << " commands/h, edge: "
+       << edge / BENCH_EDGE_SEEDS << " commands/h, edge + heartbeat: "
+       << beat / BENCH_EDGE_SEEDS << " commands/h, " << mismatches
+       << " actuator mismatches" << std::endl;
+}
+
+// glycemias between 40 and 140 with the steps of the pumps, the same on
+// every platform
+void benchGlycemias(double *glycemia) {
+    unsigned rng = 1;
+    double g = 90;
+    for (int k = 0; k < BENCH_GLYCEMIAS; ++k) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        g += rng % 2 ? Patient::Kg : -Patient::Ki;
+        if (g < 40 || g > 140)
+            g = 90;
+        glycemia[k] = g;
+    }
+}
+
+// ns per decision of Controller<P>, the decision inlined in the loop
+template <typename P>
+double benchDecide(const double *glycemia) {
+    Controller<P> controller;
+    int sink = 0;
+    long long start = monotonicNs();
+    for (int k = 0; k < BENCH_DECISIONS; ++k) {
+        Decision d = controller.decide(glycemia[k & (BENCH_GLYCEMIAS - 1)]);
+        sink += d.glucose + d.insuline + d.alarm;
+    }
+    long long duration = monotonicNs() - start;
+    volatile int keep = sink;
+    (void) keep;
+    return (double) duration / BENCH_DECISIONS;
+}
+
+// the same controller behind a virtual call, the dispatch Controller<P>
+// avoids
+class VirtualPolicy {
+public:
+    virtual ~VirtualPolicy() {}
+    virtual Decision decide(double glycemia) = 0;
+};
+
+template <typename P>
+class VirtualController : public VirtualPolicy {
+public:
+    Decision decide(double glycemia) { return controller.decide(glycemia); }
+
+private:
+    Controller<P> controller;
+};
+
+double benchVirtualDecide(VirtualPolicy *policy, const double *glycemia) {
+    int sink = 0;
+    long long start = monotonicNs();
+    for (int k = 0; k < BENCH_DECISIONS; ++k) {
+        Decision d = policy->decide(glycemia[k & (BENCH_GLYCEMIAS - 1)]);
+        sink += d.glucose + d.insuline + d.alarm;
+    }
+    long long duration = monotonicNs() - start;
+    volatile int keep = sink;
+    (void) keep;
+    return (double) duration / BENCH_DECISIONS;
+}
+
+// cost of one decision of each policy, inlined and through a virtual call
+void benchDecision(std::ostream &os) {
+    static double (*const inlined[POLICIES])(const double *) = {
+        benchDecide<BangBang>,
+        benchDecide<Hysteresis>,
+        benchDecide<Pid>,
+        benchDecide<Predictive>,
+    };
+    VirtualPolicy *virtuals[POLICIES] = {
+        new VirtualController<BangBang>(),
+        new VirtualController<Hysteresis>(),
+        new VirtualController<Pid>(),
+        new VirtualController<Predictive>(),
+    };
+    double *glycemia = new double[BENCH_GLYCEMIAS];
+    benchGlycemias(glycemia);
+    for (int id = 0; id < POLICIES; ++id) {
+        double direct = inlined[id](glycemia);
+        double dispatched = benchVirtualDecide(virtuals[id], glycemia);
+        os << policyName(id) << ": " << direct << " ns/decision, "
+           << dispatched << " ns/decision with a virtual call" << std::endl;
+        delete virtuals[id];
+    }
+    delete[] glycemia;
+}
+
+// run a bed one hour with the controller step of policy id, with a meal of
+// BENCH_MEAL_STEPS glucose steps every BENCH_MEAL_CYCLES cycles, and print
+// the glycemia it kept and the pump switches it took
+void benchScenario(int id, std::ostream &os) {
+    Bed bed;
+    double minimum = 0, maximum = 0, sum = 0;
+    long inRange = 0, critical = 0, switches = 0;
+    for (int c = 0; c < BENCH_SCENARIO_CYCLES; ++c) {
+        if (c > 0 && c % BENCH_MEAL_CYCLES == 0) {
+            for (int k = 0; k < BENCH_MEAL_STEPS; ++k)
+                bed.patient.injectGlucose();
+        }
+        policySteps[id](&bed);
+        syringeStep(&bed);
+        glucoseStep(&bed);
+        insulineStep(&bed);
+        for (int e = 0; e < bed.nEvents; ++e) {
+            Message msg = bed.events[e].msg;
+            if (msg == GLUCOSE_START || msg == GLUCOSE_STOP
+                    || msg == INSULINE_START || msg == INSULINE_STOP)
+                ++switches;
+        }
+        displayStep(&bed);
+
+        double glycemia = bed.patient.computeGlycemia();
+        if (c == 0 || glycemia < minimum)
+            minimum = glycemia;
+        if (c == 0 || glycemia > maximum)
+            maximum = glycemia;
+        sum += glycemia;
+        if (glycemia <= Patient::glycemia_crit)
+            ++critical;
+        else if (glycemia < Patient::glycemia_ref)
+            ++inRange;
+    }
+    bed.sManager.stop();
+    os << policyName(id) << ": glycemia min " << minimum << " mean "
+       << sum / BENCH_SCENARIO_CYCLES << " max " << maximum << ", "
+       << 100.0 * inRange / BENCH_SCENARIO_CYCLES << "% in range, "
+       << critical << " critical cycles, " << switches << " pump switches/h, "
+       << bed.glucoseOut.sentCount() + bed.insulineOut.sentCount()
+       << " pump commands/h" << std::endl;
+}
+
+// every policy on the same patient and meals
+void benchPolicies(std::ostream &os) {
+    for (int id = 0; id < POLICIES; ++id)
+        benchScenario(id, os);
+}
+
+// records BENCH_TRACE_RECORDS injections as fast as possible
+void *benchTracer(void *args) {
+    TraceRecorder *recorder = (TraceRecorder *) args;
+    for (int i = 1; i <= BENCH_TRACE_RECORDS; ++i)
+        recorder->record(TRACE_GLUCOSE, 0, 0, i, 0, 0);
+    return NULL;
+}
+
+// cost of a record from several threads, then speed of a sequential read
+// of the trace through the mapped window
+void benchTrace(std::ostream &os) {
+    TraceRecorder *recorder = new TraceRecorder(BENCH_TRACE_PATH, 0, false, 0);
+    pthread_t threads[BENCH_TRACE_THREADS];
+    long long start = monotonicNs();
+    for (int t = 0; t < BENCH_TRACE_THREADS; ++t)
+        pthread_create(&threads[t], NULL, benchTracer, recorder);
+    for (int t = 0; t < BENCH_TRACE_THREADS; ++t)
+        pthread_join(threads[t], NULL);
+    long long total = (long long) BENCH_TRACE_RECORDS * BENCH_TRACE_THREADS;
+    long long duration = monotonicNs() - start;
+    os << "record: " << BENCH_TRACE_THREADS << " threads, "
+       << (long long) (total * 1e9 / duration)
+       << " records/s, " << recorder->dropCount() << " dropped" << std::endl;
+    delete recorder;
+
+    TraceReader reader(BENCH_TRACE_PATH);
+    long long sum = 0;
+    start = monotonicNs();
+    const TraceRecord *r;
+    while ((r = reader.next()) != NULL)
+        sum += r->a;
+    duration = monotonicNs() - start;
+    // every thread recorded 1 to BENCH_TRACE_RECORDS
+    bool complete = sum == (long long) BENCH_TRACE_THREADS
+        * BENCH_TRACE_RECORDS / 2 * (BENCH_TRACE_RECORDS + 1);
+    os << "replay: " << reader.tell() << " records, "
+       << (long long) (reader.tell() * 1e9 / duration) << " records/s, "
+       << (long long) (reader.tell() * sizeof(TraceRecord) * 1e3 / duration)
+       << " MB/s, " << (complete ? "complete" : "records missing")
+       << std::endl;
+    unlink(BENCH_TRACE_PATH);
+}
+
+struct LiveBench {
+    LiveState *live;
+    Histogram *jitter;
+    volatile bool stopping;
+    long reads;
+    int retries;
+};
+
+// a controller publishing the state of one patient every period
+void *benchPublisher(void *args) {
+    LiveBench *bench = (LiveBench *) args;
+    Patient patient;
+    Syringe syringe;
+    PeriodicTask task(BENCH_LIVE_PERIOD, SKIP, bench->jitter);
+    for (int i = 0; i < BENCH_LIVE_CYCLES; ++i) {
+        task.wait();
+        patient.injectGlucose();
+        bench->live->publish(0, liveSnapshot(patient, syringe));
+    }
+    task.finish();
+    return NULL;
+}
+
+// a monitor polling the segment from its own mapping
+void *benchMonitor(void *args) {
+    LiveBench *bench = (LiveBench *) args;
+    LiveReader reader(BENCH_LIVE_NAME);
+    long reads = 0;
+    int retries = 0;
+    while (!bench->stopping) {
+        LiveSnapshot state;
+        if (reader.read(0, state, &retries))
+            ++reads;
+        usleep(BENCH_LIVE_POLL_US);
+    }
+    __sync_fetch_and_add(&bench->reads, reads);
+    __sync_fetch_and_add(&bench->retries, retries);
+    return NULL;
+}
+
+// release jitter of a publishing controller with nReaders monitors
+void benchLiveRun(int nReaders, std::ostream &os) {
+    LiveState live(BENCH_LIVE_NAME, 1);
+    Histogram jitter;
+    LiveBench bench = { &live, &jitter, false, 0, 0 };
+    pthread_t readers[BENCH_LIVE_READERS];
+    for (int i = 0; i < nReaders; ++i)
+        pthread_create(&readers[i], NULL, benchMonitor, &bench);
+
+    // the controller runs with a real-time priority when allowed, as in
+    // the threaded mode
+    pthread_attr_t attr;
+    sched_param param;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = VERY_CRITICAL;
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_t publisher;
+    bool realtime = pthread_create(&publisher, &attr, benchPublisher,
+            &bench) == 0;
+    if (!realtime)
+        pthread_create(&publisher, NULL, benchPublisher, &bench);
+    pthread_attr_destroy(&attr);
+    pthread_join(publisher, NULL);
+
+    bench.stopping = true;
+    for (int i = 0; i < nReaders; ++i)
+        pthread_join(readers[i], NULL);
+    os << nReaders << " readers" << (realtime ? "" : " (no SCHED_FIFO)")
+       << ": jitter p50 " << jitter.percentile(0.5) / 1000 << " us, p99 "
+       << jitter.percentile(0.99) / 1000 << " us, max "
+       << jitter.max() / 1000 << " us, " << bench.reads << " reads, "
+       << bench.retries << " retries" << std::endl;
+}
+
+void benchLive(std::ostream &os) {
+    benchLiveRun(0, os);
+    benchLiveRun(BENCH_LIVE_READERS, os);
+}
+
+#if defined(__cpp_impl_coroutine)
+// resident memory of the process in KB, -1 without /proc/self/statm
+long long residentKb() {
+    std::ifstream statm("/proc/self/statm");
+    long long size = 0;
+    long long resident = 0;
+    if (!(statm >> size >> resident))
+        return -1;
+    return resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+// a task of the one thread per task design, blocked until the end
+void *benchBlockedTask(void *args) {
+    pthread_barrier_wait((pthread_barrier_t *) args);
+    return NULL;
+}
+
+// memory of BENCH_CO_THREADED patients with five threads each
+void benchThreadMemory(std::ostream &os) {
+    int nThreads = BENCH_CO_THREADED * 5;
+    pthread_barrier_t b_end;
+    pthread_barrier_init(&b_end, NULL, nThreads + 1);
+    pthread_t *threads = new pthread_t[nThreads];
+    pthread_attr_t attr;
+    size_t stack = 0;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &stack);
+    pthread_attr_destroy(&attr);
+
+    long long before = residentKb();
+    for (int i = 0; i < nThreads; ++i) {
+        int r = pthread_create(&threads[i], NULL, benchBlockedTask, &b_end);
+        CHECK(r == 0, "Error creating task thread");
+    }
+    long long after = residentKb();
+    pthread_barrier_wait(&b_end);
+    for (int i = 0; i < nThreads; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&b_end);
+    delete[] threads;
+
+    os << "threads: " << BENCH_CO_THREADED << " patients, 5 threads each, "
+       << stack * 5 / 1024 << " KB of stacks reserved per patient, ";
+    if (before >= 0)
+        os << (after - before) * 1024 / BENCH_CO_THREADED
+           << " bytes resident per patient";
+    else
+        os << "resident memory unknown";
+    os << " (plus the kernel thread structures)" << std::endl;
+}
+
+struct HandoffBench {
+    Mailbox<int> ping;
+    Mailbox<int> pong;
+};
+
+void *benchPonger(void *args) {
+    HandoffBench *bench = (HandoffBench *) args;
+    unsigned seen = 0;
+    int v = 0;
+    while (v < BENCH_CO_ROUNDS) {
+        bench->ping.wait(v, seen, monotonicNs() + 1000000000LL);
+        bench->pong.post(v);
+    }
+    return NULL;
+}
+
+// a round trip between two threads through mailboxes: two wakeups, each
+// a system call and a context switch
+void benchThreadSwitch(std::ostream &os) {
+    HandoffBench bench;
+    pthread_t ponger;
+    pthread_create(&ponger, NULL, benchPonger, &bench);
+    unsigned seen = 0;
+    long long start = monotonicNs();
+    for (int i = 1; i <= BENCH_CO_ROUNDS; ++i) {
+        int v = 0;
+        bench.ping.post(i);
+        while (v != i)
+            bench.pong.wait(v, seen, monotonicNs() + 1000000000LL);
+    }
+    long long duration = monotonicNs() - start;
+    pthread_join(ponger, NULL);
+    os << "threads: " << duration / (2 * BENCH_CO_ROUNDS)
+       << " ns per switch" << std::endl;
+}
+
+CoTask benchPing(CoChannel<int, 1> *ping, CoChannel<int, 1> *pong) {
+    for (int i = 1; i <= BENCH_CO_ROUNDS; ++i) {
+        int v = 0;
+        ping->send(i);
+        co_await pong->receive(v);
+    }
+}
+
+CoTask benchPong(CoChannel<int, 1> *ping, CoChannel<int, 1> *pong) {
+    int v = 0;
+    while (v < BENCH_CO_ROUNDS) {
+        co_await ping->receive(v);
+        pong->send(v);
+    }
+}
+
+// the same round trip between two coroutines of an executor
+void benchCoroutineSwitch(std::ostream &os) {
+    CoChannel<int, 1> ping;
+    CoChannel<int, 1> pong;
+    Executor executor;
+    executor.spawn(benchPing(&ping, &pong), NORMAL);
+    executor.spawn(benchPong(&ping, &pong), NORMAL);
+    long long start = monotonicNs();
+    executor.run();
+    long long duration = monotonicNs() - start;
+    os << "coroutines: " << duration / executor.resumeCount()
+       << " ns per switch" << std::endl;
+}
+
+// BENCH_CO_PATIENTS patients in real time on shards executors
+void benchCoWard(int nShards, std::ostream &os) {
+    CoWard ward(BENCH_CO_PATIENTS, nShards);
+    ward.run(BENCH_CO_CYCLES, BENCH_CO_PERIOD);
+    ward.report(os);
+    for (int s = 0; s < nShards; ++s)
+        os << "  shard " << s << ": controller jitter p50 "
+           << ward.jitter(s).percentile(0.5) / 1000 << " us, p99 "
+           << ward.jitter(s).percentile(0.99) / 1000 << " us" << std::endl;
+}
+
+void benchCoroutines(std::ostream &os) {
+    benchThreadMemory(os);
+    benchThreadSwitch(os);
+    benchCoroutineSwitch(os);
+    benchCoWard(1, os);
+    benchCoWard(BENCH_CO_SHARDS, os);
+}
+#endif
+
+// the ward with 1 to BENCH_STEAL_WORKERS workers, taking chunks of beds
+// then stealing the steps by priority. The controllers done time is when
+// the last controller step of a cycle ended
+void benchSteal(std::ostream &os) {
+    os << sysconf(_SC_NPROCESSORS_ONLN) << " cores online" << std::endl;
+    for (int nWorkers = 1; nWorkers <= BENCH_STEAL_WORKERS; nWorkers *= 2) {
+        for (int steal = 0; steal < 2; ++steal) {
+            Ward ward(BENCH_STEAL_PATIENTS, nWorkers);
+            ward.setStealing(steal);
+            ward.run(BENCH_STEAL_CYCLES, 0);
+            ward.report(os);
+        }
+    }
+}
+
+struct LatencyBench {
+    Histogram *latency;
+    volatile bool stopping;
+};
+
+// wakes up every period on absolute times like cyclictest and records how
+// late each wakeup is
+void *benchCyclic(void *args) {
+    LatencyBench *bench = (LatencyBench *) args;
+    long long next = monotonicNs();
+    for (int i = 0; i < BENCH_LAT_CYCLES; ++i) {
+        next += BENCH_LAT_PERIOD;
+        sleepUntil(next);
+        bench->latency->record(monotonicNs() - next);
+    }
+    return NULL;
+}
+
+// background load: walks a buffer bigger than the caches, allocates and
+// makes system calls
+void *benchLoad(void *args) {
+    LatencyBench *bench = (LatencyBench *) args;
+    char *buffer = new char[BENCH_LAT_BUFFER];
+    for (int i = 0; !bench->stopping; ++i) {
+        memset(buffer, i, BENCH_LAT_BUFFER);
+        char *block = new char[64 * 1024];
+        block[i % (64 * 1024)] = (char) i;
+        delete[] block;
+        getppid();
+    }
+    delete[] buffer;
+    return NULL;
+}
+
+// the wakeup latency of a thread of the controller priority under load,
+// with or without the hardening of --rt
+void benchLatencyRun(bool harden, std::ostream &os) {
+    RealTime rt(harden);
+    rt.lockMemory();
+    Histogram latency;
+    LatencyBench bench = { &latency, false };
+    int nLoad = BENCH_LAT_LOAD * sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *load = new pthread_t[nLoad];
+    for (int i = 0; i < nLoad; ++i)
+        pthread_create(&load[i], NULL, benchLoad, &bench);
+    pthread_t cyclic;
+    int r = rt.createTask(&cyclic, "cyclic", VERY_CRITICAL, 0, benchCyclic,
+            &bench);
+    if (r == 0)
+        pthread_join(cyclic, NULL);
+    bench.stopping = true;
+    for (int i = 0; i < nLoad; ++i)
+        pthread_join(load[i], NULL);
+    delete[] load;
+
+    os << (harden ? "hardened" : "plain") << ": T:0 P:" << VERY_CRITICAL
+       << " I:" << BENCH_LAT_PERIOD / 1000 << " C:" << latency.count()
+       << " Min " << latency.percentile(0) / 1000 << " Avg "
+       << latency.mean() / 1000 << " P99 " << latency.percentile(0.99) / 1000
+       << " Max " << latency.max() / 1000 << " us, " << nLoad
+       << " load threads" << std::endl;
+    rt.report(os);
+}
+
+void benchLatency(std::ostream &os) {
+    benchLatencyRun(false, os);
+    benchLatencyRun(true, os);
+}
+
+struct InversionBench {
+    PiMutex *lock;
+    long long start;
+    // waits of the high task for the lock
+    Histogram *blocking;
+    // tasks the system kept out of SCHED_FIFO
+    int refused;
+};
+
+// time the calling thread ran, in nanoseconds
+inline long long threadCpuNs() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// count the calling task in refused if it does not run SCHED_FIFO
+void benchCheckFifo(InversionBench *bench) {
+    int policy;
+    sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param) != 0
+            || policy != SCHED_FIFO)
+        __atomic_add_fetch(&bench->refused, 1, __ATOMIC_RELAXED);
+}
+
+// takes the lock at the start of each round and holds it for BENCH_INV_HOLD
+// of its own cpu time, so it holds it longer when it is preempted
+void *benchLowHolder(void *args) {
+    InversionBench *bench = (InversionBench *) args;
+    benchCheckFifo(bench);
+    for (int i = 0; i < BENCH_INV_ROUNDS; ++i) {
+        sleepUntil(bench->start + i * BENCH_INV_PERIOD);
+        bench->lock->lock();
+        long long end = threadCpuNs() + BENCH_INV_HOLD;
+        while (threadCpuNs() < end) {}
+        bench->lock->unlock();
+    }
+    return NULL;
+}
+
+// wakes up while the low task holds the lock and spins, it needs no lock
+void *benchMiddleSpinner(void *args) {
+    InversionBench *bench = (InversionBench *) args;
+    benchCheckFifo(bench);
+    for (int i = 0; i < BENCH_INV_ROUNDS; ++i) {
+        long long wake = bench->start + i * BENCH_INV_PERIOD
+            + BENCH_INV_MIDDLE;
+        sleepUntil(wake);
+        while (monotonicNs() < wake + BENCH_INV_SPIN) {}
+    }
+    return NULL;
+}
+
+// wakes up while the low task holds the lock and waits for it
+void *benchHighWaiter(void *args) {
+    InversionBench *bench = (InversionBench *) args;
+    benchCheckFifo(bench);
+    for (int i = 0; i < BENCH_INV_ROUNDS; ++i) {
+        sleepUntil(bench->start + i * BENCH_INV_PERIOD + BENCH_INV_HIGH);
+        long long now = monotonicNs();
+        bench->lock->lock();
+        bench->blocking->record(monotonicNs() - now);
+        bench->lock->unlock();
+    }
+    return NULL;
+}
+
+// the classic inversion on one cpu: a low task holds a lock the high task
+// waits for while a middle task, above the low one, spins. Without a
+// protocol the high task waits for the spin too
+int benchInversionRun(LockProtocol protocol, std::ostream &os) {
+    // hardened to pin the three tasks on cpu 0, the memory stays unlocked
+    RealTime rt(true);
+    PiMutex lock(protocol);
+    LockStats stats("lock");
+    lock.setStats(&stats);
+    Histogram blocking;
+    InversionBench bench = { &lock, monotonicNs() + BENCH_INV_PERIOD,
+        &blocking, 0 };
+    pthread_t low, middle, high;
+    rt.createTask(&low, "low", URGENT, 0, benchLowHolder, &bench);
+    rt.createTask(&middle, "middle", VERY_URGENT, 0, benchMiddleSpinner,
+            &bench);
+    rt.createTask(&high, "high", VERY_CRITICAL, 0, benchHighWaiter, &bench);
+    pthread_join(low, NULL);
+    pthread_join(middle, NULL);
+    pthread_join(high, NULL);
+
+    os << lockProtocolName(protocol) << ": high task blocked mean "
+       << blocking.mean() / 1000 << " us, max " << blocking.max() / 1000
+       << " us, behind the low task " << stats.worstInversion[VERY_CRITICAL]
+          / 1000 << " us in " << stats.inversions << " of "
+       << BENCH_INV_ROUNDS << " rounds, lock held max " << stats.holdMax
+          / 1000 << " us" << std::endl;
+    if (bench.refused)
+        rt.report(os);
+    return bench.refused;
+}
+
+void benchInversion(std::ostream &os) {
+    int refused = benchInversionRun(LOCK_NONE, os);
+    refused += benchInversionRun(LOCK_INHERIT, os);
+    // a ceiling lock fails outside SCHED_FIFO
+    if (refused == 0)
+        benchInversionRun(LOCK_CEILING, os);
+    else
+        os << "ceiling: needs SCHED_FIFO" << std::endl;
+}
+
+struct FloodBench {
+    MQHandler *handler;
+    long long displayNs;
+    long frames;
+    // release to release time and send time of the controller cycles
+    Histogram period;
+    Histogram send;
+};
+
+// display taking displayNs for each message it receives
+void *benchSlowDisplay(void *args) {
+    FloodBench *bench = (FloodBench *) args;
+    Frame frames[FRAME_BATCH];
+    while (true) {
+        int n = bench->handler->receive(frames);
+        if (n == -1)
+            continue;
+        sleepUntil(monotonicNs() + bench->displayNs);
+        bench->frames += n;
+        for (int i = 0; i < n; ++i) {
+            if (frames[i].code == HALT)
+                return NULL;
+        }
+    }
+}
+
+// controller sending every cycle a glycemia alarm, critical one cycle out
+// of five, and an injection notice of the lowest priority
+void *benchFloodController(void *args) {
+    FloodBench *bench = (FloodBench *) args;
+    FrameWriter out(bench->handler, CONTROLLER_DEVICE);
+    long long next = monotonicNs();
+    long long last = 0;
+    for (int i = 0; i < BENCH_FLOOD_CYCLES; ++i) {
+        next += BENCH_FLOOD_PERIOD;
+        sleepUntil(next);
+        long long start = monotonicNs();
+        if (last)
+            bench->period.record(start - last);
+        last = start;
+        if (i % 5 == 0)
+            out.add(GLYCEMIA_CRITICAL, CRITICAL, i);
+        else
+            out.add(GLYCEMIA_NORMAL, NORMAL, i);
+        out.add(ANTIBIO_INJECT, WEAK);
+        out.flush();
+        bench->send.record(monotonicNs() - start);
+    }
+    out.add(HALT, NORMAL);
+    out.drain();
+    return NULL;
+}
+
+// the period of the controller sending to a display slowed by slowdown,
+// with the backpressure policy
+void benchFloodRun(Backpressure policy, int slowdown, std::ostream &os) {
+    RealTime rt(false);
+    MQHandler handler(RING);
+    handler.backpressure = policy;
+    FloodBench bench;
+    bench.handler = &handler;
+    bench.displayNs = BENCH_FLOOD_DISPLAY * slowdown;
+    bench.frames = 0;
+    pthread_t display, controller;
+    rt.createTask(&display, "display", NORMAL, -1, benchSlowDisplay, &bench);
+    rt.createTask(&controller, "controller", VERY_CRITICAL, -1,
+            benchFloodController, &bench);
+    pthread_join(controller, NULL);
+    pthread_join(display, NULL);
+
+    os << backpressureName(policy) << " x" << slowdown << ": period mean "
+       << bench.period.mean() / 1000 << " us p99 "
+       << bench.period.percentile(0.99) / 1000 << " us max "
+       << bench.period.max() / 1000 << " us, send max "
+       << bench.send.max() / 1000 << " us, " << bench.frames << " of "
+       << 2 * BENCH_FLOOD_CYCLES + 1 << " frames shown" << std::endl;
+    handler.reportBackpressure(os);
+}
+
+// the controller period while the display keeps up, then with the display
+// BENCH_FLOOD_SLOWDOWN times slower under each backpressure
+void benchFlood(std::ostream &os) {
+    benchFloodRun(SEND_BLOCK, 1, os);
+    for (int p = 0; p < BACKPRESSURES; ++p)
+        benchFloodRun((Backpressure) p, BENCH_FLOOD_SLOWDOWN, os);
+}
+
+// controller step deciding every cycle, as before the decision cache
+template <class Policy>
+void benchUncachedStep(Bed *bed) {
+    double glycemia = bed->patient.computeGlycemia();
+    command(bed, Policy::decide(bed->control, glycemia), glycemia);
+    bed->stats.add(glycemia);
+}
+
+// cpu time of the process, all threads, in nanoseconds
+inline long long processCpuNs() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// controller step of each policy deciding every cycle, indexed by PolicyId
+static void (*const benchUncachedSteps[POLICIES])(Bed *) = {
+    benchUncachedStep<BangBang>,
+    benchUncachedStep<Hysteresis>,
+    benchUncachedStep<Pid>,
+    benchUncachedStep<Predictive>,
+};
+
+// a ward of policy controllers, the active patients fed a meal every cycle
+// and the others at rest once settled if the policy can hold both pumps
+// off. Return a hash of the final state of the patients
+unsigned long long benchIdleRun(int policy, bool cached, std::ostream &os) {
+    Ward ward(BENCH_IDLE_PATIENTS, 1);
+    ward.setController(cached ? policySteps[policy]
+            : benchUncachedSteps[policy]);
+    for (int c = 0; c < BENCH_IDLE_SETTLE; ++c)
+        ward.cycle();
+    long hits = ward.cachedDecisions();
+    long long cpu = processCpuNs();
+    for (int c = 0; c < BENCH_IDLE_CYCLES; ++c) {
+        // the workers wait for the next cycle, the beds can be fed from here
+        for (int i = 0; i < BENCH_IDLE_PATIENTS; i += BENCH_IDLE_ACTIVE)
+            ward.bed(i)->patient.injectGlucose();
+        ward.cycle();
+    }
+    cpu = processCpuNs() - cpu;
+    hits = ward.cachedDecisions() - hits;
+
+    unsigned long long hash = FNV_OFFSET;
+    for (int i = 0; i < BENCH_IDLE_PATIENTS; ++i)
+        hash = (hash ^ ward.bed(i)->patient.epoch()) * FNV_PRIME;
+    double hours = BENCH_IDLE_CYCLES * BENCH_IDLE_CYCLE_S / 3600;
+    os << policyName(policy) << (cached ? " cached: " : " every cycle: ")
+       << BENCH_IDLE_PATIENTS << " patients, " << hits * 100.0
+          / ((long long) BENCH_IDLE_PATIENTS * BENCH_IDLE_CYCLES)
+       << "% of the decisions served from the cache, "
+       << cpu / BENCH_IDLE_CYCLES / 1000 << " us of cpu per cycle, "
+       << cpu / hours / 1000000 << " ms per simulated hour" << std::endl;
+    return hash;
+}
+
+// the cpu of a ward deciding every patient every cycle then only the ones
+// that changed. With predictive, 1 - 1/BENCH_IDLE_ACTIVE of the patients
+// rest. With bangbang, the default, a pump is always on: every patient
+// changes every cycle and the cache never serves a decision
+void benchIdle(std::ostream &os) {
+    const int policies[] = { PREDICTIVE, BANG_BANG };
+    for (int p = 0; p < 2; ++p) {
+        unsigned long long every = benchIdleRun(policies[p], false, os);
+        unsigned long long cached = benchIdleRun(policies[p], true, os);
+        os << policyName(policies[p]) << " final states "
+           << (every == cached ? "identical" : "DIFFER") << std::endl;
+    }
+}
+
+// glycemia of a patient drifting by up to 4 mg/dL a sample, between 40
+// and 160
+inline double benchNextGlycemia(double glycemia, unsigned &rng) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    glycemia += (rng % 801) / 100.0 - 4;
+    return glycemia < 40 ? 80 - glycemia
+        : glycemia > 160 ? 320 - glycemia : glycemia;
+}
+
+// add BENCH_STATS_SAMPLES samples to the statistics of each of
+// BENCH_STATS_PATIENTS patients, a cycle of the ward at a time, then merge
+// them. Report the cost of a sample and of a merge and the memory, and
+// check the merged moments and the quantiles of one patient against the
+// exact ones
+void benchStats(std::ostream &os) {
+    GlycemiaStats *stats = new GlycemiaStats[BENCH_STATS_PATIENTS];
+    double *glycemia = new double[BENCH_STATS_PATIENTS];
+    unsigned *rng = new unsigned[BENCH_STATS_PATIENTS];
+    for (int p = 0; p < BENCH_STATS_PATIENTS; ++p) {
+        glycemia[p] = 100;
+        rng[p] = p + 1;
+    }
+    double *first = new double[BENCH_STATS_SAMPLES];
+    // the mean and squared sum of every sample, the naive way
+    double sum = 0, squares = 0;
+
+    long long addNs = 0;
+    for (int s = 0; s < BENCH_STATS_SAMPLES; ++s) {
+        for (int p = 0; p < BENCH_STATS_PATIENTS; ++p) {
+            glycemia[p] = benchNextGlycemia(glycemia[p], rng[p]);
+            sum += glycemia[p];
+            squares += glycemia[p] * glycemia[p];
+        }
+        first[s] = glycemia[0];
+        long long start = monotonicNs();
+        for (int p = 0; p < BENCH_STATS_PATIENTS; ++p)
+            stats[p].add(glycemia[p]);
+        addNs += monotonicNs() - start;
+    }
+
+    GlycemiaStats total;
+    long long start = monotonicNs();
+    for (int p = 0; p < BENCH_STATS_PATIENTS; ++p)
+        total.merge(stats[p]);
+    long long mergeNs = monotonicNs() - start;
+
+    long n = (long) BENCH_STATS_PATIENTS * BENCH_STATS_SAMPLES;
+    double mean = sum / n;
+    double sd = sqrt((squares - n * mean * mean) / (n - 1));
+    std::sort(first, first + BENCH_STATS_SAMPLES);
+    double error = 0;
+    static const double quantiles[] = { 0.05, 0.25, 0.5, 0.75, 0.95 };
+    for (int q = 0; q < 5; ++q) {
+        double exact = first[(int) (quantiles[q] * (BENCH_STATS_SAMPLES - 1))];
+        double e = fabs(stats[0].percentile(quantiles[q]) - exact);
+        if (e > error)
+            error = e;
+    }
+
+    os << BENCH_STATS_PATIENTS << " patients, " << sizeof(GlycemiaStats)
+       << " bytes each (" << sizeof(GlycemiaStats) * BENCH_STATS_PATIENTS
+          / 1000000.0
+       << " MB): " << (double) addNs / n << " ns per sample, "
+       << (double) mergeNs / BENCH_STATS_PATIENTS << " ns per merge"
+       << std::endl;
+    os << "merged mean " << total.average() << " sd " << total.stddev()
+       << ", exact " << mean << " " << sd << ", " << total.timeInRange() * 100
+       << "% in range, p50 " << total.percentile(0.5) << std::endl;
+    os << "quantiles of patient 0 within " << error << " mg/dL of the exact"
+       << " ones (bins of " << STATS_BIN_WIDTH << ")" << std::endl;
+    delete[] first;
+    delete[] rng;
+    delete[] glycemia;
+    delete[] stats;
+}
+
+struct Benchmark {
+    const char *name;
+    void (*run)(std::ostream &);
+};
+
+static const Benchmark benchmarks[] = {
+    { "transport", benchTransport },
+    { "patient", benchPatient },
+    { "cohort", benchCohort },
+    { "model", benchModel },
+    { "syringe", benchSyringe },
+    { "bank", benchBank },
+    { "timers", benchTimers },
+    { "telemetry", benchTelemetry },
+    { "log", benchLog },
+    { "frames", benchFrames },
+    { "edge", benchEdge },
+    { "decision", benchDecision },
+    { "policies", benchPolicies },
+    { "trace", benchTrace },
+    { "live", benchLive },
+    { "steal", benchSteal },
+    { "latency", benchLatency },
+    { "inversion", benchInversion },
+    { "flood", benchFlood },
+    { "idle", benchIdle },
+    { "stats", benchStats },
+#if defined(__cpp_impl_coroutine)
+    { "coroutines", benchCoroutines },
+#endif
+};
+
+// run the benchmark called name, or all of them for "all"
+inline int runBenchmark(const char *name) {
+    int found = 0;
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+        if (strcmp(name, "all") == 0 || strcmp(name, benchmarks[i].name) == 0) {
+            benchmarks[i].run(std::cout);
+            ++found;
+        }
+    }
+    if (!found)
+        std::cerr << "Unknown benchmark `" << name << "`" << std::endl;
+    return found ? 0 : 1;
+}
+
+#endif
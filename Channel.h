@@ -0,0 +1,389 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <mqueue.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+
+#include "Clock.h"
+#include "Error.h"
+#include "Lock.h"
+
+#define CACHE_LINE 64
+
+// setting the priority numbers
+enum Priority {
+    VERY_CRITICAL = 20,
+    CRITICAL = 18,
+    VERY_URGENT = 15,
+    URGENT = 13,
+    NORMAL = 10,
+    WEAK = 5,
+};
+
+// Interface of the channels carrying messages between the tasks.
+// The calls follow mq_send/mq_receive: they return -1 and set errno on error
+// and the highest priority message is received first.
+class Channel {
+public:
+    virtual ~Channel() {}
+
+    // queue a message of size bytes, blocks while the channel is full
+    virtual int send(const void *msg, size_t size, unsigned prio) = 0;
+
+    // same as send but fails with EAGAIN instead of waiting when the
+    // channel is full
+    virtual int trySend(const void *msg, size_t size, unsigned prio) = 0;
+
+    // same as send but fails with ETIMEDOUT once the monotonic clock reaches
+    // deadline (in nanoseconds) while the channel is still full
+    virtual int timedSend(const void *msg, size_t size, unsigned prio,
+            long long deadline) = 0;
+
+    // wait for a message and copy it in msg, return its size
+    virtual int receive(void *msg, size_t size) = 0;
+
+    // same as receive but fails with EAGAIN instead of waiting when the
+    // channel is empty
+    virtual int tryReceive(void *msg, size_t size) = 0;
+};
+
+// channel backed by a POSIX message queue. The queue is named /name, as
+// Linux requires and QNX accepts. The process exits if it cannot be opened,
+// the tasks could not run without it
+class MQChannel : public Channel {
+public:
+    MQChannel(const char *name, long maxmsg, long msgsize)
+        : name(std::string(name[0] == '/' ? "" : "/") + name),
+          msgsize(msgsize)
+    {
+        // mq_receive needs a buffer of the queue message size, which is
+        // usually bigger than the message itself
+        buffer = new char[msgsize];
+
+        // initialize the queue attributes
+        mq_attr attr;
+        attr.mq_flags = 0;
+        attr.mq_maxmsg = maxmsg;
+        attr.mq_msgsize = msgsize;
+
+        // open the queue in read only mode qr and in write mode qw, qr_nb and
+        // qw_nb are used without blocking
+        const char *path = this->name.c_str();
+        mq_unlink(path);
+        qr = qr_nb = qw = qw_nb = (mqd_t) -1;
+        qr = mq_open(path, O_CREAT | O_RDONLY, S_IWUSR | S_IRUSR, &attr);
+        if (qr != (mqd_t) -1)
+            qr_nb = mq_open(path, O_RDONLY | O_NONBLOCK);
+        if (qr_nb != (mqd_t) -1)
+            qw = mq_open(path, O_WRONLY);
+        if (qw != (mqd_t) -1)
+            qw_nb = mq_open(path, O_WRONLY | O_NONBLOCK);
+        if (qw_nb == (mqd_t) -1) {
+            int error = errno;
+            close();
+            CHECK(false, "Error opening the queue `" << path << "`: "
+                    << strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ~MQChannel() {
+        close();
+    }
+
+    int send(const void *msg, size_t size, unsigned prio) {
+        return mq_send(qw, (const char *) msg, size, prio);
+    }
+
+    int trySend(const void *msg, size_t size, unsigned prio) {
+        return mq_send(qw_nb, (const char *) msg, size, prio);
+    }
+
+    int timedSend(const void *msg, size_t size, unsigned prio,
+            long long deadline) {
+#if defined(__QNX__)
+        timespec ts = toTimespec(deadline);
+        return mq_timedsend_monotonic(qw, (const char *) msg, size, prio,
+                &ts);
+#else
+        // mq_timedsend takes a time of the realtime clock
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        timespec ts = toTimespec(now.tv_sec * 1000000000LL + now.tv_nsec
+                + deadline - monotonicNs());
+        return mq_timedsend(qw, (const char *) msg, size, prio, &ts);
+#endif
+    }
+
+    int receive(void *msg, size_t size) {
+        return copy(mq_receive(qr, buffer, msgsize, NULL), msg, size);
+    }
+
+    int tryReceive(void *msg, size_t size) {
+        return copy(mq_receive(qr_nb, buffer, msgsize, NULL), msg, size);
+    }
+
+private:
+    // close the descriptors that are open and remove the queue
+    void close() {
+        mqd_t *queues[] = { &qr, &qr_nb, &qw, &qw_nb };
+        for (int i = 0; i < 4; ++i) {
+            if (*queues[i] != (mqd_t) -1)
+                mq_close(*queues[i]);
+            *queues[i] = (mqd_t) -1;
+        }
+        mq_unlink(name.c_str());
+        delete[] buffer;
+        buffer = NULL;
+    }
+
+    int copy(ssize_t r, void *msg, size_t size) {
+        if (r < 0)
+            return -1;
+        if ((size_t) r > size) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy(msg, buffer, r);
+        return r;
+    }
+
+    std::string name;
+    long msgsize;
+    char *buffer;
+    mqd_t qr;
+    mqd_t qr_nb;
+    mqd_t qw;
+    mqd_t qw_nb;
+};
+
+// number of priority lanes of a ring channel, and time a producer sleeps
+// before it tries a full lane again, in nanoseconds
+#define RING_LANES 4
+#define RING_BACKOFF 100000
+
+// In-process channel made of one lock-free ring per priority lane. Each ring
+// is a bounded queue where every slot carries a sequence number: the
+// consumer never takes a lock, and a producer only needs a compare and swap
+// on the tail, so the display channel can still be fed by several tasks.
+class RingChannel : public Channel {
+public:
+    RingChannel(long maxmsg, long msgsize)
+        : msgsize(msgsize), waiting(0)
+    {
+        // round the capacity up to a power of two
+        capacity = 1;
+        while (capacity < (unsigned) maxmsg)
+            capacity <<= 1;
+
+        for (int l = 0; l < RING_LANES; ++l) {
+            Lane *lane = &lanes[l];
+            lane->head = 0;
+            lane->tail = 0;
+            lane->seq = new unsigned[capacity];
+            lane->len = new size_t[capacity];
+            lane->data = new char[capacity * msgsize];
+            for (unsigned i = 0; i < capacity; ++i)
+                lane->seq[i] = i;
+        }
+        pthread_cond_init(&cv_wait, NULL);
+    }
+
+    ~RingChannel() {
+        for (int l = 0; l < RING_LANES; ++l) {
+            delete[] lanes[l].seq;
+            delete[] lanes[l].len;
+            delete[] lanes[l].data;
+        }
+        pthread_cond_destroy(&cv_wait);
+    }
+
+    int send(const void *msg, size_t size, unsigned prio) {
+        return timedSend(msg, size, prio, -1);
+    }
+
+    int trySend(const void *msg, size_t size, unsigned prio) {
+        if ((long) size > msgsize) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (!push(&lanes[laneOf(prio)], msg, size)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        wake();
+        return 0;
+    }
+
+    // a deadline of -1 waits for ever, as send()
+    int timedSend(const void *msg, size_t size, unsigned prio,
+            long long deadline) {
+        if ((long) size > msgsize) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        // like mq_send, wait for room when the lane is full. A yield would
+        // not let a consumer of lower priority run under SCHED_FIFO, the
+        // producer sleeps instead
+        Lane *lane = &lanes[laneOf(prio)];
+        while (!push(lane, msg, size)) {
+            long long now = monotonicNs();
+            if (deadline >= 0 && now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            long long wake = now + RING_BACKOFF;
+            sleepUntil(deadline >= 0 && deadline < wake ? deadline : wake);
+        }
+        wake();
+        return 0;
+    }
+
+    int receive(void *msg, size_t size) {
+        int r = tryReceive(msg, size);
+        if (r >= 0 || errno != EAGAIN)
+            return r;
+
+        m_wait.lock();
+        while (true) {
+            // announce the wait before checking the lanes again, so a send
+            // happening in between either is seen here or signals cv_wait
+            waiting = 1;
+            __sync_synchronize();
+            r = tryReceive(msg, size);
+            if (r >= 0 || errno != EAGAIN)
+                break;
+            m_wait.wait(&cv_wait);
+        }
+        waiting = 0;
+        m_wait.unlock();
+        return r;
+    }
+
+    int tryReceive(void *msg, size_t size) {
+        for (int l = 0; l < RING_LANES; ++l) {
+            Lane *lane = &lanes[l];
+            unsigned pos = lane->head;
+            unsigned slot = pos & (capacity - 1);
+            if (__atomic_load_n(&lane->seq[slot], __ATOMIC_ACQUIRE) != pos + 1)
+                continue;
+            if (lane->len[slot] > size) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            int r = lane->len[slot];
+            memcpy(msg, &lane->data[slot * msgsize], r);
+            // give the slot back to the producers for the next round
+            __atomic_store_n(&lane->seq[slot], pos + capacity, __ATOMIC_RELEASE);
+            lane->head = pos + 1;
+            return r;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+private:
+    struct Lane {
+        // producers and consumer indexes live on separate cache lines
+        unsigned tail;
+        char pad0[CACHE_LINE - sizeof(unsigned)];
+        unsigned head;
+        char pad1[CACHE_LINE - sizeof(unsigned)];
+        unsigned *seq;
+        size_t *len;
+        char *data;
+    };
+
+    // map a send priority to a lane, lane 0 is read first
+    static int laneOf(unsigned prio) {
+        if (prio >= CRITICAL)
+            return 0;
+        if (prio >= URGENT)
+            return 1;
+        if (prio >= NORMAL)
+            return 2;
+        return 3;
+    }
+
+    // wake up the consumer if it went to sleep on an empty channel
+    void wake() {
+        __sync_synchronize();
+        if (waiting) {
+            m_wait.lock();
+            pthread_cond_signal(&cv_wait);
+            m_wait.unlock();
+        }
+    }
+
+    // claim the tail slot of the lane and fill it, false when the lane is full
+    bool push(Lane *lane, const void *msg, size_t size) {
+        unsigned pos = __atomic_load_n(&lane->tail, __ATOMIC_RELAXED);
+        while (true) {
+            unsigned slot = pos & (capacity - 1);
+            int dif = (int) (__atomic_load_n(&lane->seq[slot], __ATOMIC_ACQUIRE)
+                    - pos);
+            if (dif == 0) {
+                if (__atomic_compare_exchange_n(&lane->tail, &pos, pos + 1,
+                            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    lane->len[slot] = size;
+                    memcpy(&lane->data[slot * msgsize], msg, size);
+                    __atomic_store_n(&lane->seq[slot], pos + 1,
+                            __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = __atomic_load_n(&lane->tail, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    Lane lanes[RING_LANES];
+    unsigned capacity;
+    long msgsize;
+
+    // used by the consumer to sleep while every lane is empty. The display
+    // holds m_wait while the tasks above it signal, so it inherits their
+    // priority
+    volatile int waiting;
+    PiMutex m_wait;
+    pthread_cond_t cv_wait;
+};
+
+// available channel backends
+enum Transport {
+    MQUEUE,
+    RING,
+    TRANSPORTS
+};
+
+inline const char *transportName(int id) {
+    static const char *names[TRANSPORTS] = { "mqueue", "ring" };
+    return id >= 0 && id < TRANSPORTS ? names[id] : "";
+}
+
+// id of the transport called name, -1 if there is none
+inline int findTransport(const char *name) {
+    for (int id = 0; id < TRANSPORTS; ++id) {
+        if (strcmp(name, transportName(id)) == 0)
+            return id;
+    }
+    return -1;
+}
+
+inline Channel *openChannel(Transport transport, const char *name,
+        long maxmsg, long msgsize) {
+    if (transport == RING)
+        return new RingChannel(maxmsg, msgsize);
+    return new MQChannel(name, maxmsg, msgsize);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <errno.h>
+#include <time.h>
+
+// current time of the monotonic clock in nanoseconds
+inline long long monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// time in nanoseconds as a timespec
+inline timespec toTimespec(long long ns) {
+    timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    return ts;
+}
+
+// sleep until the monotonic clock reaches ns. The wakeup time is absolute,
+// so the time spent before the call does not delay it
+inline void sleepUntil(long long ns) {
+    timespec ts = toTimespec(ns);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// time source of the simulation mode, in nanoseconds. It only moves when the
+// simulation advances it to its next event
+class VirtualClock {
+public:
+    VirtualClock() : t(0) {}
+
+    long long now() const { return t; }
+
+    void advanceTo(long long time) { t = time; }
+
+private:
+    long long t;
+};
+
+#endif
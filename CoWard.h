@@ -0,0 +1,342 @@
+#ifndef CO_WARD_H
+#define CO_WARD_H
+
+#include "Coroutine.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <pthread.h>
+#include <iostream>
+
+#include "Clock.h"
+#include "Controller.h"
+#include "EdgeTrigger.h"
+#include "Error.h"
+#include "EventLog.h"
+#include "GlycemiaStats.h"
+#include "Histogram.h"
+#include "Message.h"
+#include "Patient.h"
+#include "Periodic.h"
+#include "Syringe.h"
+
+// commands a pump can have waiting and display events of a bed
+#define CO_COMMANDS 4
+#define CO_EVENTS 16
+
+// an event for the display task, with the glycemia or level it shows
+struct CoEvent {
+    double value;
+    Message msg;
+};
+
+// one patient of a CoWard and the channels between its tasks, what the
+// threaded mode keeps in Data, the mailboxes and the display queue
+struct CoBed {
+    CoBed()
+        : id(0), edge(true), heartbeat(0), verbose(false), log(NULL) {}
+
+    int id;
+    Patient patient;
+    Syringe sManager;
+    CoChannel<Message, CO_COMMANDS> glucoseCmd;
+    CoChannel<Message, CO_COMMANDS> insulineCmd;
+    CoChannel<CoEvent, CO_EVENTS> display;
+    // edge or level triggered commands and heartbeat of the pumps
+    bool edge;
+    int heartbeat;
+    bool verbose;
+    // binary log of the events, printed when NULL
+    EventLog *log;
+    // glycemia read by the controller task
+    GlycemiaStats stats;
+};
+
+inline void show(CoBed *bed, Message msg, double value = 0) {
+    CoEvent e = { value, msg };
+    bed->display.send(e);
+}
+
+// the tasks of a bed, written as the threads of GlycemiaRegulator.cc with
+// co_await where they block
+
+// controller task with the control law of Policy, as t_controller
+template <class Policy>
+CoTask coController(CoBed *bed, int nCycles, long long period,
+        Histogram *jitter) {
+    PeriodicTask task(period, SKIP, jitter);
+    Controller<Policy> controller;
+    EdgeTrigger glucoseOut(bed->edge, bed->heartbeat);
+    EdgeTrigger insulineOut(bed->edge, bed->heartbeat);
+    EdgeTrigger alarmOut(bed->edge);
+
+    for (int i = 0; i < nCycles; ++i) {
+        task.finish();
+        co_await coSleepUntil(task.deadline());
+        task.begin();
+        double glycemia;
+        Decision d = controller.decide(bed->patient, glycemia);
+        bed->stats.add(glycemia);
+        if (d.glucose == NONE) {
+            if (glucoseOut.idleCycle())
+                bed->glucoseCmd.send((Message) glucoseOut.command());
+        } else if (glucoseOut.update(d.glucose)) {
+            bed->glucoseCmd.send(d.glucose);
+        }
+        if (d.insuline == NONE) {
+            if (insulineOut.idleCycle())
+                bed->insulineCmd.send((Message) insulineOut.command());
+        } else if (insulineOut.update(d.insuline)) {
+            bed->insulineCmd.send(d.insuline);
+        }
+        if (d.alarm != NONE && alarmOut.update(d.alarm))
+            show(bed, d.alarm, glycemia);
+    }
+    task.finish();
+
+    bed->glucoseCmd.send(HALT);
+    bed->insulineCmd.send(HALT);
+    show(bed, HALT);
+    // wakes up the syringe task
+    bed->sManager.stop();
+}
+
+// controller task of each policy, indexed by PolicyId
+static CoTask (*const coControllers[POLICIES])(CoBed *, int, long long,
+        Histogram *) = {
+    coController<BangBang>,
+    coController<Hysteresis>,
+    coController<Pid>,
+    coController<Predictive>,
+};
+
+// glucose task, as t_glucose: a command is handled when it comes, the
+// injection is done at the releases
+inline CoTask coGlucose(CoBed *bed, long long period) {
+    PeriodicTask task(period);
+    bool injecting = false;
+    while (true) {
+        Message msg = NONE;
+        if (!co_await bed->glucoseCmd.receive(msg, task.deadline())) {
+            task.begin();
+            if (injecting)
+                bed->patient.injectGlucose();
+            task.finish();
+            continue;
+        }
+        if (msg == START) {
+            if (!injecting)
+                show(bed, GLUCOSE_START);
+            injecting = true;
+        } else if (msg == STOP) {
+            if (injecting)
+                show(bed, GLUCOSE_STOP);
+            injecting = false;
+        } else if (msg == HALT) {
+            co_return;
+        }
+    }
+}
+
+// insuline task, as t_insuline
+inline CoTask coInsuline(CoBed *bed, long long period) {
+    PeriodicTask task(period);
+    bool injecting = true;
+    while (true) {
+        Message msg = NONE;
+        if (!co_await bed->insulineCmd.receive(msg, task.deadline())) {
+            task.begin();
+            if (injecting) {
+                // wakes up the syringe task on a threshold
+                bed->sManager.pump();
+                bed->patient.injectInsuline();
+            }
+            task.finish();
+            continue;
+        }
+        if (msg == START) {
+            if (!injecting)
+                show(bed, INSULINE_START);
+            injecting = true;
+        } else if (msg == STOP) {
+            if (injecting)
+                show(bed, INSULINE_STOP);
+            injecting = false;
+        } else if (msg == HALT) {
+            co_return;
+        }
+    }
+}
+
+// syringe task, as t_syringe
+inline CoTask coSyringe(CoBed *bed) {
+    static const double thresholds[] = {
+        Syringe::level_weak, Syringe::level_critical
+    };
+    Syringe *sManager = &bed->sManager;
+    int observer = sManager->subscribe(thresholds, 2);
+    Syringe::Crossing crossing;
+    while (co_await coCrossing(sManager, observer, crossing)) {
+        int s_active = crossing.active;
+        if (crossing.threshold == Syringe::level_critical) {
+            show(bed, s_active == 0 ? SYRINGE_1_CRITICAL : SYRINGE_2_CRITICAL,
+                    crossing.level);
+            sManager->syringeSwitch();
+            show(bed, SWITCH);
+            sManager->reset();
+            show(bed, RESET);
+        } else if (crossing.threshold == Syringe::level_weak) {
+            show(bed, s_active == 0 ? SYRINGE_1_LOW : SYRINGE_2_LOW,
+                    crossing.level);
+        }
+    }
+}
+
+// display task, as t_display, the lines are prefixed by the bed id
+inline CoTask coDisplay(CoBed *bed) {
+    CoEvent e;
+    while (co_await bed->display.receive(e)) {
+        if (bed->log) {
+            bed->log->log(bed->id, e.msg, e.value);
+        } else if (bed->verbose) {
+            const char *payload = payloadName(e.msg);
+            std::cout << "[bed " << bed->id << "] " << messageText(e.msg);
+            if (payload)
+                std::cout << " (" << payload << " " << e.value << ")";
+            std::cout << "\n";
+        }
+        if (e.msg == HALT)
+            co_return;
+    }
+}
+
+// an executor and the thread running it
+struct CoShard {
+    Executor executor;
+    // release jitter of the controllers of the shard
+    Histogram jitter;
+    pthread_t thread;
+};
+
+// Hosts many beds in one process with the five tasks of each bed as
+// coroutines. The beds are spread over nShards executors, one thread each,
+// and a bed stays on its shard so its channels need no lock.
+// The tasks keep the priorities of the threads within a shard.
+class CoWard {
+public:
+    CoWard(int nBeds, int nShards, bool verbose = false, EventLog *log = NULL)
+        : nBeds(nBeds), nShards(nShards), frameBytes(0), durationNs(0)
+    {
+        beds = new CoBed[nBeds];
+        for (int i = 0; i < nBeds; ++i) {
+            beds[i].id = i;
+            beds[i].verbose = verbose;
+            beds[i].log = log;
+        }
+        shards = new CoShard[nShards];
+    }
+
+    ~CoWard() {
+        delete[] shards;
+        delete[] beds;
+    }
+
+    // edge or level triggered commands, with a heartbeat of the pumps every
+    // heartbeat cycles (0 for none). Must be called before run()
+    void setTrigger(bool edge, int heartbeat) {
+        for (int i = 0; i < nBeds; ++i) {
+            beds[i].edge = edge;
+            beds[i].heartbeat = heartbeat;
+        }
+    }
+
+    // run nCycles controller cycles of period ns on every bed with the
+    // control law policy, return once every task has ended
+    void run(int nCycles, long long period, int policy = BANG_BANG) {
+        long long before = __atomic_load_n(&coFrameBytes, __ATOMIC_RELAXED);
+        for (int i = 0; i < nBeds; ++i) {
+            CoBed *bed = &beds[i];
+            Executor *e = &shards[i % nShards].executor;
+            Histogram *jitter = &shards[i % nShards].jitter;
+            e->spawn(coControllers[policy](bed, nCycles, period, jitter),
+                    VERY_CRITICAL);
+            e->spawn(coSyringe(bed), CRITICAL);
+            e->spawn(coGlucose(bed, period), VERY_URGENT);
+            e->spawn(coInsuline(bed, period), URGENT);
+            e->spawn(coDisplay(bed), NORMAL);
+        }
+        frameBytes = __atomic_load_n(&coFrameBytes, __ATOMIC_RELAXED)
+            - before;
+
+        long long start = monotonicNs();
+        for (int s = 0; s < nShards; ++s) {
+            int r = pthread_create(&shards[s].thread, NULL, runShard,
+                    &shards[s]);
+            CHECK(r == 0, "Error creating shard thread");
+        }
+        for (int s = 0; s < nShards; ++s)
+            pthread_join(shards[s].thread, NULL);
+        durationNs = monotonicNs() - start;
+        std::cout << std::flush;
+    }
+
+    // print the memory of a bed, the resumes, the time the shards were
+    // busy and the controller jitter
+    void report(std::ostream &os) const {
+        long long resumes = 0;
+        long long busyNs = 0;
+        for (int s = 0; s < nShards; ++s) {
+            resumes += shards[s].executor.resumeCount();
+            busyNs += durationNs - shards[s].executor.sleptNs();
+        }
+        os << nBeds << " patients, " << nShards << " shards: "
+           << bytesPerBed() << " bytes per patient ("
+           << frameBytes / (nBeds ? nBeds : 1) << " of frames), "
+           << resumes << " resumes, busy " << busyNs * 100 / nShards
+              / (durationNs ? durationNs : 1)
+           << "% of " << durationNs / 1000000 << " ms, "
+           << busyNs / (resumes ? resumes : 1)
+           << " ns per resume, controller jitter max";
+        for (int s = 0; s < nShards; ++s)
+            os << " " << shards[s].jitter.max() / 1000;
+        os << " us" << std::endl;
+    }
+
+    // memory of a bed: its state, channels and task frames
+    long long bytesPerBed() const {
+        return sizeof(CoBed) + frameBytes / (nBeds ? nBeds : 1);
+    }
+
+    // add the glycemia statistics of the beds to total, shard by shard.
+    // Must be called once run() returned
+    void mergeStats(GlycemiaStats &total) const {
+        for (int s = 0; s < nShards; ++s) {
+            GlycemiaStats shard;
+            for (int i = s; i < nBeds; i += nShards)
+                shard.merge(beds[i].stats);
+            total.merge(shard);
+        }
+    }
+
+    const Histogram &jitter(int shard) const { return shards[shard].jitter; }
+    CoBed *bed(int i) { return &beds[i]; }
+    int size() const { return nBeds; }
+
+private:
+    static void *runShard(void *args) {
+        CoShard *shard = (CoShard *) args;
+        shard->executor.run();
+        return NULL;
+    }
+
+    CoBed *beds;
+    CoShard *shards;
+    int nBeds;
+    int nShards;
+    long long frameBytes;
+    long long durationNs;
+};
+
+#endif
+
+#endif
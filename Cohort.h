@@ -0,0 +1,215 @@
+#ifndef COHORT_H
+#define COHORT_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "Model.h"
+#include "Patient.h"
+#include "Syringe.h"
+
+// alignment of the cohort arrays, enough for the widest vector loads
+#define COHORT_ALIGN 32
+
+// Structure-of-arrays state of a virtual cohort of patients. One call to
+// step() runs a control cycle for every patient: glycemia computation, the
+// glycemia_crit/glycemia_ref decision of t_controller, then the glucose and
+// insuline injections and the syringe switch of the actuators. No display
+// event is raised. The syringe levels and steps are whole numbers, so they
+// are kept as int like glucose and insuline. There is no tracking of the
+// patients that did not change, as the decision cache of the ward does:
+// under this law a pump stays on once a threshold is crossed, so every
+// patient changes every cycle and the kernels stay without branches.
+class Cohort {
+public:
+    Cohort(int n) : n(n), model(NULL), dt(0) {
+        glucose = allocate();
+        insuline = allocate();
+        level = allocate();
+        spare = allocate();
+        active = allocate();
+        glucoseOn = allocate();
+        insulineOn = allocate();
+        glycemia = new double[n];
+        for (int k = 0; k < n; ++k) {
+            glucose[k] = 63;
+            insuline[k] = 0;
+            level[k] = 100;
+            spare[k] = 100;
+            active[k] = 0;
+            glucoseOn[k] = 0;
+            insulineOn[k] = 1;
+        }
+    }
+
+    ~Cohort() {
+        free(glucose);
+        free(insuline);
+        free(level);
+        free(spare);
+        free(active);
+        free(glucoseOn);
+        free(insulineOn);
+        delete[] glycemia;
+    }
+
+    // use model to compute the glycemia, each step advancing it by dt
+    // seconds. The default, NULL, is the linear model of Patient, computed
+    // inside the vector kernel
+    void setModel(GlycemiaModel *model, double dt) {
+        this->model = model;
+        this->dt = dt;
+    }
+
+    // run one control cycle for the whole cohort, with the model when one is
+    // set, otherwise with the AVX2 kernel when the target has it. Without
+    // it the scalar loop is used: the compiler vectorizes it with SSE2 at
+    // least as well as a hand-written SSE2 kernel did
+    void step() {
+        if (model != NULL) {
+            model->evaluate(n, glucose, insuline, dt, glycemia);
+            for (int k = 0; k < n; ++k)
+                actuate(k, glycemia[k]);
+            return;
+        }
+
+        int k = 0;
+#if defined(__AVX2__)
+        for (; k + 8 <= n; k += 8)
+            stepAvx2(k);
+#endif
+        stepScalar(k, n);
+    }
+
+    // reference kernel, one patient at a time
+    void stepScalar(int first, int last) {
+        for (int k = first; k < last; ++k)
+            actuate(k, Patient::Kg * glucose[k] - Patient::Ki * insuline[k]);
+    }
+
+    // controller decision and actuators of patient k for the given glycemia
+    void actuate(int k, double glycemia) {
+        if (glycemia <= Patient::glycemia_crit) {
+            glucoseOn[k] = 1;
+            insulineOn[k] = 0;
+        } else if (glycemia >= Patient::glycemia_ref) {
+            glucoseOn[k] = 0;
+            insulineOn[k] = 1;
+        }
+
+        if (glucoseOn[k])
+            glucose[k] += Patient::glucose_step;
+        if (insulineOn[k]) {
+            level[k] -= (int) Syringe::s_step;
+            insuline[k] += Patient::insuline_step;
+            // switch to the spare syringe and refill the empty one
+            if (level[k] == (int) Syringe::level_critical) {
+                level[k] = spare[k];
+                spare[k] = 100;
+                active[k] = 1 - active[k];
+            }
+        }
+    }
+
+    int size() const { return n; }
+
+    // contiguous per patient state, flags are 0 or 1
+    int *glucose;
+    int *insuline;
+    // level of the active syringe and of the other one
+    int *level;
+    int *spare;
+    int *active;
+    int *glucoseOn;
+    int *insulineOn;
+    // last glycemia computed by the model
+    double *glycemia;
+
+private:
+    int *allocate() {
+        void *p = NULL;
+        if (posix_memalign(&p, COHORT_ALIGN, (n + 8) * sizeof(int)) != 0)
+            return NULL;
+        memset(p, 0, (n + 8) * sizeof(int));
+        return (int *) p;
+    }
+
+#if defined(__AVX2__)
+    // 8 patients at a time
+    void stepAvx2(int k) {
+        __m256i g = _mm256_load_si256((__m256i *) &glucose[k]);
+        __m256i in = _mm256_load_si256((__m256i *) &insuline[k]);
+
+        // glycemia in double, as Patient::computeGlycemia does
+        __m256d kg = _mm256_set1_pd(Patient::Kg);
+        __m256d ki = _mm256_set1_pd(Patient::Ki);
+        __m256d gLo = _mm256_sub_pd(
+                _mm256_mul_pd(kg, _mm256_cvtepi32_pd(_mm256_castsi256_si128(g))),
+                _mm256_mul_pd(ki, _mm256_cvtepi32_pd(_mm256_castsi256_si128(in))));
+        __m256d gHi = _mm256_sub_pd(
+                _mm256_mul_pd(kg, _mm256_cvtepi32_pd(_mm256_extracti128_si256(g, 1))),
+                _mm256_mul_pd(ki, _mm256_cvtepi32_pd(_mm256_extracti128_si256(in, 1))));
+        __m256i crit = packMasks(
+                _mm256_cmp_pd(gLo, _mm256_set1_pd(Patient::glycemia_crit), _CMP_LE_OQ),
+                _mm256_cmp_pd(gHi, _mm256_set1_pd(Patient::glycemia_crit), _CMP_LE_OQ));
+        __m256i ref = _mm256_andnot_si256(crit, packMasks(
+                _mm256_cmp_pd(gLo, _mm256_set1_pd(Patient::glycemia_ref), _CMP_GE_OQ),
+                _mm256_cmp_pd(gHi, _mm256_set1_pd(Patient::glycemia_ref), _CMP_GE_OQ)));
+
+        // a decision sets one actuator on and the other off
+        __m256i one = _mm256_set1_epi32(1);
+        __m256i decided = _mm256_or_si256(crit, ref);
+        __m256i gOn = _mm256_or_si256(
+                _mm256_andnot_si256(decided, _mm256_load_si256((__m256i *) &glucoseOn[k])),
+                _mm256_and_si256(crit, one));
+        __m256i iOn = _mm256_or_si256(
+                _mm256_andnot_si256(decided, _mm256_load_si256((__m256i *) &insulineOn[k])),
+                _mm256_and_si256(ref, one));
+        __m256i gMask = _mm256_cmpeq_epi32(gOn, one);
+        __m256i iMask = _mm256_cmpeq_epi32(iOn, one);
+
+        // injections and pump
+        g = _mm256_add_epi32(g, _mm256_and_si256(gMask,
+                    _mm256_set1_epi32(Patient::glucose_step)));
+        in = _mm256_add_epi32(in, _mm256_and_si256(iMask,
+                    _mm256_set1_epi32(Patient::insuline_step)));
+        __m256i lvl = _mm256_sub_epi32(_mm256_load_si256((__m256i *) &level[k]),
+                _mm256_and_si256(iMask, _mm256_set1_epi32((int) Syringe::s_step)));
+
+        // switch and reset where the active syringe reached level_critical
+        __m256i sw = _mm256_and_si256(iMask, _mm256_cmpeq_epi32(lvl,
+                    _mm256_set1_epi32((int) Syringe::level_critical)));
+        __m256i spr = _mm256_load_si256((__m256i *) &spare[k]);
+        lvl = _mm256_blendv_epi8(lvl, spr, sw);
+        spr = _mm256_blendv_epi8(spr, _mm256_set1_epi32(100), sw);
+        __m256i act = _mm256_xor_si256(_mm256_load_si256((__m256i *) &active[k]),
+                _mm256_and_si256(sw, one));
+
+        _mm256_store_si256((__m256i *) &glucose[k], g);
+        _mm256_store_si256((__m256i *) &insuline[k], in);
+        _mm256_store_si256((__m256i *) &level[k], lvl);
+        _mm256_store_si256((__m256i *) &spare[k], spr);
+        _mm256_store_si256((__m256i *) &active[k], act);
+        _mm256_store_si256((__m256i *) &glucoseOn[k], gOn);
+        _mm256_store_si256((__m256i *) &insulineOn[k], iOn);
+    }
+
+    // narrow two masks of 4 doubles to one mask of 8 ints
+    static __m256i packMasks(__m256d lo, __m256d hi) {
+        __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+        __m256i l = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(lo), even);
+        __m256i h = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(hi), even);
+        return _mm256_permute2x128_si256(l, h, 0x20);
+    }
+#endif
+
+    int n;
+    GlycemiaModel *model;
+    double dt;
+};
+
+#endif
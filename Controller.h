@@ -0,0 +1,264 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <string.h>
+
+#include "Message.h"
+#include "Patient.h"
+
+// commands of the controller for one cycle: START or STOP for each pump and
+// GLYCEMIA_CRITICAL or GLYCEMIA_NORMAL for the display, NONE when the policy
+// has nothing to say (the triggers may then send a heartbeat)
+struct Decision {
+    Message glucose;
+    Message insuline;
+    Message alarm;
+};
+
+// state a policy keeps from one cycle to the next
+struct ControlState {
+    ControlState() : mode(0), integral(0), previous(0), started(false) {}
+
+    // +1 while raising the glycemia, -1 while lowering it, 0 at rest
+    int mode;
+    // integral and last value of the error of the PID
+    double integral;
+    double previous;
+    bool started;
+};
+
+// the commands of a mode: raising gives glucose only, lowering insuline
+// only and rest stops both pumps
+inline Decision decision(int mode, Message alarm) {
+    Decision d = { STOP, STOP, alarm };
+    if (mode > 0)
+        d.glucose = START;
+    else if (mode < 0)
+        d.insuline = START;
+    return d;
+}
+
+// no command at all this cycle
+inline Decision noDecision() {
+    Decision d = { NONE, NONE, NONE };
+    return d;
+}
+
+// alarm of the display for a glycemia, the same for every policy
+inline Message alarmOf(double glycemia) {
+    if (glycemia <= Patient::glycemia_crit)
+        return GLYCEMIA_CRITICAL;
+    if (glycemia >= Patient::glycemia_ref)
+        return GLYCEMIA_NORMAL;
+    return NONE;
+}
+
+// A policy is a struct of constexpr tuning constants and a static
+// decide(state, glycemia). Controller<Policy> calls it directly, so the
+// decision is inlined in the control loop without any virtual call.
+// repeatable tells that a second decide() on the glycemia of the last one
+// gives the same commands, so a patient that did not change need not be
+// decided again.
+
+// the original law: glucose at the critical glycemia, insuline at the
+// reference one and no command in between
+struct BangBang {
+    static constexpr double low = Patient::glycemia_crit;
+    static constexpr double high = Patient::glycemia_ref;
+    static constexpr bool repeatable = true;
+
+    static Decision decide(ControlState &state, double glycemia) {
+        if (glycemia <= low)
+            state.mode = 1;
+        else if (glycemia >= high)
+            state.mode = -1;
+        else
+            return noDecision();
+        return decision(state.mode, alarmOf(glycemia));
+    }
+};
+
+// keeps the glycemia in a band around target: raises it below the band,
+// lowers it above and keeps the current mode inside
+struct Hysteresis {
+    static constexpr double target = 90;
+    static constexpr double band = 10;
+    static constexpr bool repeatable = true;
+
+    static Decision decide(ControlState &state, double glycemia) {
+        if (glycemia <= target - band)
+            state.mode = 1;
+        else if (glycemia >= target + band)
+            state.mode = -1;
+        if (state.mode == 0)
+            return noDecision();
+        return decision(state.mode, alarmOf(glycemia));
+    }
+};
+
+// PID on the error to target, errors in mg/dL and time in cycles. The pumps
+// are on/off: a command above deadband raises, below -deadband lowers,
+// both pumps stop in between
+struct Pid {
+    static constexpr double target = 90;
+    static constexpr double kp = 0.5;
+    static constexpr double ki = 0.002;
+    static constexpr double kd = 1;
+    static constexpr double deadband = 1;
+    // bound of the integral term, against the windup while a pump is on
+    static constexpr double windup = 200;
+    // the integral goes on growing while the glycemia stays the same
+    static constexpr bool repeatable = false;
+
+    static Decision decide(ControlState &state, double glycemia) {
+        double error = target - glycemia;
+        double derivative = state.started ? error - state.previous : 0;
+        state.previous = error;
+        state.started = true;
+        state.integral += error;
+        if (state.integral > windup)
+            state.integral = windup;
+        else if (state.integral < -windup)
+            state.integral = -windup;
+
+        double u = kp * error + ki * state.integral + kd * derivative;
+        state.mode = u > deadband ? 1 : u < -deadband ? -1 : 0;
+        return decision(state.mode, alarmOf(glycemia));
+    }
+};
+
+// model-predictive control on the linear model of Patient: each mode moves
+// the glycemia by a fixed step per cycle, the policy picks the mode whose
+// prediction over horizon cycles stays closest to target, with a penalty
+// for a change of mode and any prediction under the critical glycemia
+// ruled out
+struct Predictive {
+    static constexpr double target = 90;
+    static constexpr int horizon = 10;
+    static constexpr double switchCost = 50;
+    static constexpr double raiseStep = Patient::Kg * Patient::glucose_step;
+    static constexpr double lowerStep = Patient::Ki * Patient::insuline_step;
+    static constexpr double forbidden = 1e30;
+    // the mode chosen is the cheapest one from itself too
+    static constexpr bool repeatable = true;
+
+    static Decision decide(ControlState &state, double glycemia) {
+        int best = state.mode;
+        double bestCost = cost(glycemia, state.mode, state.mode);
+        for (int mode = -1; mode <= 1; ++mode) {
+            double c = cost(glycemia, mode, state.mode);
+            if (c < bestCost) {
+                best = mode;
+                bestCost = c;
+            }
+        }
+        state.mode = best;
+        return decision(state.mode, alarmOf(glycemia));
+    }
+
+    static double cost(double glycemia, int mode, int current) {
+        double step = mode > 0 ? raiseStep : mode < 0 ? -lowerStep : 0;
+        double c = mode != current ? switchCost : 0;
+        double predicted = glycemia;
+        for (int k = 0; k < horizon; ++k) {
+            predicted += step;
+            if (predicted <= Patient::glycemia_crit && step < 0)
+                return forbidden;
+            double e = predicted - target;
+            c += e * e;
+        }
+        return c;
+    }
+};
+
+// last decision of a controller, the glycemia it was made on and the epoch
+// of the patient it was read from
+struct DecisionCache {
+    DecisionCache() : valid(false), epoch(0), glycemia(0), hits(0) {
+        decision = noDecision();
+    }
+
+    // decide again on the next call, after a change of the configuration
+    void invalidate() {
+        valid = false;
+    }
+
+    bool valid;
+    unsigned long long epoch;
+    double glycemia;
+    Decision decision;
+    // decisions served from the cache
+    long hits;
+};
+
+// decide with Policy on the glycemia of patient, or serve the decision and
+// glycemia of cache when the patient did not change since and the policy
+// is repeatable. A traced patient is always read, the trace has a read per
+// cycle. The epoch is read before the glycemia, an injection in between
+// only makes the next call decide again
+template <class Policy>
+inline Decision decideCached(ControlState &state, DecisionCache &cache,
+        const Patient &patient, double &glycemia) {
+    unsigned long long epoch = patient.epoch();
+    if (Policy::repeatable && cache.valid && cache.epoch == epoch
+            && !patient.traced()) {
+        ++cache.hits;
+        glycemia = cache.glycemia;
+        return cache.decision;
+    }
+    glycemia = patient.computeGlycemia();
+    cache.decision = Policy::decide(state, glycemia);
+    cache.glycemia = glycemia;
+    cache.epoch = epoch;
+    cache.valid = true;
+    return cache.decision;
+}
+
+// Controller of one patient with a policy chosen at compile time
+//
+//     Controller<Pid> controller;
+//     double glycemia;
+//     Decision d = controller.decide(patient, glycemia);
+template <class Policy>
+class Controller {
+public:
+    Decision decide(double glycemia) {
+        return Policy::decide(state, glycemia);
+    }
+
+    // decide on the glycemia of patient, given in glycemia, only when it
+    // changed since the last call
+    Decision decide(const Patient &patient, double &glycemia) {
+        return decideCached<Policy>(state, cache, patient, glycemia);
+    }
+
+    const ControlState &controlState() const { return state; }
+    const DecisionCache &decisionCache() const { return cache; }
+
+private:
+    ControlState state;
+    DecisionCache cache;
+};
+
+// policies that can be chosen by name at run time. A caller keeps a table
+// indexed by PolicyId of its code instantiated for each policy, the name
+// only picks the entry once at startup
+enum PolicyId { BANG_BANG, HYSTERESIS, PID, PREDICTIVE, POLICIES };
+
+inline const char *policyName(int id) {
+    static const char *names[POLICIES] = {
+        "bangbang", "hysteresis", "pid", "predictive"
+    };
+    return id >= 0 && id < POLICIES ? names[id] : "";
+}
+
+// id of the policy called name, -1 if there is none
+inline int findPolicy(const char *name) {
+    for (int id = 0; id < POLICIES; ++id) {
+        if (strcmp(name, policyName(id)) == 0)
+            return id;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,352 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// the coroutine tasks need a C++20 compiler (-std=gnu++20), the rest of
+// the tree builds without them
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include <new>
+#include <queue>
+#include <vector>
+
+#include "Channel.h"
+#include "Clock.h"
+#include "Syringe.h"
+
+// ready queues of an executor, one per priority level, the values of
+// Priority fit in them
+#define EXECUTOR_LEVELS 32
+
+class Executor;
+
+// bytes of coroutine frames allocated and not freed yet, in all executors
+static long long coFrameBytes = 0;
+
+// A task of an executor: a coroutine that starts suspended, is handed to
+// Executor::spawn() and is freed by it when it returns. While it waits it
+// costs its frame only, no stack and no thread.
+class CoTask {
+public:
+    struct promise_type {
+        promise_type()
+            : executor(NULL), next(NULL), priority(0), wait(0), timers(0),
+              queued(false) {}
+
+        CoTask get_return_object() {
+            return CoTask(std::coroutine_handle<promise_type>::from_promise(
+                    *this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        // the executor frees the frame, once no timer points to it
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t size) {
+            __atomic_add_fetch(&coFrameBytes, size, __ATOMIC_RELAXED);
+            return ::operator new(size);
+        }
+        static void operator delete(void *p, size_t size) {
+            __atomic_sub_fetch(&coFrameBytes, size, __ATOMIC_RELAXED);
+            ::operator delete(p);
+        }
+
+        Executor *executor;
+        // next task in the ready queue of its priority
+        promise_type *next;
+        int priority;
+        // number of the current wait, a timer of an older wait is ignored
+        unsigned wait;
+        // timers of the executor still pointing to the task
+        int timers;
+        bool queued;
+    };
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    explicit CoTask(Handle h) : handle(h) {}
+    CoTask(CoTask &&other) : handle(other.handle) { other.handle = NULL; }
+
+    // a task never spawned is freed with its CoTask
+    ~CoTask() {
+        if (handle)
+            handle.destroy();
+    }
+
+    Handle release() {
+        Handle h = handle;
+        handle = NULL;
+        return h;
+    }
+
+private:
+    Handle handle;
+};
+
+// a task sleeping until time. Timers of the same time wake their tasks by
+// decreasing priority, then in the order they were set
+struct CoTimer {
+    long long time;
+    int priority;
+    unsigned long long seq;
+    CoTask::promise_type *task;
+    unsigned wait;
+
+    bool operator<(const CoTimer &other) const {
+        if (time != other.time)
+            return time > other.time;
+        if (priority != other.priority)
+            return priority < other.priority;
+        return seq > other.seq;
+    }
+};
+
+// Runs coroutine tasks on the thread calling run(). The ready task of the
+// highest priority runs first, as the scheduler does with threads of those
+// priorities, and the tasks of a priority run in the order they became
+// ready. A task only gives the thread back at a co_await, so a switch is a
+// return and a resume instead of a system call and a kernel context switch.
+// An executor is not thread safe: its tasks, and whatever wakes them up
+// (channels, syringes), stay on its thread.
+class Executor {
+public:
+    typedef CoTask::promise_type Task;
+
+    Executor()
+        : mask(0), tasks(0), nextSeq(0), resumes(0), sleeps(0), idleNs(0)
+    {
+        for (int l = 0; l < EXECUTOR_LEVELS; ++l)
+            heads[l] = tails[l] = NULL;
+    }
+
+    // run task at priority, from the next call of run()
+    void spawn(CoTask task, Priority priority) {
+        Task *t = &task.release().promise();
+        t->executor = this;
+        t->priority = priority;
+        ++tasks;
+        ready(t);
+    }
+
+    // queue t to run, ending the wait it was in
+    void ready(Task *t) {
+        if (t->queued)
+            return;
+        t->queued = true;
+        ++t->wait;
+        t->next = NULL;
+        int l = t->priority;
+        if (tails[l])
+            tails[l]->next = t;
+        else
+            heads[l] = t;
+        tails[l] = t;
+        mask |= 1u << l;
+    }
+
+    // make t ready at time, unless something else ends its wait first
+    void sleepUntil(Task *t, long long time) {
+        CoTimer timer = { time, t->priority, nextSeq++, t, t->wait };
+        timers.push(timer);
+        ++t->timers;
+    }
+
+    // run the tasks until every one of them returned, sleeping when none
+    // is ready until the next timer
+    void run() {
+        while (tasks > 0) {
+            if (!timers.empty())
+                wakeTimers(monotonicNs());
+            if (mask == 0) {
+                if (timers.empty()) {
+                    std::cerr << tasks << " tasks waiting for ever"
+                              << std::endl;
+                    return;
+                }
+                ++sleeps;
+                long long now = monotonicNs();
+                ::sleepUntil(timers.top().time);
+                idleNs += monotonicNs() - now;
+                continue;
+            }
+            int l = 31 - __builtin_clz(mask);
+            Task *t = heads[l];
+            heads[l] = t->next;
+            if (heads[l] == NULL) {
+                tails[l] = NULL;
+                mask &= ~(1u << l);
+            }
+            t->queued = false;
+            ++resumes;
+            CoTask::Handle h = CoTask::Handle::from_promise(*t);
+            h.resume();
+            if (h.done()) {
+                --tasks;
+                if (t->timers == 0)
+                    h.destroy();
+            }
+        }
+    }
+
+    int taskCount() const { return tasks; }
+    // tasks resumed, sleeps of the thread and time it slept so far
+    long long resumeCount() const { return resumes; }
+    long long sleepCount() const { return sleeps; }
+    long long sleptNs() const { return idleNs; }
+
+private:
+    // ready the tasks of the timers due at now
+    void wakeTimers(long long now) {
+        while (!timers.empty() && timers.top().time <= now) {
+            CoTimer timer = timers.top();
+            timers.pop();
+            Task *t = timer.task;
+            --t->timers;
+            CoTask::Handle h = CoTask::Handle::from_promise(*t);
+            if (h.done()) {
+                // the task returned while this timer was pending
+                if (t->timers == 0)
+                    h.destroy();
+            } else if (timer.wait == t->wait) {
+                ready(t);
+            }
+        }
+    }
+
+    Task *heads[EXECUTOR_LEVELS];
+    Task *tails[EXECUTOR_LEVELS];
+    // bit l set when the queue of priority l is not empty
+    unsigned mask;
+    int tasks;
+    std::priority_queue<CoTimer> timers;
+    unsigned long long nextSeq;
+    long long resumes;
+    long long sleeps;
+    long long idleNs;
+};
+
+// co_await coSleepUntil(ns): the task sleeps until the monotonic clock
+// reaches ns, it goes on at once if ns is passed
+struct CoSleep {
+    long long time;
+
+    bool await_ready() const { return time <= monotonicNs(); }
+    void await_suspend(CoTask::Handle h) {
+        h.promise().executor->sleepUntil(&h.promise(), time);
+    }
+    void await_resume() const {}
+};
+
+inline CoSleep coSleepUntil(long long ns) {
+    CoSleep s = { ns };
+    return s;
+}
+
+// Queue of up to N values from the code of an executor to one task of it.
+// send() never waits: it drops the value when the queue is full, as post()
+// does for the events of a bed. The task waits for a value with
+//     Message msg;
+//     if (co_await channel.receive(msg, deadline)) ...
+// which gives false if nothing came before deadline (-1 waits for ever).
+template <typename T, int N>
+class CoChannel {
+public:
+    CoChannel() : head(0), count(0), dropped(0), waiter(NULL) {}
+
+    bool send(T value) {
+        if (count == N) {
+            ++dropped;
+            return false;
+        }
+        values[(head + count++) % N] = value;
+        if (waiter)
+            waiter->executor->ready(waiter);
+        return true;
+    }
+
+    bool tryReceive(T &value) {
+        if (count == 0)
+            return false;
+        value = values[head];
+        head = (head + 1) % N;
+        --count;
+        return true;
+    }
+
+    struct Receive {
+        CoChannel *channel;
+        T *value;
+        long long deadline;
+
+        bool await_ready() const {
+            return channel->count > 0
+                || (deadline >= 0 && deadline <= monotonicNs());
+        }
+        void await_suspend(CoTask::Handle h) {
+            CoTask::promise_type *t = &h.promise();
+            channel->waiter = t;
+            if (deadline >= 0)
+                t->executor->sleepUntil(t, deadline);
+        }
+        bool await_resume() {
+            channel->waiter = NULL;
+            return channel->tryReceive(*value);
+        }
+    };
+
+    Receive receive(T &value, long long deadline = -1) {
+        Receive r = { this, &value, deadline };
+        return r;
+    }
+
+    long droppedCount() const { return dropped; }
+
+private:
+    T values[N];
+    int head;
+    int count;
+    long dropped;
+    // task waiting in receive(), NULL for none
+    CoTask::promise_type *waiter;
+};
+
+// co_await coCrossing(syringe, id, crossing): the task waits for the next
+// crossing of the observer id of syringe, it is woken up by the pump that
+// crosses the threshold. Gives false once the syringe is stopped
+struct CoCrossing {
+    Syringe *syringe;
+    int id;
+    Syringe::Crossing *crossing;
+    int found;
+
+    bool await_ready() {
+        found = syringe->tryCrossing(id, *crossing);
+        return found != 0;
+    }
+    bool await_suspend(CoTask::Handle h) {
+        return syringe->armWakeup(id, wake, &h.promise());
+    }
+    bool await_resume() {
+        if (found == 0)
+            found = syringe->tryCrossing(id, *crossing);
+        return found > 0;
+    }
+
+    // called by the syringe with m_syringe held
+    static void wake(void *arg) {
+        CoTask::promise_type *t = (CoTask::promise_type *) arg;
+        t->executor->ready(t);
+    }
+};
+
+inline CoCrossing coCrossing(Syringe *syringe, int id,
+        Syringe::Crossing &crossing) {
+    CoCrossing c = { syringe, id, &crossing, 0 };
+    return c;
+}
+
+#endif
+
+#endif
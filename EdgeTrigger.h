@@ -0,0 +1,82 @@
+#ifndef EDGE_TRIGGER_H
+#define EDGE_TRIGGER_H
+
+#include <iostream>
+
+// Output of the controller to one actuator. The controller gives its command
+// every cycle and update() tells whether to send it: only when it differs
+// from the last one sent, or again after heartbeat cycles without a send so
+// that a lost command does not last (0 for no heartbeat). A level triggered
+// output sends every command, as the controller used to.
+class EdgeTrigger {
+public:
+    EdgeTrigger(bool edge = true, int heartbeat = 0)
+        : edge(edge), heartbeat(heartbeat), last(-1), idle(0), sent(0),
+          suppressed(0), beats(0) {}
+
+    // return true if command must be sent this cycle
+    bool update(int command) {
+        if (!edge || command != last) {
+            last = command;
+            idle = 0;
+            ++sent;
+            return true;
+        }
+        if (beat())
+            return true;
+        ++suppressed;
+        return false;
+    }
+
+    // a cycle where the controller has no command, return true if the last
+    // one must be sent again as a heartbeat
+    bool idleCycle() {
+        return last >= 0 && beat();
+    }
+
+    // the last command sent, -1 if none
+    int command() const { return last; }
+
+    // commands sent, heartbeats included, and commands a level triggered
+    // output would have sent in addition
+    long sentCount() const { return sent; }
+    long suppressedCount() const { return suppressed; }
+    long heartbeatCount() const { return beats; }
+
+private:
+    bool beat() {
+        if (heartbeat <= 0 || ++idle < heartbeat)
+            return false;
+        idle = 0;
+        ++sent;
+        ++beats;
+        return true;
+    }
+
+    bool edge;
+    int heartbeat;
+    int last;
+    // cycles since the last send
+    int idle;
+    long sent;
+    long suppressed;
+    long beats;
+};
+
+// print the commands sent by the glucose, insuline and alarm outputs of a
+// controller per hour, against the ones a level triggered output sends
+inline void reportCommands(const EdgeTrigger &glucose,
+        const EdgeTrigger &insuline, const EdgeTrigger &alarm, double hours,
+        std::ostream &os) {
+    long sent = glucose.sentCount() + insuline.sentCount() + alarm.sentCount();
+    long beats = glucose.heartbeatCount() + insuline.heartbeatCount();
+    long level = sent - beats + glucose.suppressedCount()
+        + insuline.suppressedCount() + alarm.suppressedCount();
+    if (hours <= 0)
+        hours = 1;
+    os << "controller: " << (long) (sent / hours) << " commands/h ("
+       << (long) (beats / hours) << " heartbeats), level triggered "
+       << (long) (level / hours) << " commands/h" << std::endl;
+}
+
+#endif
@@ -1,10 +1,18 @@
 #ifndef ERROR_H
 #define ERROR_H
 
-#define CHECK(c, msg)                       \
-    do {                                    \
-        if(!(c))                            \
-            std::cerr << msg << std::endl;  \
-    } while (false)                         \
+// number of failed CHECKs since the start, exported by the telemetry
+inline long &checkFailures() {
+    static long failures = 0;
+    return failures;
+}
+
+#define CHECK(c, msg)                                   \
+    do {                                                \
+        if(!(c)) {                                      \
+            __sync_fetch_and_add(&checkFailures(), 1);  \
+            std::cerr << msg << std::endl;              \
+        }                                               \
+    } while (false)                                     \
 
 #endif
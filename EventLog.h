@@ -0,0 +1,238 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <iostream>
+
+#include "Clock.h"
+#include "Error.h"
+
+// records per producer buffer (a power of two), producers per log, records
+// per write() of the writer and period of the writer in nanoseconds
+#define LOG_BUFFER 8192
+#define LOG_PRODUCERS 32
+#define LOG_BATCH 1024
+#define LOG_FLUSH_NS 10000000LL
+
+// "GLOG", at the start of every log file
+#define LOG_MAGIC 0x474f4c47
+#define LOG_VERSION 1
+
+// one event of the log, written to the file as is
+struct LogRecord {
+    // monotonic time of the event in nanoseconds
+    long long time;
+    int patient;
+    // the Message of the event
+    int code;
+    // glycemia or syringe level carried by the event, see payloadName
+    double value;
+};
+
+struct LogHeader {
+    unsigned magic;
+    unsigned version;
+    unsigned recordSize;
+    unsigned pad;
+    // monotonic time at the creation of the log
+    long long startNs;
+};
+
+// Single producer, single consumer ring of records. The producer never
+// blocks: a record pushed to a full buffer is dropped and counted.
+class LogBuffer {
+public:
+    LogBuffer() : head(0), tail(0), drops(0) {}
+
+    bool push(const LogRecord &record) {
+        unsigned long t = tail;
+        if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == LOG_BUFFER) {
+            ++drops;
+            return false;
+        }
+        records[t & (LOG_BUFFER - 1)] = record;
+        __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // move up to max records to out, return how many
+    int pop(LogRecord *out, int max) {
+        unsigned long h = head;
+        unsigned long t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        int n = 0;
+        while (h != t && n < max)
+            out[n++] = records[h++ & (LOG_BUFFER - 1)];
+        __atomic_store_n(&head, h, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    long dropCount() const { return drops; }
+
+private:
+    LogRecord records[LOG_BUFFER];
+    // read by the writer and written by the producer, a cache line apart
+    unsigned long head;
+    char pad[64 - sizeof(unsigned long)];
+    unsigned long tail;
+    long drops;
+};
+
+// Binary log of the display events. log() fills a fixed size record in a
+// buffer owned by the calling thread: no lock, no allocation and no system
+// call per event. A background thread writes the buffers to the file in
+// batches every LOG_FLUSH_NS. LogDecoder turns the file back into the text
+// of t_display.
+class EventLog {
+public:
+    EventLog(const char *path)
+        : nProducers(0), lateProducers(0), written(0), stopping(false)
+    {
+        pthread_key_create(&key, NULL);
+        buffers = new LogBuffer[LOG_PRODUCERS];
+        batch = new LogRecord[LOG_BATCH];
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0, "Error opening event log " << path);
+        LogHeader header = {
+            LOG_MAGIC, LOG_VERSION, sizeof(LogRecord), 0, monotonicNs()
+        };
+        writeAll(&header, sizeof(header));
+
+        pthread_mutex_init(&m_stop, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cv_stop, &attr);
+        pthread_condattr_destroy(&attr);
+        int r = pthread_create(&th_writer, NULL, run, this);
+        CHECK(r == 0, "Error creating event log thread");
+    }
+
+    // write what is left in the buffers and close the file. The producers
+    // must have stopped logging
+    ~EventLog() {
+        pthread_mutex_lock(&m_stop);
+        stopping = true;
+        pthread_cond_signal(&cv_stop);
+        pthread_mutex_unlock(&m_stop);
+        pthread_join(th_writer, NULL);
+        drain();
+        if (fd >= 0)
+            close(fd);
+        pthread_cond_destroy(&cv_stop);
+        pthread_mutex_destroy(&m_stop);
+        pthread_key_delete(key);
+        delete[] batch;
+        delete[] buffers;
+    }
+
+    // log the event code of patient, return false if it was dropped
+    bool log(int patient, int code, double value) {
+        LogBuffer *buffer = (LogBuffer *) pthread_getspecific(key);
+        if (buffer == NULL && (buffer = attach()) == NULL)
+            return false;
+        LogRecord record = { monotonicNs(), patient, code, value };
+        return buffer->push(record);
+    }
+
+    // records dropped on full buffers or because there were more producer
+    // threads than LOG_PRODUCERS
+    long dropCount() const {
+        long n = __atomic_load_n(&lateProducers, __ATOMIC_RELAXED);
+        int producers = __atomic_load_n(&nProducers, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < producers && i < LOG_PRODUCERS; ++i)
+            n += buffers[i].dropCount();
+        return n;
+    }
+
+    long writtenCount() const {
+        return __atomic_load_n(&written, __ATOMIC_RELAXED);
+    }
+
+private:
+    // give a buffer to the calling thread on its first event
+    LogBuffer *attach() {
+        int i = __atomic_fetch_add(&nProducers, 1, __ATOMIC_ACQ_REL);
+        if (i >= LOG_PRODUCERS) {
+            __atomic_fetch_add(&lateProducers, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        pthread_setspecific(key, &buffers[i]);
+        return &buffers[i];
+    }
+
+    static void *run(void *args) {
+        EventLog *log = (EventLog *) args;
+        long long next = monotonicNs() + LOG_FLUSH_NS;
+        pthread_mutex_lock(&log->m_stop);
+        while (!log->stopping) {
+            timespec ts = toTimespec(next);
+            if (pthread_cond_timedwait(&log->cv_stop, &log->m_stop, &ts) == 0)
+                continue;
+            next += LOG_FLUSH_NS;
+            pthread_mutex_unlock(&log->m_stop);
+            log->drain();
+            pthread_mutex_lock(&log->m_stop);
+        }
+        pthread_mutex_unlock(&log->m_stop);
+        return NULL;
+    }
+
+    // write the records of every buffer, LOG_BATCH at a time
+    void drain() {
+        int producers = __atomic_load_n(&nProducers, __ATOMIC_ACQUIRE);
+        if (producers > LOG_PRODUCERS)
+            producers = LOG_PRODUCERS;
+        int n = 0;
+        for (int i = 0; i < producers; ++i) {
+            int got;
+            while ((got = buffers[i].pop(batch + n, LOG_BATCH - n)) > 0) {
+                n += got;
+                if (n == LOG_BATCH) {
+                    writeBatch(n);
+                    n = 0;
+                }
+            }
+        }
+        if (n > 0)
+            writeBatch(n);
+    }
+
+    void writeBatch(int n) {
+        if (writeAll(batch, n * sizeof(LogRecord)))
+            __atomic_fetch_add(&written, n, __ATOMIC_RELAXED);
+    }
+
+    bool writeAll(const void *data, size_t size) {
+        if (fd < 0)
+            return false;
+        const char *p = (const char *) data;
+        while (size > 0) {
+            ssize_t r = write(fd, p, size);
+            if (r < 0 && errno == EINTR)
+                continue;
+            CHECK(r > 0, "Error writing event log");
+            if (r <= 0)
+                return false;
+            p += r;
+            size -= r;
+        }
+        return true;
+    }
+
+    LogBuffer *buffers;
+    int nProducers;
+    long lateProducers;
+    LogRecord *batch;
+    long written;
+    int fd;
+    pthread_key_t key;
+    bool stopping;
+    pthread_mutex_t m_stop;
+    pthread_cond_t cv_stop;
+    pthread_t th_writer;
+};
+
+#endif
@@ -1,155 +1,221 @@
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 
 #include <time.h>
 #include <pthread.h>
 #include <mqueue.h>
 #include <string>
+#include <cstring>
 #include <errno.h>
 
+#include "CoWard.h"
+#include "Controller.h"
+#include "EdgeTrigger.h"
 #include "Error.h"
+#include "GlycemiaStats.h"
+#include "LiveState.h"
 #include "Patient.h"
+#include "Periodic.h"
+#include "Realtime.h"
+#include "Trace.h"
 #include "Message.h"
 #include "Syringe.h"
+#include "Ward.h"
+#include "Simulation.h"
+#include "TimerWheel.h"
+#include "Benchmark.h"
 
 #define EXECUTION_TIME 5*60
 #define CYCLE_TIME 0.5
 #define EXECUTION_CYCLE EXECUTION_TIME / CYCLE_TIME
 #define FACTOR_TIME 0.1
-
-// setting the priority numbers
-enum Priority {
-    VERY_CRITICAL = 20,
-    CRITICAL = 18,
-    VERY_URGENT = 15,
-    URGENT = 13,
-    NORMAL = 10,
-    WEAK = 5,
-};
+// period of the controller, glucose and insuline tasks in nanoseconds
+#define CYCLE_NS (long long) (1000000000LL * CYCLE_TIME * FACTOR_TIME)
+// default number of workers stepping the beds of a ward
+#define WARD_WORKERS 4
+// tick of the timer wheel of the medications, in nanoseconds
+#define TIMER_TICK 1000000
+// period of the telemetry export, in nanoseconds
+#define TELEMETRY_PERIOD 1000000000LL
+// busy and idle time of each cycle of the stress tasks, in nanoseconds
+#define STRESS_BURST 2000000
+#define STRESS_REST 3000000
 
 // define the data structure
 struct Data {
     Patient *patient;
     MQHandler *mqHandler;
     Syringe *sManager;
+    // observer id of t_syringe on the syringe thresholds
+    int syringeObserver;
+    // overrun policy of the periodic tasks
+    Overrun overrun;
+    // binary log of the display messages, printed when NULL
+    EventLog *log;
+    // level triggered commands instead of edge triggered, and heartbeat of
+    // the pumps in cycles (0 for none)
+    bool levelTriggered;
+    int heartbeat;
+    // segment where the controller publishes the state, NULL for none
+    LiveState *live;
+    // glycemia read by the controller
+    GlycemiaStats *stats;
+    // frames of the medication timers, made before the tasks start so the
+    // timer thread does not allocate
+    FrameWriter *timerOut;
 };
 
-// controller task
+// controller task, with the control law of Policy
+template <class Policy>
 void *t_controller(void *args) {
     Data *data = (Data *) args;
     Patient *patient = data->patient;
     MQHandler *mqHandler = data->mqHandler;
     Syringe *sManager = data->sManager;
+    Telemetry *telemetry = &mqHandler->telemetry;
+    PeriodicTask task(CYCLE_NS, data->overrun,
+            &telemetry->jitter[CONTROLLER_TASK]);
+    FrameWriter out(mqHandler, CONTROLLER_DEVICE);
+    Controller<Policy> controller;
+    // commands are only sent when they change, plus the heartbeats
+    bool edge = !data->levelTriggered;
+    EdgeTrigger glucoseOut(edge, data->heartbeat);
+    EdgeTrigger insulineOut(edge, data->heartbeat);
+    EdgeTrigger alarmOut(edge);
+    long long start = monotonicNs();
 
     for (int i = 0; i < EXECUTION_CYCLE; ++i) {
-        usleep(1000000 * CYCLE_TIME * FACTOR_TIME);
-        // call the glycemia module
-        double glycemia = patient->computeGlycemia();
-        // case of critical glycemia
-        // add messages in glucose, insuline and display queues
-        if (glycemia <= patient->glycemia_crit) {
-            Message msg_glucose = START;
-            Message msg_insuline = STOP;
-            Message msg_critical = GLYCEMIA_CRITICAL;
-            int r = mq_send(mqHandler->qw_glucose, (const char *) &msg_glucose,
-                        sizeof(msg_glucose), CRITICAL);
-            CHECK(r >= 0, "Error sending glucose msg");
-            r = mq_send(mqHandler->qw_insuline, (const char *) &msg_insuline,
-                        sizeof(msg_insuline), CRITICAL);
-            CHECK(r >= 0, "Error sending insuline msg");
-
-            r = mq_send(mqHandler->qw_display, (const char *) &msg_critical,
-                        sizeof(msg_critical), CRITICAL);
-            CHECK(r >= 0, "Error sending display msg");
-        } else if (glycemia >= patient->glycemia_ref) {
-            // case of normal glycemia
-            // add messages in glucose, insuline and display queues
-            Message msg_glucose = STOP;
-            Message msg_insuline = START;
-            Message msg_normal = GLYCEMIA_NORMAL;
-            int r = mq_send(mqHandler->qw_glucose, (const char *) &msg_glucose,
-                        sizeof(msg_glucose), URGENT);
-            CHECK(r >= 0, "Error sending glucose msg");
-
-            r = mq_send(mqHandler->qw_insuline, (const char *) &msg_insuline,
-                        sizeof(msg_insuline), URGENT);
-            CHECK(r >= 0, "Error sending insuline  msg");
-
-            r = mq_send(mqHandler->qw_display, (const char *) &msg_normal,
-                        sizeof(msg_normal), NORMAL);
-            CHECK(r >= 0, "Error sending display msg");
+        task.wait();
+        // call the glycemia module, unless no pump injected since the
+        // last cycle: the last glycemia and decision hold then
+        double glycemia;
+        Decision d = controller.decide(*patient, glycemia);
+        data->stats->add(glycemia);
+        // post the glucose and insuline commands, a pump without command
+        // gets its heartbeat
+        if (d.glucose == NONE) {
+            if (glucoseOut.idleCycle())
+                mqHandler->command(GLUCOSE_DEVICE,
+                        (Message) glucoseOut.command());
+        } else if (glucoseOut.update(d.glucose)) {
+            if (d.glucose == START)
+                telemetry->decided(GLUCOSE_PUMP);
+            mqHandler->command(GLUCOSE_DEVICE, d.glucose);
         }
+        if (d.insuline == NONE) {
+            if (insulineOut.idleCycle())
+                mqHandler->command(INSULINE_DEVICE,
+                        (Message) insulineOut.command());
+        } else if (insulineOut.update(d.insuline)) {
+            if (d.insuline == START)
+                telemetry->decided(INSULINE_PUMP);
+            mqHandler->command(INSULINE_DEVICE, d.insuline);
+        }
+        // add a message in the display queue on a critical or normal
+        // glycemia
+        if (d.alarm != NONE && alarmOut.update(d.alarm))
+            out.add(d.alarm, d.alarm == GLYCEMIA_CRITICAL ? CRITICAL : NORMAL,
+                    glycemia);
+        // the frames of a cycle go in one send, they wait for the next
+        // cycle if the display channel is full
+        int r = out.flush();
+        CHECK(r >= 0, "Error sending display msg");
+        // the monitors read the state from the segment, not from the tasks
+        if (data->live)
+            data->live->publish(0, liveSnapshot(*patient, *sManager));
     }
 
-    // at simulation end send halt message in the queue q_glucose, q_display, q_insuline
-    Message msg = HALT;
-    int r = mq_send(mqHandler->qw_glucose, (const char *) &msg,
-                sizeof(msg), NORMAL);
-    CHECK(r >= 0, "Error sending glucose msg halt");
-    r = mq_send(mqHandler->qw_insuline, (const char *) &msg,
-                sizeof(msg), NORMAL);
-    CHECK(r >= 0, "Error sending glucose msg halt");
-    r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                sizeof(msg), NORMAL);
+    // at simulation end post halt to the glucose and insuline tasks and
+    // send it in the display queue
+    mqHandler->command(GLUCOSE_DEVICE, HALT);
+    mqHandler->command(INSULINE_DEVICE, HALT);
+    // the display ends on halt, it must get it
+    out.add(HALT, NORMAL);
+    int r = out.drain();
     CHECK(r >= 0, "Error sending display msg halt");
 
-    // call stop method to stop the syringe usage
-    pthread_mutex_lock(&sManager->m_syringe);
+    // call stop method to stop the syringe usage, this wakes up t_syringe
     sManager->stop();
-    pthread_cond_signal(&mqHandler->cv_syringe);
-    pthread_mutex_unlock(&sManager->m_syringe);
+
+    task.finish();
+    task.report("controller", std::cerr);
+    reportCommands(glucoseOut, insulineOut, alarmOut,
+            (monotonicNs() - start) / 3.6e12, std::cerr);
+    std::cerr << "controller: "
+              << controller.decisionCache().hits * 100.0 / (EXECUTION_CYCLE)
+              << "% decisions cached" << std::endl;
+    data->stats->report("glycemia", std::cerr);
 
     pthread_exit(NULL);
 }
 
+// controller task of each policy, indexed by PolicyId
+static void *(*const controllerTasks[POLICIES])(void *) = {
+    t_controller<BangBang>,
+    t_controller<Hysteresis>,
+    t_controller<Pid>,
+    t_controller<Predictive>,
+};
+
 // task in charge of injecting glucose
 void *t_glucose(void *args) {
     Data *data = (Data *) args;
     Patient *patient = data->patient;
     MQHandler *mqHandler = data->mqHandler;
     bool isInjecting = false;
+    // version of the last command read in the mailbox
+    unsigned seen = 0;
+    Telemetry *telemetry = &mqHandler->telemetry;
+    PeriodicTask task(CYCLE_NS, data->overrun,
+            &telemetry->jitter[GLUCOSE_TASK]);
+    FrameWriter out(mqHandler, GLUCOSE_DEVICE);
+    // time of the decision of the controller not acted on yet, 0 if none
+    long long decision = 0;
 
     while (true) {
-        usleep(1000000 * CYCLE_TIME * FACTOR_TIME);
         Message msg = NONE;
-        mq_attr attr, old_attr;
-        mq_getattr(mqHandler->qr_glucose, &attr);
-        if (attr.mq_curmsgs != 0) {
-            // First set the queue to not block any calls
-            attr.mq_flags = O_NONBLOCK;
-            mq_setattr(mqHandler->qr_glucose, &attr, &old_attr);
-            // Now consume all of the messages. Only the last one is usefull
-            while (mq_receive(mqHandler->qr_glucose,
-                        (char *) &msg, MSG_SIZE, NULL) != -1) {}
-            CHECK(errno == EAGAIN, "Error receiving glucose msg");
-
-            // Now restore the attributes
-            mq_setattr(mqHandler->qr_glucose, &old_attr, NULL);
+        // wait for a command until the next release. A command is handled
+        // as soon as the controller posts it, the injection is done at the
+        // release
+        if (!mqHandler->waitCommand(GLUCOSE_DEVICE, msg, seen,
+                task.deadline())) {
+            task.begin();
+            if (isInjecting) {
+                // glucose injection
+                patient->injectGlucose();
+                if (decision) {
+                    telemetry->acted(GLUCOSE_PUMP, decision);
+                    decision = 0;
+                }
+            }
+            // frames kept while the display channel was full
+            int r = out.flush();
+            CHECK(r >= 0, "Error sending display msg");
+            task.finish();
+            continue;
         }
         // set the variable is injecting to start the injection
         // and add a message in q_display_queue
+        // a heartbeat repeats the last command, only a change is displayed
         if (msg == START) {
+            if (!isInjecting) {
+                decision = telemetry->decision(GLUCOSE_PUMP);
+                out.add(GLUCOSE_START, URGENT);
+            }
             isInjecting = true;
-            Message msg = GLUCOSE_START;
-            int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                        sizeof(msg), URGENT);
-            CHECK(r >= 0, "Error sending display msg");
         } else if (msg == STOP) {
             // add a message in q_display_queue to indiquate the glucose
             // injection stop
-            Message msg = GLUCOSE_STOP;
-            int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                        sizeof(msg), NORMAL);
-            CHECK(r >= 0, "Error sending display msg");
+            if (isInjecting)
+                out.add(GLUCOSE_STOP, NORMAL);
             isInjecting = false;
         } else if (msg == HALT) {
+            task.report("glucose", std::cerr);
             pthread_exit(NULL);
         }
-
-        if (isInjecting) {
-            // glucose injection
-            patient->injectGlucose();
-        }
+        int r = out.flush();
+        CHECK(r >= 0, "Error sending display msg");
     }
 }
 
@@ -160,128 +226,94 @@ void *t_insuline(void *args) {
     MQHandler *mqHandler = data->mqHandler;
     Syringe *sManager = data->sManager;
     bool isInjecting = true;
+    unsigned seen = 0;
+    Telemetry *telemetry = &mqHandler->telemetry;
+    PeriodicTask task(CYCLE_NS, data->overrun,
+            &telemetry->jitter[INSULINE_TASK]);
+    FrameWriter out(mqHandler, INSULINE_DEVICE);
+    long long decision = 0;
 
     while (true) {
-        usleep(1000000 * CYCLE_TIME * FACTOR_TIME);
         Message msg = NONE;
-
-        mq_attr attr, old_attr;
-        mq_getattr (mqHandler->qr_insuline, &attr);
-        if (attr.mq_curmsgs != 0) {
-            attr.mq_flags = O_NONBLOCK;
-            mq_setattr(mqHandler->qr_insuline, &attr, &old_attr);
-            while (mq_receive(mqHandler->qr_insuline,
-                        (char *) &msg, MSG_SIZE, NULL) != -1) {}
-            CHECK(errno == EAGAIN, "Error receiving insuline msg");
-
-            mq_setattr(mqHandler->qr_insuline, &old_attr, NULL);
+        // same as t_glucose, commands at once and injections at the releases
+        if (!mqHandler->waitCommand(INSULINE_DEVICE, msg, seen,
+                task.deadline())) {
+            task.begin();
+            if (isInjecting) {
+                // pump the insuline solution, the syringe wakes up t_syringe
+                // only if the level crossed one of its thresholds
+                sManager->pump();
+                // pump the insuline solution
+                patient->injectInsuline();
+                if (decision) {
+                    telemetry->acted(INSULINE_PUMP, decision);
+                    decision = 0;
+                }
+            }
+            int r = out.flush();
+            CHECK(r >= 0, "Error sending display msg");
+            task.finish();
+            continue;
         }
 
         if (msg == START) {
             // set the variable is injecting to start the injection
             // and add a message in q_display_queue
+            if (!isInjecting) {
+                decision = telemetry->decision(INSULINE_PUMP);
+                out.add(INSULINE_START, URGENT);
+            }
             isInjecting = true;
-            Message msg = INSULINE_START;
-            int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                        sizeof(msg), URGENT);
-            CHECK(r >= 0, "Error sending display msg");
         } else if (msg == STOP) {
             // add a message in q_display_queue
-            Message msg = INSULINE_STOP;
-            int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                        sizeof(msg), NORMAL);
-            CHECK(r >= 0, "Error sending display msg");
+            if (isInjecting)
+                out.add(INSULINE_STOP, NORMAL);
             isInjecting = false;
         } else if (msg == HALT) {
+            task.report("insuline", std::cerr);
             pthread_exit(NULL);
         }
-
-        if (isInjecting) {
-            // pump the insuline solution
-            // this action need to be protected by a mutex as
-            // s_level variable is shared with t_syringe task
-            pthread_mutex_lock(&sManager->m_syringe);
-            sManager->pump();
-            // send a signal that indiquate that syringe level is changing
-            pthread_cond_signal(&mqHandler->cv_syringe);
-            pthread_mutex_unlock(&sManager->m_syringe);
-            // pump the insuline solution
-            patient->injectInsuline();
-        }
+        int r = out.flush();
+        CHECK(r >= 0, "Error sending display msg");
     }
 }
 
 // task responsable of displaying the alerts and informations
-// messages found in qr_display queue
+// messages found in the display channel
 void *t_display(void *args) {
     Data *data = (Data *) args;
     MQHandler *mqHandler = data->mqHandler;
 
+    Frame frames[FRAME_BATCH];
+
     while (true) {
-        Message msg = NONE;
-        if (mq_receive(mqHandler->qr_display,
-                    (char *) &msg, MSG_SIZE, NULL) == -1)
-        {
-            std::cerr << "Error receiving display msg" << std::endl;
+        int n = mqHandler->receive(frames);
+        // a signal only interrupts the wait, any other error would come
+        // back on every receive: the display stops instead of spinning
+        if (n == -1 && errno == EINTR)
             continue;
-        }
-        std::string msgText;
-        switch(msg) {
-            case HALT:
-                msgText = "Stopping the system";
-                break;
-            case GLYCEMIA_CRITICAL:
-                msgText = "Glycemia critical";
-                break;
-            case GLYCEMIA_NORMAL:
-                msgText = "Glycemia normal";
-                break;
-            case GLUCOSE_START:
-                msgText = "Start glucose injection";
-                break;
-            case GLUCOSE_STOP:
-                msgText = "Stop glucose injection";
-                break;
-            case INSULINE_START:
-                msgText = "Start insuline injection";
-                break;
-            case INSULINE_STOP:
-                msgText = "Stop insuline injection";
-                break;
-            case ANTIBIO_INJECT:
-                msgText = "Antibiotic injection";
-                break;
-            case ANTICOAG_INJECT:
-                msgText = "Antiocoagulant injection";
-                break;
-            case SYRINGE_1_LOW:
-                msgText = "Solution level in syringe 1 reaches 5%";
-                break;
-            case SYRINGE_2_LOW:
-                msgText = "Solution level in syringe 2 reaches 5%";
-                break;
-            case SYRINGE_1_CRITICAL:
-                msgText = "Solution level in syringe 1 reaches 1%";
-                break;
-            case SYRINGE_2_CRITICAL:
-                msgText = "Solution level in syringe 2 reaches 1%";
-                break;
-            case SWITCH:
-                msgText = "Switch between syringe";
-                break;
-            case RESET:
-                msgText = "Reset inactive syringe";
-                break;
-            case START:
-            case STOP:
-            case NONE:
-                break;
-        }
-        std::cout << msgText << std::endl;
-
-        if (msg == HALT) {
+        if (n == -1) {
+            CHECK(false, "Error receiving display msg: " << strerror(errno));
             pthread_exit(NULL);
         }
+        for (int i = 0; i < n; ++i) {
+            Message msg = (Message) frames[i].code;
+            const char *payload = payloadName(msg);
+            // the log only copies a record to the buffer of this thread,
+            // the text is made offline by LogDecoder
+            if (data->log) {
+                data->log->log(frames[i].patient, msg, frames[i].value);
+            } else if (payload) {
+                std::cout << messageText(msg) << " (" << payload << " "
+                          << frames[i].value << ")" << std::endl;
+            } else {
+                std::cout << messageText(msg) << std::endl;
+            }
+
+            if (msg == HALT) {
+                pthread_exit(NULL);
+            }
+        }
     }
 }
 
@@ -291,22 +323,24 @@ void *t_syringe(void *args) {
     Data *data = (Data *) args;
     MQHandler *mqHandler = data->mqHandler;
     Syringe *sManager = data->sManager;
+    FrameWriter out(mqHandler, SYRINGE_DEVICE);
 
     while (true) {
-        // waiting for condvar signal indiquating that the current syringe level changed
-        pthread_mutex_lock(&sManager->m_syringe);
-        pthread_cond_wait(&mqHandler->cv_syringe, &sManager->m_syringe);
-        // read the shared variables s_level and s_activate
-        double level = sManager->inspect();
-        int s_active = sManager->getActiveSyringe();
-        pthread_mutex_unlock(&sManager->m_syringe);
+        // waiting for the level of the active syringe to cross level_weak
+        // or level_critical
+        Syringe::Crossing crossing = { 0, 0, 0 };
+        if (!sManager->waitCrossing(data->syringeObserver, crossing)) {
+            // the syringe is stopped, stop the thread
+            std::cerr << "Syringe: " << sManager->pumpCount() << " pumps, "
+                      << sManager->wakeupCount(data->syringeObserver)
+                      << " wakeups" << std::endl;
+            pthread_exit(NULL);
+        }
+        int s_active = crossing.active;
 
         Message msg = NONE;
 
-        if (level < 0) {
-            // stop the thread
-            pthread_exit(NULL);
-        } else if (level == Syringe::level_critical) {
+        if (crossing.threshold == Syringe::level_critical) {
             // switch and reset syringe when level reach 1%
             if (s_active == 0)
                 msg = SYRINGE_1_CRITICAL;
@@ -315,144 +349,495 @@ void *t_syringe(void *args) {
 
             // add message in q_display queue indicating that syringe level
             // reach 1%
-            int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                    sizeof(msg), URGENT);
-            CHECK(r >= 0, "Error sending syringe level msg");
+            out.add(msg, URGENT, crossing.level);
 
             sManager->syringeSwitch();
-
-            msg = SWITCH;
-            r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                    sizeof(msg), NORMAL);
-            CHECK(r >= 0, "Error sending syringe switch msg");
+            out.add(SWITCH, NORMAL);
 
             sManager->reset();
-
-            msg = RESET;
-            r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                    sizeof(msg), NORMAL);
-            CHECK(r >= 0, "Error sending syringe reset msg");
-        } else if (level == Syringe::level_weak) {
+            out.add(RESET, NORMAL);
+        } else if (crossing.threshold == Syringe::level_weak) {
             if (s_active == 0)
                 msg = SYRINGE_1_LOW;
             else
                 msg = SYRINGE_2_LOW;
             // add message in q_display queue indicating that syringe level reach 5%
-            int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                    sizeof(msg), NORMAL);
-            CHECK(r >= 0, "Error sending syringe level msg");
+            out.add(msg, NORMAL, crossing.level);
         }
+        // the level, switch and reset messages go in one send
+        int r = out.flush();
+        CHECK(r >= 0, "Error sending syringe msg");
     }
 }
 
 // add a message ANTIBIO_INJECT in the display queue
-void t_antibio(sigval args) {
-    Data *data = (Data *) args.sival_ptr;
-    MQHandler *mqHandler = data->mqHandler;
+void t_antibio(void *args, long long time) {
+    (void) time;
+    Data *data = (Data *) args;
 
-    Message msg = ANTIBIO_INJECT;
-    int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                sizeof(msg), WEAK);
+    data->timerOut->add(ANTIBIO_INJECT, WEAK);
+    int r = data->timerOut->flush();
     CHECK(r >= 0, "Error sending display msg ANTIBIO_INJECT");
 }
 
 // add a message ANTICOAG_INJECT in the display queue
-void t_anticoag(sigval args) {
-    Data *data = (Data *) args.sival_ptr;
-    MQHandler *mqHandler = data->mqHandler;
+void t_anticoag(void *args, long long time) {
+    (void) time;
+    Data *data = (Data *) args;
 
-    Message msg = ANTICOAG_INJECT;
-    int r = mq_send(mqHandler->qw_display, (const char *) &msg,
-                sizeof(msg), WEAK);
+    data->timerOut->add(ANTICOAG_INJECT, WEAK);
+    int r = data->timerOut->flush();
     CHECK(r >= 0, "Error sending display msg ANTICOAG_INJECT");
 }
 
+// load of the stress tasks, they run until stop is set
+struct Stress {
+    long long burst;
+    long long rest;
+    int stop;
+};
+
+// task of middle priority taking the cpu from the tasks below it in bursts,
+// so a task of higher priority waiting for a lock they hold waits longer
+// unless the lock lends them its priority
+void *t_stress(void *args) {
+    Stress *stress = (Stress *) args;
+    while (!__atomic_load_n(&stress->stop, __ATOMIC_RELAXED)) {
+        long long end = monotonicNs() + stress->burst;
+        while (monotonicNs() < end) {}
+        sleepUntil(monotonicNs() + stress->rest);
+    }
+    return NULL;
+}
+
+// print the worst wait of each task for the locks, and the part of it behind
+// a task of lower priority
+void reportBlocking(const LockStats *const *locks, int nLocks,
+        std::ostream &os) {
+    static const char *names[] = {
+        "controller", "syringe", "glucose", "insuline", "display"
+    };
+    static const int priorities[] = {
+        VERY_CRITICAL, CRITICAL, VERY_URGENT, URGENT, NORMAL
+    };
+    os << "worst blocking (" << lockProtocolName(defaultLockProtocol())
+       << "):";
+    for (int t = 0; t < 5; ++t) {
+        long long wait = 0;
+        long long inversion = 0;
+        for (int l = 0; l < nLocks; ++l) {
+            if (locks[l]->worstWait[priorities[t]] > wait)
+                wait = locks[l]->worstWait[priorities[t]];
+            if (locks[l]->worstInversion[priorities[t]] > inversion)
+                inversion = locks[l]->worstInversion[priorities[t]];
+        }
+        os << " " << names[t] << " " << wait / 1000 << " us ("
+           << inversion / 1000 << " inverted)";
+    }
+    os << std::endl;
+}
+
+// one JSON line of the glycemia statistics of patient id, -1 for all of
+// them
+void writeStats(std::ostream &os, int id, const GlycemiaStats &stats) {
+    os << "{\"patient\":";
+    if (id < 0)
+        os << "\"all\"";
+    else
+        os << id;
+    os << ",\"glycemia\":";
+    stats.writeJson(os);
+    os << "}\n";
+}
+
+// open path to append the glycemia statistics, NULL if path is NULL
+std::ofstream *openStats(const char *path) {
+    if (path == NULL)
+        return NULL;
+    std::ofstream *out = new std::ofstream(path, std::ios::app);
+    CHECK(*out, "Error opening statistics file " << path);
+    return out;
+}
+
+// run a ward of nBeds patients in real time on a pool of nWorkers threads,
+// stealing the steps of each other if steal
+int runWard(int nBeds, int nWorkers, const char *logPath, int policy,
+        const char *liveName, bool steal, const char *statsPath) {
+    EventLog *log = logPath ? new EventLog(logPath) : NULL;
+    LiveState *live = liveName ? new LiveState(liveName, nBeds) : NULL;
+    {
+        Ward ward(nBeds, nWorkers, true, log);
+        ward.setController(policySteps[policy]);
+        ward.setLive(live);
+        ward.setStealing(steal);
+        ward.run(EXECUTION_CYCLE, CYCLE_TIME * FACTOR_TIME);
+        std::cout.flush();
+        ward.report(std::cerr);
+        GlycemiaStats total;
+        ward.mergeStats(total);
+        total.report("glycemia", std::cerr);
+        std::ofstream *out = openStats(statsPath);
+        for (int i = 0; out && i < nBeds; ++i)
+            writeStats(*out, i, ward.bed(i)->stats);
+        if (out)
+            writeStats(*out, -1, total);
+        delete out;
+    }
+    // the workers are stopped, the log can write the last records
+    if (log) {
+        std::cerr << log->dropCount() << " events dropped" << std::endl;
+        delete log;
+    }
+    delete live;
+    return 0;
+}
+
+#if defined(__cpp_impl_coroutine)
+// run a ward of nBeds patients in real time, their tasks as coroutines on
+// nShards threads
+int runCoroutines(int nBeds, int nShards, const char *logPath, int policy,
+        bool edge, int heartbeat, const char *statsPath) {
+    EventLog *log = logPath ? new EventLog(logPath) : NULL;
+    {
+        CoWard ward(nBeds, nShards, true, log);
+        ward.setTrigger(edge, heartbeat);
+        ward.run(EXECUTION_CYCLE, CYCLE_NS, policy);
+        ward.report(std::cerr);
+        GlycemiaStats total;
+        ward.mergeStats(total);
+        total.report("glycemia", std::cerr);
+        std::ofstream *out = openStats(statsPath);
+        for (int i = 0; out && i < nBeds; ++i)
+            writeStats(*out, i, ward.bed(i)->stats);
+        if (out)
+            writeStats(*out, -1, total);
+        delete out;
+    }
+    if (log) {
+        std::cerr << log->dropCount() << " events dropped" << std::endl;
+        delete log;
+    }
+    return 0;
+}
+#endif
+
+// report the controller cycle time of a ward from 1 to 10000 patients,
+// cycles are run back to back
+int scanWard(int nWorkers, bool steal) {
+    for (int nBeds = 1; nBeds <= 10000; nBeds *= 10) {
+        Ward ward(nBeds, nWorkers);
+        ward.setStealing(steal);
+        ward.run(EXECUTION_CYCLE, 0);
+        ward.report(std::cout);
+    }
+    return 0;
+}
+
+// run nCycles controller cycles of the simulation mode on the virtual clock
+int runSimulation(int nCycles, unsigned seed, bool edge, int heartbeat,
+        int policy, const char *statsPath) {
+    long long start = monotonicNs();
+    Simulation sim(CYCLE_NS, nCycles, seed, std::cout);
+    sim.setController(policySteps[policy]);
+    Bed *bed = sim.patientBed();
+    bed->setTrigger(edge, heartbeat);
+    // same schedules as the antibiotic and anticoagulant timers
+    sim.addDose(ANTIBIO_INJECT, clock_t(130 * FACTOR_TIME) * 1000000000LL,
+            clock_t(4*3600 * FACTOR_TIME) * 1000000000LL);
+    sim.addDose(ANTICOAG_INJECT, clock_t(10 * FACTOR_TIME) * 1000000000LL,
+            clock_t(24*3600 * FACTOR_TIME) * 1000000000LL);
+    sim.run();
+    std::cout.flush();
+    std::cerr << "simulated " << sim.now() / 1000000 << " ms in "
+              << (monotonicNs() - start) / 1000 << " us" << std::endl;
+    reportCommands(bed->glucoseOut, bed->insulineOut, bed->alarmOut,
+            sim.now() / 3.6e12, std::cerr);
+    bed->stats.report("glycemia", std::cerr);
+    std::ofstream *out = openStats(statsPath);
+    if (out)
+        writeStats(*out, 0, bed->stats);
+    delete out;
+    return 0;
+}
+
+// cpus of the tasks in the order they are created from a list like
+// 0,1,1,2,3, -1 for the ones not given
+void parseCpus(const char *list, int *cpus, int n) {
+    for (int i = 0; i < n; ++i)
+        cpus[i] = -1;
+    for (int i = 0; list && *list && i < n; ++i) {
+        char *end;
+        cpus[i] = (int) strtol(list, &end, 10);
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+// value given to the option name, NULL if it is not in argv
+const char *option(int argc, char **argv, const char *name) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], name) == 0)
+            return argv[i + 1];
+    }
+    return NULL;
+}
+
+// true if the option name is in argv
+bool flag(int argc, char **argv, const char *name) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
 int main(int argc, char **argv) {
 
+    // binary event log instead of the display: --log <file>
+    const char *logPath = option(argc, argv, "--log");
+    // trace of the threaded mode for TraceReplay: --record <file>
+    const char *tracePath = option(argc, argv, "--record");
+    // shared memory segment of the live state for LiveMonitor: --live <name>
+    const char *liveName = option(argc, argv, "--live");
+    // glycemia statistics of each patient at the end: --stats <file>
+    const char *statsPath = option(argc, argv, "--stats");
+    // commands of the controller: --level to send them every cycle,
+    // --heartbeat <cycles> to send them again after that many cycles
+    bool levelTriggered = flag(argc, argv, "--level");
+    const char *heartbeat = option(argc, argv, "--heartbeat");
+    int heartbeatCycles = heartbeat ? atoi(heartbeat) : 0;
+    // control law: --policy bangbang|hysteresis|pid|predictive
+    const char *policyArg = option(argc, argv, "--policy");
+    int policy = policyArg ? findPolicy(policyArg) : BANG_BANG;
+    if (policy < 0) {
+        std::cerr << "Unknown policy `" << policyArg << "`" << std::endl;
+        return 1;
+    }
+
+    // ward modes: GlycemiaRegulator --ward <patients> [workers]
+    //             GlycemiaRegulator --ward-scan [workers]
+    // with --steal the workers take the steps by priority and steal them
+    bool steal = flag(argc, argv, "--steal");
+    if (argc > 1 && strcmp(argv[1], "--ward") == 0) {
+        int nBeds = argc > 2 ? atoi(argv[2]) : 1;
+        int nWorkers = argc > 3 && argv[3][0] != '-'
+            ? atoi(argv[3]) : WARD_WORKERS;
+        return runWard(nBeds, nWorkers, logPath, policy, liveName, steal,
+                statsPath);
+    }
+    if (argc > 1 && strcmp(argv[1], "--ward-scan") == 0)
+        return scanWard(argc > 2 && argv[2][0] != '-'
+                ? atoi(argv[2]) : WARD_WORKERS, steal);
+
+    // coroutine mode: GlycemiaRegulator --coroutines <patients> [shards]
+    if (argc > 1 && strcmp(argv[1], "--coroutines") == 0) {
+#if defined(__cpp_impl_coroutine)
+        int nBeds = argc > 2 ? atoi(argv[2]) : 1;
+        int nShards = argc > 3 && argv[3][0] != '-' ? atoi(argv[3]) : 1;
+        return runCoroutines(nBeds, nShards, logPath, policy,
+                !levelTriggered, heartbeatCycles, statsPath);
+#else
+        std::cerr << "--coroutines needs a C++20 build" << std::endl;
+        return 1;
+#endif
+    }
+
+    // simulation mode: GlycemiaRegulator --sim [cycles] [seed]
+    if (argc > 1 && strcmp(argv[1], "--sim") == 0) {
+        int nCycles = argc > 2 && argv[2][0] != '-'
+            ? atoi(argv[2]) : EXECUTION_CYCLE;
+        unsigned seed = argc > 3 && argv[3][0] != '-' ? atoi(argv[3]) : 0;
+        return runSimulation(nCycles, seed, !levelTriggered, heartbeatCycles,
+                policy, statsPath);
+    }
+
+    // benchmarks: GlycemiaRegulator --bench <name>|all
+    if (argc > 2 && strcmp(argv[1], "--bench") == 0)
+        return runBenchmark(argv[2]);
+
+    // backend of the task channels: GlycemiaRegulator --transport mqueue|ring
+    // overrun policy of the periodic tasks: --overrun skip|catchup|compress
+    // export of the telemetry: --telemetry <file>
+    const char *transportArg = option(argc, argv, "--transport");
+    int transport = transportArg ? findTransport(transportArg) : MQUEUE;
+    if (transport < 0) {
+        std::cerr << "Unknown transport `" << transportArg << "`"
+                  << std::endl;
+        return 1;
+    }
+    const char *overrunArg = option(argc, argv, "--overrun");
+    int overrun = overrunArg ? findOverrun(overrunArg) : SKIP;
+    if (overrun < 0) {
+        std::cerr << "Unknown overrun `" << overrunArg << "`" << std::endl;
+        return 1;
+    }
+    const char *telemetryPath = option(argc, argv, "--telemetry");
+
+    // real-time mode: --rt locks the memory, pre-faults the stacks and
+    // pins the tasks to the cpus of --cpus <controller,syringe,glucose,
+    // insuline,display>
+    RealTime rt(flag(argc, argv, "--rt"));
+    int cpus[5];
+    parseCpus(option(argc, argv, "--cpus"), cpus, 5);
+    rt.setMainPriority(VERY_CRITICAL);
+
+    // protocol of the shared locks: --lock-protocol inherit|ceiling|none,
+    // to be set before the locks are made
+    const char *protocol = option(argc, argv, "--lock-protocol");
+    if (protocol && strcmp(protocol, "none") == 0)
+        defaultLockProtocol() = LOCK_NONE;
+    if (protocol && strcmp(protocol, "ceiling") == 0) {
+        // a ceiling lock fails for the threads the system keeps out of
+        // SCHED_FIFO, they would share the data unlocked
+        CHECK(rt.mainPriorityError() == 0,
+                "No SCHED_FIFO for the ceiling protocol, using inherit");
+        if (rt.mainPriorityError() == 0)
+            defaultLockProtocol() = LOCK_CEILING;
+    }
+
     // create data structure and instantiate the classes
     // Patient, MQHandler, Syringe
     Patient patient;
-    MQHandler mqHandler;
+    MQHandler mqHandler((Transport) transport);
+    // what the writers of the display do when it is full:
+    // --backpressure block|timeout|drop|coalesce|overflow
+    const char *backpressure = option(argc, argv, "--backpressure");
+    if (backpressure) {
+        int id = findBackpressure(backpressure);
+        if (id < 0) {
+            std::cerr << "Unknown backpressure `" << backpressure << "`"
+                      << std::endl;
+            return 1;
+        }
+        mqHandler.backpressure = (Backpressure) id;
+    }
     Syringe sManager;
-    Data data = {&patient, &mqHandler, &sManager};
+    GlycemiaStats stats;
+    // the antibiotic and anticoagulant timers share the timer thread and
+    // its device
+    FrameWriter timerOut(&mqHandler, TIMER_DEVICE);
+    // t_syringe observes the syringe from before the first pump
+    double thresholds[] = { Syringe::level_weak, Syringe::level_critical };
+    Data data = {&patient, &mqHandler, &sManager,
+        sManager.subscribe(thresholds, 2), (Overrun) overrun,
+        logPath ? new EventLog(logPath) : NULL, levelTriggered,
+        heartbeatCycles, liveName ? new LiveState(liveName, 1) : NULL,
+        &stats, &timerOut};
+
+    // record the patient, the syringe and the messages for TraceReplay
+    TraceRecorder *recorder = NULL;
+    if (tracePath) {
+        recorder = new TraceRecorder(tracePath, policy, levelTriggered,
+                heartbeatCycles);
+        patient.setRecorder(recorder);
+        sManager.setRecorder(recorder);
+        mqHandler.recorder = recorder;
+    }
 
-    sched_param s_param;
-    pthread_attr_t attr;
-    setprio(0, 20);
-    pthread_attr_init(&attr);
-    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
-    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    // export the telemetry while the tasks run
+    TelemetryExporter *exporter = NULL;
+    if (telemetryPath)
+        exporter = new TelemetryExporter(&mqHandler.telemetry, telemetryPath,
+                TELEMETRY_PERIOD);
+
+    // hold times and waits of the locks shared by tasks of different
+    // priorities
+    LockStats syringeLock("m_syringe");
+    LockStats glucoseLock("glucose mailbox");
+    LockStats insulineLock("insuline mailbox");
+    sManager.setLockStats(&syringeLock);
+    mqHandler.glucose.setLockStats(&glucoseLock);
+    mqHandler.insuline.setLockStats(&insulineLock);
+
+    // everything the tasks use is allocated by now
+    rt.lockMemory();
 
     // create the thread th_controller with most high priority
     pthread_t th_controller;
-    s_param.sched_priority = VERY_CRITICAL;
-    pthread_attr_setschedparam(&attr, &s_param);
-    pthread_create(&th_controller, &attr, t_controller, &data);
+    rt.createTask(&th_controller, "controller", VERY_CRITICAL, cpus[0],
+            controllerTasks[policy], &data);
 
     // create the thread th_syringe with critical  priority
     pthread_t th_syringe;
-    s_param.sched_priority = CRITICAL;
-    pthread_attr_setschedparam(&attr, &s_param);
-    pthread_create(&th_controller, &attr, t_syringe, &data);
+    rt.createTask(&th_syringe, "syringe", CRITICAL, cpus[1], t_syringe,
+            &data);
 
     // create the thread th_glucose with very urgent priority
     pthread_t th_glucose;
-    s_param.sched_priority = VERY_URGENT;
-    pthread_attr_setschedparam(&attr, &s_param);
-    pthread_create(&th_glucose, &attr, t_glucose, &data);
+    rt.createTask(&th_glucose, "glucose", VERY_URGENT, cpus[2], t_glucose,
+            &data);
 
     // create the thread th_insuline with urgent priority
     pthread_t th_insuline;
-    s_param.sched_priority = URGENT;
-    pthread_attr_setschedparam(&attr, &s_param);
-    pthread_create(&th_insuline, &attr, t_insuline, &data);
+    rt.createTask(&th_insuline, "insuline", URGENT, cpus[3], t_insuline,
+            &data);
 
     // create the thread th_display with normal priority
     pthread_t th_display;
-    s_param.sched_priority = NORMAL;
-    pthread_attr_setschedparam(&attr, &s_param);
-    pthread_create(&th_display, &attr, t_display, &data);
-
-    // create timer and sigevent to simulate the period task antibiotic injection
-    timer_t timerAntibioId;
-    itimerspec timerAntibio;
-    sigevent eventAntibio;
-
-    SIGEV_THREAD_INIT(&eventAntibio, t_antibio, &data, NULL);
-    timer_create(CLOCK_REALTIME, &eventAntibio, &timerAntibioId);
-
-    // set the start time for the timer
-    timerAntibio.it_value.tv_sec = clock_t(130 * FACTOR_TIME);
-    timerAntibio.it_value.tv_nsec= 0;
-    // set the timer period
-    timerAntibio.it_interval.tv_sec = clock_t(4*3600 * FACTOR_TIME);
-    timerAntibio.it_interval.tv_nsec = 0;
-
-    timer_settime(timerAntibioId, 0, &timerAntibio, NULL);
-
-    // create timer and sigevent to simulate the period task anticoagulant injection
-    timer_t timerAnticoagId;
-    itimerspec timerAnticoag;
-    sigevent eventAnticoag;
+    rt.createTask(&th_display, "display", NORMAL, cpus[4], t_display,
+            &data);
+
+    // stress mode: --stress adds two tasks of middle priority on the cpu of
+    // th_insuline, one between th_syringe and th_glucose and one between
+    // th_glucose and th_insuline, the holders of the locks
+    Stress stress = { STRESS_BURST, STRESS_REST, 0 };
+    bool stressed = flag(argc, argv, "--stress");
+    pthread_t th_stress[2];
+    if (stressed) {
+        rt.createTask(&th_stress[0], "stress", (CRITICAL + VERY_URGENT) / 2,
+                cpus[3], t_stress, &stress);
+        rt.createTask(&th_stress[1], "stress", (VERY_URGENT + URGENT) / 2,
+                cpus[3], t_stress, &stress);
+    }
 
-    SIGEV_THREAD_INIT(&eventAnticoag, t_anticoag, &data, NULL);
-    timer_create(CLOCK_REALTIME, &eventAnticoag, &timerAnticoagId);
+    // the periodic medications share one timer thread with a 1 ms tick
+    // instead of a thread per expiry of a POSIX timer
+    TimerService timers(TIMER_TICK);
 
-    // set the start time for the timer
-    timerAnticoag.it_value.tv_sec = clock_t(10 * FACTOR_TIME);
-    timerAnticoag.it_value.tv_nsec= 0;
-    // set the timer period
-    timerAnticoag.it_interval.tv_sec = clock_t(24*3600 * FACTOR_TIME);
-    timerAnticoag.it_interval.tv_nsec = 0;
+    // timer of the period task antibiotic injection
+    Timer timerAntibio;
+    timers.schedule(&timerAntibio,
+            clock_t(130 * FACTOR_TIME) * 1000000000LL,
+            clock_t(4*3600 * FACTOR_TIME) * 1000000000LL,
+            t_antibio, &data);
 
-    timer_settime(timerAnticoagId, 0, &timerAnticoag, NULL);
+    // timer of the period task anticoagulant injection
+    Timer timerAnticoag;
+    timers.schedule(&timerAnticoag,
+            clock_t(10 * FACTOR_TIME) * 1000000000LL,
+            clock_t(24*3600 * FACTOR_TIME) * 1000000000LL,
+            t_anticoag, &data);
 
     // join all the thread
-    pthread_join(th_controller, NULL);
-    pthread_join(th_syringe, NULL);
-    pthread_join(th_glucose, NULL);
-    pthread_join(th_insuline, NULL);
-    pthread_join(th_display, NULL);
-
+    pthread_t tasks[] = {
+        th_controller, th_syringe, th_glucose, th_insuline, th_display
+    };
+    for (int i = 0; i < 5; ++i) {
+        int r = pthread_join(tasks[i], NULL);
+        CHECK(r == 0, "Error joining task " << i << ": " << strerror(r));
+    }
+    if (stressed) {
+        __atomic_store_n(&stress.stop, 1, __ATOMIC_RELAXED);
+        pthread_join(th_stress[0], NULL);
+        pthread_join(th_stress[1], NULL);
+    }
+    rt.report(std::cerr);
+    const LockStats *locks[] = { &syringeLock, &glucoseLock, &insulineLock };
+    for (int l = 0; l < 3; ++l)
+        locks[l]->report(std::cerr);
+    reportBlocking(locks, 3, std::cerr);
+    mqHandler.reportBackpressure(std::cerr);
+    std::ofstream *statsOut = openStats(statsPath);
+    if (statsOut)
+        writeStats(*statsOut, 0, stats);
+    delete statsOut;
+
+    delete data.log;
+    delete data.live;
+    delete exporter;
+    if (recorder) {
+        std::cerr << recorder->recordCount() << " records traced, "
+                  << recorder->dropCount() << " dropped" << std::endl;
+        delete recorder;
+    }
     pthread_exit(NULL);
 }
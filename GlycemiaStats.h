@@ -0,0 +1,164 @@
+#ifndef GLYCEMIA_STATS_H
+#define GLYCEMIA_STATS_H
+
+#include <math.h>
+#include <iostream>
+
+#include "Patient.h"
+
+// bins of the glycemia quantiles, STATS_BIN_WIDTH mg/dL each from 0. The
+// values below 0 or above STATS_BINS * STATS_BIN_WIDTH go to an underflow
+// and an overflow bin, which span to the min and the max
+#define STATS_BINS 64
+#define STATS_BIN_WIDTH 4.0
+
+// Summary of the glycemia samples of a patient, updated as the controller
+// reads them: time below, within and above [glycemia_crit, glycemia_ref],
+// min, max, mean and variance by Welford, and the quantiles from a table of
+// fixed bins. Its size does not depend on the number of samples and two of
+// them merge exactly, so the summaries of patients and shards add up to the
+// one of the ward. Like LockStats it is not atomic: one task adds to it,
+// the others read it once that task is done.
+struct GlycemiaStats {
+    GlycemiaStats()
+        : samples(0), mean(0), m2(0), minimum(0), maximum(0), below(0),
+          above(0)
+    {
+        for (int i = 0; i < STATS_BINS + 2; ++i)
+            bins[i] = 0;
+    }
+
+    void add(double glycemia) {
+        ++samples;
+        double delta = glycemia - mean;
+        mean += delta / samples;
+        m2 += delta * (glycemia - mean);
+        if (samples == 1 || glycemia < minimum)
+            minimum = glycemia;
+        if (samples == 1 || glycemia > maximum)
+            maximum = glycemia;
+        if (glycemia < Patient::glycemia_crit)
+            ++below;
+        else if (glycemia > Patient::glycemia_ref)
+            ++above;
+        ++bins[bin(glycemia)];
+    }
+
+    // add the samples of other, as if they had been added one by one. The
+    // moments are combined as Chan et al. do
+    void merge(const GlycemiaStats &other) {
+        if (other.samples == 0)
+            return;
+        if (samples == 0) {
+            *this = other;
+            return;
+        }
+        long n = samples + other.samples;
+        double delta = other.mean - mean;
+        mean += delta * other.samples / n;
+        m2 += other.m2 + delta * delta * samples / n * other.samples;
+        if (other.minimum < minimum)
+            minimum = other.minimum;
+        if (other.maximum > maximum)
+            maximum = other.maximum;
+        below += other.below;
+        above += other.above;
+        for (int i = 0; i < STATS_BINS + 2; ++i)
+            bins[i] += other.bins[i];
+        samples = n;
+    }
+
+    long count() const { return samples; }
+    double average() const { return mean; }
+    double min() const { return minimum; }
+    double max() const { return maximum; }
+
+    double stddev() const {
+        return samples > 1 ? sqrt(m2 / (samples - 1)) : 0;
+    }
+
+    // coefficient of variation in percent, the usual glycemic variability
+    double variation() const {
+        return mean != 0 ? 100 * stddev() / fabs(mean) : 0;
+    }
+
+    // fraction of the samples below glycemia_crit, within the range and
+    // above glycemia_ref. The controller samples at a fixed period, so they
+    // are also fractions of the time
+    double timeBelow() const { return fraction(below); }
+    double timeAbove() const { return fraction(above); }
+    double timeInRange() const {
+        return fraction(samples - below - above);
+    }
+
+    // p-th quantile, p in [0, 1], interpolated within its bin: within
+    // STATS_BIN_WIDTH of the exact one between 0 and the top of the bins
+    double percentile(double p) const {
+        if (samples == 0)
+            return 0;
+        double rank = p * samples;
+        double seen = 0;
+        for (int i = 0; i < STATS_BINS + 2; ++i) {
+            if (bins[i] == 0 || seen + bins[i] < rank) {
+                seen += bins[i];
+                continue;
+            }
+            double lo = i == 0 ? minimum : (i - 1) * STATS_BIN_WIDTH;
+            double hi = i == STATS_BINS + 1 ? maximum : i * STATS_BIN_WIDTH;
+            double q = lo + (hi - lo) * (rank - seen) / bins[i];
+            return q < minimum ? minimum : q > maximum ? maximum : q;
+        }
+        return maximum;
+    }
+
+    // one JSON object: samples, mean, sd, cv, min, max, the fractions of
+    // the time and p5 to p95
+    void writeJson(std::ostream &os) const {
+        os << "{\"samples\":" << samples << ",\"mean\":" << mean
+           << ",\"sd\":" << stddev() << ",\"cv\":" << variation()
+           << ",\"min\":" << minimum << ",\"max\":" << maximum
+           << ",\"below\":" << timeBelow() << ",\"in_range\":"
+           << timeInRange() << ",\"above\":" << timeAbove()
+           << ",\"p5\":" << percentile(0.05) << ",\"p25\":"
+           << percentile(0.25) << ",\"p50\":" << percentile(0.5)
+           << ",\"p75\":" << percentile(0.75) << ",\"p95\":"
+           << percentile(0.95) << "}";
+    }
+
+    // one line of text, prefixed by name
+    void report(const char *name, std::ostream &os) const {
+        os << name << ": " << samples << " samples, " << timeInRange() * 100
+           << "% in range (" << timeBelow() * 100 << "% below, "
+           << timeAbove() * 100 << "% above), mean " << mean << " sd "
+           << stddev() << " cv " << variation() << "%, min " << minimum
+           << " p5 " << percentile(0.05) << " p50 " << percentile(0.5)
+           << " p95 " << percentile(0.95) << " max " << maximum
+           << std::endl;
+    }
+
+private:
+    static int bin(double glycemia) {
+        if (glycemia < 0)
+            return 0;
+        if (glycemia >= STATS_BINS * STATS_BIN_WIDTH)
+            return STATS_BINS + 1;
+        return 1 + (int) (glycemia / STATS_BIN_WIDTH);
+    }
+
+    double fraction(long n) const {
+        return samples ? (double) n / samples : 0;
+    }
+
+    long samples;
+    double mean;
+    // sum of the squared differences to the mean
+    double m2;
+    double minimum;
+    double maximum;
+    long below;
+    long above;
+    // underflow bin, STATS_BINS bins and overflow bin
+    unsigned bins[STATS_BINS + 2];
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <iostream>
+
+// the values below 2^HIST_SUB_BITS have a bucket each, above that every
+// power of two is split in HIST_SUB / 2 buckets, so a value is known within
+// 1/64 of itself. Values are clamped to 2^HIST_MAX_BITS - 1 (18 min in ns)
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_HALF)
+
+// Log-linear histogram of durations in nanoseconds, in the spirit of
+// HdrHistogram. record() is a few relaxed atomic adds with no lock, so any
+// number of tasks can record while another one reads the percentiles.
+class Histogram {
+public:
+    Histogram() : total(0), sum(0), maximum(0) {
+        for (int i = 0; i < HIST_BUCKETS; ++i)
+            counts[i] = 0;
+    }
+
+    void record(long long value) {
+        if (value < 0)
+            value = 0;
+        __atomic_fetch_add(&counts[bucket(value)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sum, value, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total, 1, __ATOMIC_RELAXED);
+        long long m = __atomic_load_n(&maximum, __ATOMIC_RELAXED);
+        while (value > m && !__atomic_compare_exchange_n(&maximum, &m, value,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+
+    long count() const { return __atomic_load_n(&total, __ATOMIC_RELAXED); }
+
+    long long max() const {
+        return __atomic_load_n(&maximum, __ATOMIC_RELAXED);
+    }
+
+    long long mean() const {
+        long n = count();
+        return n > 0 ? __atomic_load_n(&sum, __ATOMIC_RELAXED) / n : 0;
+    }
+
+    // smallest value of the bucket holding the p-th quantile, p in [0, 1].
+    // The counts are read while others record, the result is approximate
+    // by at most the values recorded during the call
+    long long percentile(double p) const {
+        long n = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i)
+            n += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+        long rank = (long) (p * n);
+        if (rank >= n)
+            rank = n - 1;
+        long seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            seen += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+            if (seen > rank)
+                return lowest(i);
+        }
+        return 0;
+    }
+
+    // one JSON object: count, mean, p50, p99, p999 and max
+    void writeJson(std::ostream &os) const {
+        os << "{\"count\":" << count() << ",\"mean\":" << mean()
+           << ",\"p50\":" << percentile(0.5) << ",\"p99\":"
+           << percentile(0.99) << ",\"p999\":" << percentile(0.999)
+           << ",\"max\":" << max() << "}";
+    }
+
+private:
+    static int bucket(long long value) {
+        if (value >= (1LL << HIST_MAX_BITS))
+            value = (1LL << HIST_MAX_BITS) - 1;
+        if (value < HIST_SUB)
+            return (int) value;
+        int e = 63 - __builtin_clzll(value);
+        int shift = e - (HIST_SUB_BITS - 1);
+        return HIST_SUB + (shift - 1) * HIST_HALF
+            + (int) ((value >> shift) - HIST_HALF);
+    }
+
+    static long long lowest(int i) {
+        if (i < HIST_SUB)
+            return i;
+        int shift = (i - HIST_SUB) / HIST_HALF + 1;
+        return (long long) (HIST_HALF + (i - HIST_SUB) % HIST_HALF) << shift;
+    }
+
+    long counts[HIST_BUCKETS];
+    long total;
+    long long sum;
+    long long maximum;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+#include "Clock.h"
+#include "LiveState.h"
+
+// Monitor of a running GlycemiaRegulator --live <name>. Reads the state of
+// the patients from the shared memory segment, without any message to the
+// tasks, and prints one line per patient:
+//     [bed <patient>] glucose <g> insuline <i> glycemia <x> syringe <n>
+//     levels <l1> <l2> (<publishes>, <age> ms)
+//
+//     LiveMonitor <name> [period_ms]    print the state once, or every
+//                                       period until the regulator stops
+
+void print(const LiveReader &reader) {
+    long long now = monotonicNs();
+    for (int i = 0; i < reader.slotCount(); ++i) {
+        LiveSnapshot s;
+        if (!reader.read(i, s))
+            continue;
+        printf("[bed %d] glucose %d insuline %d glycemia %.2f syringe %d "
+                "levels %.0f %.0f (%lld, %lld ms)\n", i, s.glucose,
+                s.insuline, s.glycemia, s.active + 1, s.level[0], s.level[1],
+                s.updates, (now - s.time) / 1000000);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: LiveMonitor <name> [period_ms]" << std::endl;
+        return 1;
+    }
+    long long period = argc > 2 ? atoll(argv[2]) * 1000000 : 0;
+    long long next = monotonicNs();
+    while (true) {
+        // opened again each time, so a restarted regulator is followed and
+        // the monitor stops once the segment is removed
+        LiveReader reader(argv[1]);
+        if (!reader.valid())
+            return period ? 0 : 1;
+        print(reader);
+        if (period <= 0)
+            return 0;
+        next += period;
+        sleepUntil(next);
+    }
+}
@@ -0,0 +1,234 @@
+#ifndef LIVE_STATE_H
+#define LIVE_STATE_H
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+
+#include "Clock.h"
+#include "Error.h"
+#include "Patient.h"
+#include "Syringe.h"
+
+// "GLIV", at the start of every live state segment
+#define LIVE_MAGIC 0x56494c47
+#define LIVE_VERSION 1
+// tries of a reader on a slot being written before it falls back to the
+// last snapshot it read of that slot
+#define LIVE_RETRIES 100
+
+// state of one patient, as published
+struct LiveSnapshot {
+    int glucose;
+    int insuline;
+    // active syringe and level of both syringes
+    int active;
+    int pad;
+    double glycemia;
+    double level[2];
+    // monotonic time of the publish and number of publishes of the slot
+    long long time;
+    long long updates;
+};
+
+// a slot of the segment, one cache line. seq is odd while the slot is
+// being written
+struct __attribute__((aligned(64))) LiveSlot {
+    unsigned seq;
+    unsigned pad;
+    LiveSnapshot state;
+};
+
+static_assert(sizeof(LiveSlot) == 64, "a live slot must be one cache line");
+
+struct LiveHeader {
+    unsigned magic;
+    unsigned version;
+    unsigned slotSize;
+    int nSlots;
+    long long startNs;
+    char fill[64 - 24];
+};
+
+// name of the shared memory segment of name, /name as Linux requires and
+// QNX accepts
+inline std::string liveSegmentName(const char *name) {
+    return std::string(name[0] == '/' ? "" : "/") + name;
+}
+
+// state of a patient and its syringe. The glycemia is the one of the doses
+// read, the active syringe and the levels are one consistent reading of
+// the seqlock of the syringe
+inline LiveSnapshot liveSnapshot(const Patient &patient, Syringe &syringe) {
+    LiveSnapshot s;
+    memset(&s, 0, sizeof(s));
+    patient.snapshot(s.glucose, s.insuline);
+    s.glycemia = Patient::glycemiaOf(s.glucose, s.insuline);
+    syringe.levels(s.active, s.level[0], s.level[1]);
+    return s;
+}
+
+// Publisher of the state of the patients in a POSIX shared memory segment,
+// one slot per patient, for monitors in other processes. Each slot is a
+// seqlock with a single writer: publish() never waits and never makes a
+// system call, the readers never write to the segment so they cannot slow
+// the control tasks down. The segment is removed when the publisher is
+// destroyed, mapped readers keep their copy. The segment of name is /name.
+class LiveState {
+public:
+    LiveState(const char *name, int nSlots)
+        : name(liveSegmentName(name)), nSlots(nSlots), segment(NULL)
+    {
+        size = sizeof(LiveHeader) + nSlots * sizeof(LiveSlot);
+        int fd = shm_open(this->name.c_str(), O_CREAT | O_RDWR | O_TRUNC,
+                0644);
+        CHECK(fd >= 0, "Error opening shared memory " << name);
+        if (fd < 0)
+            return;
+        CHECK(ftruncate(fd, size) == 0, "Error sizing shared memory");
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        CHECK(p != MAP_FAILED, "Error mapping shared memory");
+        if (p == MAP_FAILED)
+            return;
+        segment = (char *) p;
+        memset(segment, 0, size);
+        LiveHeader *header = (LiveHeader *) segment;
+        header->version = LIVE_VERSION;
+        header->slotSize = sizeof(LiveSlot);
+        header->nSlots = nSlots;
+        header->startNs = monotonicNs();
+        // a reader checks the magic last
+        __atomic_store_n(&header->magic, LIVE_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    ~LiveState() {
+        if (segment) {
+            munmap(segment, size);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    // publish the state of patient slot, only one task may publish a slot
+    // at a time
+    void publish(int slot, const LiveSnapshot &state) {
+        if (segment == NULL || slot < 0 || slot >= nSlots)
+            return;
+        LiveSlot *s = (LiveSlot *) (segment + sizeof(LiveHeader)) + slot;
+        unsigned seq = s->seq;
+        long long updates = s->state.updates;
+        __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        s->state = state;
+        s->state.time = monotonicNs();
+        s->state.updates = updates + 1;
+        __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+
+private:
+    std::string name;
+    int nSlots;
+    size_t size;
+    char *segment;
+};
+
+// Read only view of a segment of another process. read() copies a slot
+// without any lock and tries again if the copy overlapped a publish. It is
+// lock-free but not wait-free: after LIVE_RETRIES tries it returns the last
+// snapshot it read of the slot, which the time and updates of the snapshot
+// tell apart, or fails if it has none.
+class LiveReader {
+public:
+    LiveReader(const char *name)
+        : nSlots(0), size(0), startNs(0), segment(NULL), last(NULL)
+    {
+        int fd = shm_open(liveSegmentName(name).c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            std::cerr << "No live state " << name << std::endl;
+            return;
+        }
+        // the header gives the size of the whole segment
+        void *h = mmap(NULL, sizeof(LiveHeader), PROT_READ, MAP_SHARED, fd, 0);
+        LiveHeader header;
+        memset(&header, 0, sizeof(header));
+        if (h != MAP_FAILED) {
+            header = *(const LiveHeader *) h;
+            munmap(h, sizeof(LiveHeader));
+        }
+        if (header.magic != LIVE_MAGIC || header.version != LIVE_VERSION
+                || header.slotSize != sizeof(LiveSlot)) {
+            std::cerr << name << " is not a live state of this version"
+                      << std::endl;
+            close(fd);
+            return;
+        }
+        nSlots = header.nSlots;
+        startNs = header.startNs;
+        size = sizeof(LiveHeader) + nSlots * sizeof(LiveSlot);
+        void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        CHECK(p != MAP_FAILED, "Error mapping shared memory");
+        if (p == MAP_FAILED)
+            return;
+        segment = (const char *) p;
+        // updates 0 for a slot never read
+        last = new LiveSnapshot[nSlots];
+        memset(last, 0, nSlots * sizeof(LiveSnapshot));
+    }
+
+    ~LiveReader() {
+        if (segment)
+            munmap((void *) segment, size);
+        delete[] last;
+    }
+
+    bool valid() const { return segment != NULL; }
+    int slotCount() const { return nSlots; }
+    long long start() const { return startNs; }
+
+    // copy the state of patient slot. If it kept changing during
+    // LIVE_RETRIES tries, copy the last state read of it instead. Return
+    // false if it was never published or never read
+    bool read(int slot, LiveSnapshot &state, int *retries = NULL) const {
+        if (segment == NULL || slot < 0 || slot >= nSlots)
+            return false;
+        const LiveSlot *s = (const LiveSlot *) (segment + sizeof(LiveHeader))
+            + slot;
+        for (int tries = 0; tries < LIVE_RETRIES; ++tries) {
+            unsigned before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            if (before & 1)
+                continue;
+            LiveSnapshot copy = s->state;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == before) {
+                if (retries)
+                    *retries += tries;
+                if (before == 0)
+                    return false;
+                state = last[slot] = copy;
+                return true;
+            }
+        }
+        if (retries)
+            *retries += LIVE_RETRIES;
+        state = last[slot];
+        return last[slot].updates > 0;
+    }
+
+private:
+    // not copyable, the last snapshots are owned
+    LiveReader(const LiveReader &);
+    LiveReader &operator=(const LiveReader &);
+
+    int nSlots;
+    size_t size;
+    long long startNs;
+    const char *segment;
+    // last consistent snapshot of each slot
+    LiveSnapshot *last;
+};
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+
+#include "Clock.h"
+#include "Error.h"
+
+// priorities followed by the lock statistics, the values of Priority fit
+#define LOCK_PRIORITIES 32
+// ceiling of a LOCK_CEILING mutex by default, VERY_CRITICAL
+#define LOCK_DEFAULT_CEILING 20
+
+// protocol of a PiMutex: none, priority inheritance or priority ceiling.
+// A ceiling mutex can only be locked by SCHED_FIFO or SCHED_RR threads, the
+// others get EINVAL
+enum LockProtocol { LOCK_NONE, LOCK_INHERIT, LOCK_CEILING };
+
+// protocol of the mutexes created from now on, LOCK_INHERIT unless changed
+// before the objects owning them are built
+inline LockProtocol &defaultLockProtocol() {
+    static LockProtocol protocol = LOCK_INHERIT;
+    return protocol;
+}
+
+inline const char *lockProtocolName(LockProtocol protocol) {
+    switch (protocol) {
+        case LOCK_NONE: return "none";
+        case LOCK_INHERIT: return "inherit";
+        case LOCK_CEILING: return "ceiling";
+    }
+    return "";
+}
+
+// priority of the task running on the calling thread, -1 if unknown.
+// RealTime sets it for the tasks it starts
+inline int &taskPriority() {
+    static __thread int priority = -1;
+    return priority;
+}
+
+// Counters of a lock. They are only updated by the thread holding the
+// lock, so they need no atomic; read them once the tasks are done.
+struct LockStats {
+    LockStats(const char *name)
+        : name(name), acquisitions(0), contended(0), inversions(0),
+          holdSum(0), holdMax(0)
+    {
+        for (int p = 0; p < LOCK_PRIORITIES; ++p)
+            worstWait[p] = worstInversion[p] = 0;
+    }
+
+    // print the counters and the worst waits of each priority, times in us
+    void report(std::ostream &os) const {
+        os << name << ": " << acquisitions << " acquisitions, " << contended
+           << " contended, " << inversions << " behind a lower priority, hold"
+           << " mean " << (acquisitions ? holdSum / acquisitions : 0) / 1000
+           << " us max " << holdMax / 1000 << " us" << std::endl;
+        for (int p = LOCK_PRIORITIES - 1; p >= 0; --p) {
+            if (worstWait[p] == 0)
+                continue;
+            os << "  priority " << p << ": worst wait "
+               << worstWait[p] / 1000 << " us, behind a lower priority "
+               << worstInversion[p] / 1000 << " us" << std::endl;
+        }
+    }
+
+    const char *name;
+    long acquisitions;
+    long contended;
+    // waits for an owner of a lower priority, a priority inversion
+    long inversions;
+    long long holdSum;
+    long long holdMax;
+    // worst wait of a task of each priority for the lock, and worst wait
+    // behind an owner of a lower priority
+    long long worstWait[LOCK_PRIORITIES];
+    long long worstInversion[LOCK_PRIORITIES];
+};
+
+// Mutex of the locks shared by tasks of different priorities. It inherits
+// the priority of its waiters by default, so a task holding it cannot be
+// kept from releasing it by the tasks of middle priority. With LockStats
+// it also measures the hold times and the waits, and tells the waits
+// behind an owner of a lower priority from the taskPriority() of each
+// thread; without it lock() is pthread_mutex_lock().
+class PiMutex {
+public:
+    PiMutex(LockProtocol protocol = defaultLockProtocol(),
+            int ceiling = LOCK_DEFAULT_CEILING)
+        : stats(NULL), ownerPriority(-1), acquiredNs(0)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        int r = 0;
+        if (protocol == LOCK_INHERIT) {
+            r = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+        } else if (protocol == LOCK_CEILING) {
+            r = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_PROTECT);
+            if (r == 0)
+                r = pthread_mutexattr_setprioceiling(&attr, ceiling);
+        }
+        if (r == 0)
+            r = pthread_mutex_init(&m, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if (r != 0) {
+            CHECK(false, "Error creating a " << lockProtocolName(protocol)
+                    << " mutex: " << strerror(r) << ", using a plain one");
+            pthread_mutex_init(&m, NULL);
+        }
+    }
+
+    ~PiMutex() {
+        pthread_mutex_destroy(&m);
+    }
+
+    // measure the lock into s, NULL to stop. Must be set before the tasks
+    // use the lock
+    void setStats(LockStats *s) {
+        stats = s;
+    }
+
+    void lock() {
+        if (stats == NULL) {
+            pthread_mutex_lock(&m);
+            return;
+        }
+        if (pthread_mutex_trylock(&m) != 0) {
+            int owner = __atomic_load_n(&ownerPriority, __ATOMIC_RELAXED);
+            long long start = monotonicNs();
+            pthread_mutex_lock(&m);
+            waited(owner, monotonicNs() - start);
+        }
+        acquired();
+    }
+
+    void unlock() {
+        if (stats)
+            released();
+        pthread_mutex_unlock(&m);
+    }
+
+    // pthread_cond_wait on cv, the time waiting is not a hold time
+    int wait(pthread_cond_t *cv) {
+        if (stats)
+            released();
+        int r = pthread_cond_wait(cv, &m);
+        if (stats)
+            acquired();
+        return r;
+    }
+
+    int timedWait(pthread_cond_t *cv, const timespec *deadline) {
+        if (stats)
+            released();
+        int r = pthread_cond_timedwait(cv, &m, deadline);
+        if (stats)
+            acquired();
+        return r;
+    }
+
+private:
+    // not copyable, the mutex is in use
+    PiMutex(const PiMutex &);
+    PiMutex &operator=(const PiMutex &);
+
+    void acquired() {
+        int priority = taskPriority();
+        __atomic_store_n(&ownerPriority, priority, __ATOMIC_RELAXED);
+        acquiredNs = monotonicNs();
+        ++stats->acquisitions;
+    }
+
+    void released() {
+        long long hold = monotonicNs() - acquiredNs;
+        stats->holdSum += hold;
+        if (hold > stats->holdMax)
+            stats->holdMax = hold;
+        __atomic_store_n(&ownerPriority, -1, __ATOMIC_RELAXED);
+    }
+
+    // the lock was taken after waiting for an owner of priority owner, -1
+    // if unknown. The owner may have changed meanwhile, the first one is
+    // the one that made the task wait
+    void waited(int owner, long long waitNs) {
+        ++stats->contended;
+        int priority = taskPriority();
+        if (priority < 0 || priority >= LOCK_PRIORITIES)
+            return;
+        if (waitNs > stats->worstWait[priority])
+            stats->worstWait[priority] = waitNs;
+        if (owner >= 0 && owner < priority) {
+            ++stats->inversions;
+            if (waitNs > stats->worstInversion[priority])
+                stats->worstInversion[priority] = waitNs;
+        }
+    }
+
+    pthread_mutex_t m;
+    LockStats *stats;
+    // taskPriority() of the owner, -1 when free or unknown
+    int ownerPriority;
+    long long acquiredNs;
+};
+
+#endif
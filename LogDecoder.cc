@@ -0,0 +1,68 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "EventLog.h"
+#include "Message.h"
+
+// Offline decoder of the binary event log of GlycemiaRegulator --log. Prints
+// one line per event with the text t_display used to print:
+//     [<ms since the log start> ms] [bed <patient>] <text> (<payload> <value>)
+// The buffers of the producers are written one after the other, the events
+// are sorted by time before printing.
+//
+//     LogDecoder <file>
+
+// the record of an earlier event first, records of the same time keep their
+// order in the file
+bool earlier(const LogRecord &a, const LogRecord &b) {
+    return a.time < b.time;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: LogDecoder <file>" << std::endl;
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        std::cerr << "Error opening " << argv[1] << std::endl;
+        return 1;
+    }
+
+    LogHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+            || header.magic != LOG_MAGIC) {
+        std::cerr << argv[1] << " is not an event log" << std::endl;
+        fclose(f);
+        return 1;
+    }
+    if (header.version != LOG_VERSION
+            || header.recordSize != sizeof(LogRecord)) {
+        std::cerr << "Unsupported event log version " << header.version
+                  << std::endl;
+        fclose(f);
+        return 1;
+    }
+
+    std::vector<LogRecord> records;
+    LogRecord batch[LOG_BATCH];
+    size_t n;
+    while ((n = fread(batch, sizeof(LogRecord), LOG_BATCH, f)) > 0)
+        records.insert(records.end(), batch, batch + n);
+    fclose(f);
+
+    std::stable_sort(records.begin(), records.end(), earlier);
+    for (size_t i = 0; i < records.size(); ++i) {
+        const LogRecord &r = records[i];
+        const char *payload = payloadName((Message) r.code);
+        printf("[%lld ms] [bed %d] %s", (r.time - header.startNs) / 1000000,
+                r.patient, messageText((Message) r.code));
+        if (payload)
+            printf(" (%s %.1f)", payload, r.value);
+        printf("\n");
+    }
+    return 0;
+}
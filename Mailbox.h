@@ -0,0 +1,106 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <pthread.h>
+
+#include "Clock.h"
+#include "Lock.h"
+
+// Conflating "latest value" channel. The writer overwrites a single slot
+// and the reader takes the newest value with one atomic load. The slot is a
+// 64 bits word packing a version counter with the value, so the reader can
+// tell a new value from one it has already seen. T must fit in 32 bits.
+// A reader can also block until a value is posted or a deadline passes, the
+// writer only takes the lock when a reader is waiting, the lock inherits the
+// priority of a writer blocked on it.
+template <typename T>
+class Mailbox {
+public:
+    Mailbox() : word(0), waiters(0) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        // the deadlines are times of the monotonic clock
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cv_posted, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    ~Mailbox() {
+        pthread_cond_destroy(&cv_posted);
+    }
+
+    // publish value, replacing the one that was not read yet
+    void post(T value) {
+        unsigned long long old = __atomic_load_n(&word, __ATOMIC_RELAXED);
+        unsigned long long next;
+        do {
+            next = (((old >> 32) + 1) << 32) | (unsigned) value;
+        } while (!__atomic_compare_exchange_n(&word, &old, next, true,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        // the value must be visible before waiters is read, wait() does
+        // the opposite
+        __sync_synchronize();
+        if (__atomic_load_n(&waiters, __ATOMIC_RELAXED) > 0) {
+            m_posted.lock();
+            pthread_cond_broadcast(&cv_posted);
+            m_posted.unlock();
+        }
+    }
+
+    // take the newest value if it was posted after version seen, in which
+    // case seen is updated to its version
+    bool read(T &value, unsigned &seen) const {
+        unsigned long long w = __atomic_load_n(&word, __ATOMIC_ACQUIRE);
+        unsigned v = (unsigned) (w >> 32);
+        if (v == seen)
+            return false;
+        seen = v;
+        value = (T) (unsigned) w;
+        return true;
+    }
+
+    // like read() but wait for a new value until the monotonic clock reaches
+    // deadline (in nanoseconds). Return false if none was posted by then
+    bool wait(T &value, unsigned &seen, long long deadline) {
+        if (read(value, seen))
+            return true;
+        timespec ts = toTimespec(deadline);
+        m_posted.lock();
+        __atomic_add_fetch(&waiters, 1, __ATOMIC_RELAXED);
+        __sync_synchronize();
+        bool found = false;
+        while (!(found = read(value, seen))) {
+            if (m_posted.timedWait(&cv_posted, &ts) != 0) {
+                // a value may have been posted right at the deadline
+                found = read(value, seen);
+                break;
+            }
+        }
+        __atomic_sub_fetch(&waiters, 1, __ATOMIC_RELAXED);
+        m_posted.unlock();
+        return found;
+    }
+
+    // measure the lock into stats, NULL for none
+    void setLockStats(LockStats *stats) {
+        m_posted.setStats(stats);
+    }
+
+    // number of values posted so far
+    unsigned version() const {
+        return (unsigned) (__atomic_load_n(&word, __ATOMIC_ACQUIRE) >> 32);
+    }
+
+private:
+    // not copyable, the condvar is in use
+    Mailbox(const Mailbox &);
+    Mailbox &operator=(const Mailbox &);
+
+    unsigned long long word;
+    // readers blocked in wait()
+    int waiters;
+    PiMutex m_posted;
+    pthread_cond_t cv_posted;
+};
+
+#endif
@@ -2,77 +2,17 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
-#define MSG_SIZE 4096
+#include <errno.h>
+#include <string.h>
+#include <iostream>
 
-struct MQHandler {
-    // declaration of messages queues descriptors
-    mqd_t qw_glucose;
-    mqd_t qr_glucose;
-    mqd_t qw_insuline;
-    mqd_t qr_insuline;
-    mqd_t qw_display;
-    mqd_t qr_display;
-    // declaration of a condvar
-    pthread_cond_t cv_syringe;
-
-    MQHandler() {
-        // initialize the queue attributes
-        mq_attr attr;
-        attr.mq_flags = 0;
-        attr.mq_maxmsg = 50;
-        attr.mq_msgsize = MSG_SIZE;
-
-        // open the queue q_glucose in read only mode qr_glucose and in write mode qw_glucose
-        mq_unlink("q_glucose");
-        qr_glucose = mq_open("q_glucose",
-                O_CREAT | O_RDONLY, S_IWUSR | S_IRUSR, &attr);
-        if(qr_glucose == (mqd_t)0)
-            std::cout << "Error creating `qr_glucose`" << std::endl;
-
-        qw_glucose= mq_open("q_glucose", O_WRONLY);
-        if(qw_glucose == (mqd_t)0)
-            std::cout << "Error creating `qw_glucose`" << std::endl;
-
-        // open the queue q_insuline in read mode qr_insuline and in write mode qw_insuline
-        mq_unlink("q_insuline");
-        qr_insuline = mq_open("q_insuline",
-                O_CREAT | O_RDONLY, S_IWUSR | S_IRUSR, &attr);
-        if(qr_insuline == (mqd_t)0)
-            std::cout << "Error creating `qr_insuline`" << std::endl;
-
-        qw_insuline = mq_open("q_insuline", O_WRONLY);
-        if(qw_insuline == (mqd_t)0)
-            std::cout << "Error creating `qw_insuline`"<< std::endl;
-
-        // open the queue q_display in read mode qr_display
-        // and in write mode qw_display
-        mq_unlink("q_display");
-        qr_display = mq_open("q_display",
-                O_CREAT | O_RDONLY, S_IWUSR | S_IRUSR, &attr);
-        if(qr_display == (mqd_t)0)
-            std::cout << "Error creating `qr_display`" << std::endl;
-
-        qw_display = mq_open("q_display", O_WRONLY);
-        if(qw_display == (mqd_t)0)
-            std::cout << "Error creating `qw_display`"<< std::endl;
-
-    pthread_cond_init(&cv_syringe, NULL);
-    }
+#include "Channel.h"
+#include "Clock.h"
+#include "Mailbox.h"
+#include "Telemetry.h"
+#include "Trace.h"
 
-    ~MQHandler() {
-        mq_close(qr_glucose);
-        mq_close(qw_glucose);
-        mq_unlink("q_glucose");
-
-        mq_close(qr_insuline);
-        mq_close(qw_insuline);
-        mq_unlink("q_insuline");
-
-        mq_close(qr_display);
-        mq_close(qw_display);
-        mq_unlink("q_display");
-    }
-};
+#define MSG_MAX 50
 
 // list all messages used in enum
 enum Message {
@@ -96,4 +36,391 @@ enum Message {
     RESET
 };
 
+// number of Message values
+#define MESSAGES (RESET + 1)
+
+// human readable text displayed for each message
+inline const char *messageText(Message msg) {
+    switch(msg) {
+        case HALT:
+            return "Stopping the system";
+        case GLYCEMIA_CRITICAL:
+            return "Glycemia critical";
+        case GLYCEMIA_NORMAL:
+            return "Glycemia normal";
+        case GLUCOSE_START:
+            return "Start glucose injection";
+        case GLUCOSE_STOP:
+            return "Stop glucose injection";
+        case INSULINE_START:
+            return "Start insuline injection";
+        case INSULINE_STOP:
+            return "Stop insuline injection";
+        case ANTIBIO_INJECT:
+            return "Antibiotic injection";
+        case ANTICOAG_INJECT:
+            return "Antiocoagulant injection";
+        case SYRINGE_1_LOW:
+            return "Solution level in syringe 1 reaches 5%";
+        case SYRINGE_2_LOW:
+            return "Solution level in syringe 2 reaches 5%";
+        case SYRINGE_1_CRITICAL:
+            return "Solution level in syringe 1 reaches 1%";
+        case SYRINGE_2_CRITICAL:
+            return "Solution level in syringe 2 reaches 1%";
+        case SWITCH:
+            return "Switch between syringe";
+        case RESET:
+            return "Reset inactive syringe";
+        case START:
+        case STOP:
+        case NONE:
+            break;
+    }
+    return "";
+}
+
+// tasks sending frames in the display channel
+enum Device {
+    CONTROLLER_DEVICE,
+    GLUCOSE_DEVICE,
+    INSULINE_DEVICE,
+    SYRINGE_DEVICE,
+    TIMER_DEVICE,
+    DEVICES
+};
+
+// A message of the display channel with what the display needs to show it.
+// 32 bytes, so a send can carry a batch of them
+struct Frame {
+    // monotonic time of the send in nanoseconds
+    long long time;
+    // glycemia or syringe level, see payloadName
+    double value;
+    // number of the frame among the ones of its device
+    unsigned seq;
+    unsigned short patient;
+    unsigned char device;
+    // the Message and its priority
+    unsigned char code;
+    unsigned char priority;
+    unsigned char pad[7];
+};
+
+// frames per send at most, the size of a message of the display channel
+#define FRAME_BATCH 8
+#define MSG_SIZE (FRAME_BATCH * sizeof(Frame))
+
+// name of the value carried by msg, NULL if it carries none
+inline const char *payloadName(Message msg) {
+    switch(msg) {
+        case GLYCEMIA_CRITICAL:
+        case GLYCEMIA_NORMAL:
+            return "glycemia";
+        case SYRINGE_1_LOW:
+        case SYRINGE_2_LOW:
+        case SYRINGE_1_CRITICAL:
+        case SYRINGE_2_CRITICAL:
+            return "level";
+        default:
+            break;
+    }
+    return NULL;
+}
+
+// frames a writer keeps while the display channel is full, with
+// SEND_OVERFLOW and with the other policies that do not wait
+#define FRAME_OVERFLOW 4096
+#define FRAME_BACKLOG 64
+// longest wait for room of SEND_TIMEOUT, in nanoseconds
+#define SEND_TIMEOUT_NS 1000000
+
+// What a writer of the display channel does when it is full. The display
+// only informs, so a task above it should not wait for it: every policy
+// but SEND_BLOCK keeps the writer going and counts the frames it loses.
+enum Backpressure {
+    // wait for room, whatever the time it takes
+    SEND_BLOCK,
+    // wait for room up to SEND_TIMEOUT_NS, then drop the frames
+    SEND_TIMEOUT,
+    // keep the frames for the next flush, the oldest frame of the lowest
+    // priority below the new one is dropped when they do not fit
+    SEND_DROP,
+    // as SEND_DROP, and a new frame replaces a waiting one of its message
+    SEND_COALESCE,
+    // keep up to FRAME_OVERFLOW frames in order, drop the new ones beyond
+    SEND_OVERFLOW,
+    BACKPRESSURES
+};
+
+inline const char *backpressureName(int id) {
+    static const char *names[BACKPRESSURES] = {
+        "block", "timeout", "drop", "coalesce", "overflow"
+    };
+    return id >= 0 && id < BACKPRESSURES ? names[id] : "";
+}
+
+// id of the backpressure called name, -1 if there is none
+inline int findBackpressure(const char *name) {
+    for (int id = 0; id < BACKPRESSURES; ++id) {
+        if (strcmp(name, backpressureName(id)) == 0)
+            return id;
+    }
+    return -1;
+}
+
+struct MQHandler {
+    // declaration of the command mailboxes from the controller to the
+    // glucose and insuline tasks, only the last command is useful
+    Mailbox<Message> glucose;
+    Mailbox<Message> insuline;
+    // declaration of the display channel
+    Channel *display;
+    // measures of the tasks, always on
+    Telemetry telemetry;
+    // last sequence number of each device
+    unsigned seq[DEVICES];
+    // records the commands and the frames sent when set
+    TraceRecorder *recorder;
+    // what the writers of the display do when it is full, set before they
+    // are created. The command mailboxes never wait, a command replaces
+    // the one not read yet
+    Backpressure backpressure;
+
+    // open the channel q_display with the given backend
+    MQHandler(Transport transport = MQUEUE)
+        : recorder(NULL), backpressure(SEND_DROP)
+    {
+        display = openChannel(transport, "q_display", MSG_MAX, MSG_SIZE);
+        for (int d = 0; d < DEVICES; ++d)
+            seq[d] = 0;
+    }
+
+    ~MQHandler() {
+        delete display;
+    }
+
+    // post cmd to the mailbox of the pump device
+    void command(Device pump, Message cmd) {
+        if (recorder)
+            recorder->record(TRACE_POST, pump, cmd, 0, 0, 0);
+        (pump == GLUCOSE_DEVICE ? glucose : insuline).post(cmd);
+    }
+
+    // wait for a command of the pump device until deadline, as
+    // Mailbox::wait
+    bool waitCommand(Device pump, Message &cmd, unsigned &seen,
+            long long deadline) {
+        bool got = (pump == GLUCOSE_DEVICE ? glucose : insuline).wait(cmd,
+                seen, deadline);
+        if (got && recorder)
+            recorder->record(TRACE_RECEIVE, pump, cmd, 0, 0, 0);
+        return got;
+    }
+
+    // send n frames in one message of the display channel, with the highest
+    // of their priorities. Wait for room until deadline, for ever if -1,
+    // not at all if 0. Return -1 on error, with errno EAGAIN or ETIMEDOUT
+    // if the channel stayed full
+    int send(const Frame *frames, int n, long long deadline = -1) {
+        unsigned prio = 0;
+        for (int i = 0; i < n; ++i) {
+            if (frames[i].priority > prio)
+                prio = frames[i].priority;
+        }
+        size_t size = n * sizeof(Frame);
+        if (deadline < 0)
+            return display->send(frames, size, prio);
+        if (deadline == 0)
+            return display->trySend(frames, size, prio);
+        return display->timedSend(frames, size, prio, deadline);
+    }
+
+    // take the next message of the display channel, record the time its
+    // frames were queued and return how many there are, -1 on error
+    int receive(Frame *frames) {
+        int r = display->receive(frames, MSG_SIZE);
+        if (r == -1)
+            return r;
+        int n = r / sizeof(Frame);
+        for (int i = 0; i < n; ++i)
+            telemetry.received(frames[i].priority, frames[i].time);
+        return n;
+    }
+
+    // print the frames lost or merged by the backpressure, per message
+    void reportBackpressure(std::ostream &os) const {
+        os << "display " << backpressureName(backpressure) << ": "
+           << __atomic_load_n(&telemetry.drops, __ATOMIC_RELAXED)
+           << " frames dropped, backlog max "
+           << __atomic_load_n(&telemetry.backlogMax, __ATOMIC_RELAXED);
+        for (int m = 0; m < MESSAGES; ++m) {
+            long d = __atomic_load_n(&telemetry.messageDrops[m],
+                    __ATOMIC_RELAXED);
+            long c = __atomic_load_n(&telemetry.coalesces[m],
+                    __ATOMIC_RELAXED);
+            if (d || c)
+                os << ", " << messageText((Message) m) << " " << d
+                   << " dropped " << c << " coalesced";
+        }
+        os << std::endl;
+    }
+};
+
+// Batch of frames of one device. The frames added during a cycle of a task
+// go in sends of up to FRAME_BATCH frames at flush(), or earlier when the
+// batch is full. When the display channel is full the writer applies the
+// backpressure of its handler: unless it blocks, it keeps the frames that
+// did not go for its next flush and drops or merges some when they do not
+// fit, counted per message by the telemetry.
+class FrameWriter {
+public:
+    FrameWriter(MQHandler *handler, Device device, int patient = 0)
+        : handler(handler), device(device), patient(patient),
+          policy(handler->backpressure), head(0), n(0)
+    {
+        if (policy == SEND_OVERFLOW)
+            capacity = FRAME_OVERFLOW;
+        else if (policy == SEND_DROP || policy == SEND_COALESCE)
+            capacity = FRAME_BACKLOG;
+        else
+            capacity = FRAME_BATCH;
+        frames = new Frame[capacity];
+    }
+
+    // the frames still waiting are lost
+    ~FrameWriter() {
+        for (int i = 0; i < n; ++i)
+            handler->telemetry.droppedMessage(at(i)->code);
+        delete[] frames;
+    }
+
+    // stamp a frame of msg, return -1 if the frames could not be sent
+    int add(Message msg, Priority prio, double value = 0) {
+        unsigned seq = __atomic_add_fetch(&handler->seq[device], 1,
+                __ATOMIC_RELAXED);
+        // the trace has the frames the task made, whatever their fate
+        if (handler->recorder)
+            handler->recorder->record(TRACE_SEND, device, msg, prio, seq,
+                    value);
+        if (policy == SEND_COALESCE)
+            coalesce(msg);
+        int r = 0;
+        if (n == capacity)
+            r = flush();
+        if (n == capacity && !evict(prio)) {
+            handler->telemetry.droppedMessage(msg);
+            return r;
+        }
+        Frame *f = at(n++);
+        memset(f, 0, sizeof(*f));
+        f->time = monotonicNs();
+        f->value = value;
+        f->seq = seq;
+        f->patient = patient;
+        f->device = device;
+        f->code = msg;
+        f->priority = prio;
+        return r;
+    }
+
+    // send the frames added since the last flush as the backpressure says,
+    // return -1 on error
+    int flush() {
+        return sendFrames(policy);
+    }
+
+    // send every frame, waiting for room whatever the backpressure, for the
+    // last frames of a task
+    int drain() {
+        return sendFrames(SEND_BLOCK);
+    }
+
+    // frames waiting for room in the display channel
+    int waiting() const { return n; }
+
+private:
+    // not copyable, the frames are owned
+    FrameWriter(const FrameWriter &);
+    FrameWriter &operator=(const FrameWriter &);
+
+    Frame *at(int i) {
+        return &frames[(head + i) % capacity];
+    }
+
+    // remove the waiting frame i
+    void remove(int i) {
+        for (; i + 1 < n; ++i)
+            *at(i) = *at(i + 1);
+        --n;
+    }
+
+    // the new frame of msg replaces the waiting one, it goes at the end so
+    // the frames keep the order of the last change of each message
+    void coalesce(Message msg) {
+        for (int i = 0; i < n; ++i) {
+            if (at(i)->code == msg) {
+                handler->telemetry.coalesced(msg);
+                remove(i);
+                return;
+            }
+        }
+    }
+
+    // drop the oldest of the waiting frames of the lowest priority, if it
+    // is below prio. SEND_OVERFLOW drops the new frames instead
+    bool evict(Priority prio) {
+        if (policy == SEND_OVERFLOW)
+            return false;
+        int victim = -1;
+        for (int i = 0; i < n; ++i) {
+            if (at(i)->priority < prio && (victim < 0
+                        || at(i)->priority < at(victim)->priority))
+                victim = i;
+        }
+        if (victim < 0)
+            return false;
+        handler->telemetry.droppedMessage(at(victim)->code);
+        remove(victim);
+        return true;
+    }
+
+    int sendFrames(Backpressure mode) {
+        int r = 0;
+        long long deadline = mode == SEND_BLOCK ? -1
+            : mode == SEND_TIMEOUT ? monotonicNs() + SEND_TIMEOUT_NS : 0;
+        while (n > 0) {
+            Frame batch[FRAME_BATCH];
+            int k = n < FRAME_BATCH ? n : FRAME_BATCH;
+            for (int i = 0; i < k; ++i)
+                batch[i] = *at(i);
+            if (handler->send(batch, k, deadline) == -1) {
+                bool full = errno == EAGAIN || errno == ETIMEDOUT;
+                // the frames wait for the next flush
+                if (full && mode != SEND_TIMEOUT)
+                    break;
+                if (!full)
+                    r = -1;
+                for (int i = 0; i < k; ++i)
+                    handler->telemetry.droppedMessage(batch[i].code);
+            }
+            head = (head + k) % capacity;
+            n -= k;
+        }
+        if (n > 0)
+            handler->telemetry.backlog(n);
+        return r;
+    }
+
+    MQHandler *handler;
+    Device device;
+    int patient;
+    Backpressure policy;
+    // waiting frames, n of them from head
+    Frame *frames;
+    int capacity;
+    int head;
+    int n;
+};
+
 #endif
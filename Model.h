@@ -0,0 +1,306 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Patient.h"
+
+// Interface of the glucose-insuline dynamics of a batch of patients. The
+// models see the doses as the Patient counts them: the cumulative number of
+// glucose and insuline injections of each patient. Only Cohort runs them:
+// the Patient of the threaded, ward and coroutine modes keeps the linear
+// model inline in computeGlycemia(), which has no time step to advance a
+// model by.
+class GlycemiaModel {
+public:
+    virtual ~GlycemiaModel() {}
+
+    // advance patients [0, n) by dt seconds and write their glycemia
+    virtual void evaluate(int n, const int *glucose, const int *insuline,
+            double dt, double *glycemia) = 0;
+};
+
+// the model of Patient::computeGlycemia, glycemia is a linear function of
+// the doses and does not depend on time
+class LinearModel : public GlycemiaModel {
+public:
+    void evaluate(int n, const int *glucose, const int *insuline,
+            double dt, double *glycemia) {
+        (void) dt;
+        for (int k = 0; k < n; ++k)
+            glycemia[k] = Patient::Kg * glucose[k] - Patient::Ki * insuline[k];
+    }
+};
+
+// parameters of the Bergman minimal model, time in minutes, glucose in
+// mg/dL and insuline in mU/L
+struct BergmanParams {
+    // glucose effectiveness, 1/min
+    double p1;
+    // decay of the remote insuline action, 1/min
+    double p2;
+    // insuline sensitivity gain, L/(mU.min^2)
+    double p3;
+    // basal glucose and insuline
+    double Gb;
+    double Ib;
+    // plasma insuline clearance, 1/min
+    double clearance;
+    // glucose and insuline distribution volumes, dL and L
+    double VG;
+    double VI;
+    // time to peak of the subcutaneous insuline absorption, min
+    double tmax;
+    // quantity given by one glucose_step (mg) and one insuline_step (mU)
+    double glucoseDose;
+    double insulineDose;
+};
+
+inline BergmanParams bergmanDefaults() {
+    BergmanParams p = {
+        0.028735, 0.028344, 5.035e-5,
+        100.8, 10,
+        0.0926,
+        117, 12,
+        55,
+        1000, 100
+    };
+    return p;
+}
+
+// number of state variables of the Bergman model
+#define BERGMAN_STATES 5
+// patients integrated together by the vector kernel of BergmanModel, the
+// loops over them have this fixed length so the compiler vectorizes them
+#define BERGMAN_BLOCK 64
+#define BERGMAN_ALIGN 32
+
+// Bergman minimal model with a two compartment subcutaneous insuline
+// absorption, which delays the action of each insuline dose:
+//   G'  = -(p1 + X) G + p1 Gb + Ra
+//   X'  = -p2 X + p3 (I - Ib)
+//   I'  = S2 / (tmax VI) - n (I - Ib)
+//   S1' = u - S1 / tmax
+//   S2' = (S1 - S2) / tmax
+// Ra and u are the glucose and insuline infusion rates, deduced from the
+// doses given since the previous call and held over dt. The state of every
+// patient is integrated with fixed step RK4, in substeps of at most hmax
+// seconds. Each state variable has its own array, and evaluate() runs
+// every stage of RK4 as a loop over BERGMAN_BLOCK patients, so one
+// instruction advances several patients; the patients after the last
+// whole block go through the scalar kernel.
+class BergmanModel : public GlycemiaModel {
+public:
+    BergmanModel(int n, double hmax = 60,
+            BergmanParams params = bergmanDefaults())
+        : n(n), hmax(hmax), p(params)
+    {
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            y[v] = allocate();
+        ra = allocate();
+        u = allocate();
+        lastGlucose = new int[n];
+        lastInsuline = new int[n];
+        for (int k = 0; k < n; ++k) {
+            // start every patient at its basal steady state
+            y[0][k] = p.Gb;
+            y[1][k] = 0;
+            y[2][k] = p.Ib;
+            y[3][k] = 0;
+            y[4][k] = 0;
+            lastGlucose[k] = -1;
+            lastInsuline[k] = -1;
+        }
+    }
+
+    ~BergmanModel() {
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            free(y[v]);
+        free(ra);
+        free(u);
+        delete[] lastGlucose;
+        delete[] lastInsuline;
+    }
+
+    void evaluate(int count, const int *glucose, const int *insuline,
+            double dt, double *glycemia) {
+        if (count > n)
+            count = n;
+        int substeps;
+        double h = substep(dt, substeps);
+        infusions(count, glucose, insuline, dt / 60);
+        int k = 0;
+        for (; k + BERGMAN_BLOCK <= count; k += BERGMAN_BLOCK) {
+            for (int s = 0; s < substeps; ++s)
+                rk4Block(k, h);
+        }
+        for (; k < count; ++k) {
+            for (int s = 0; s < substeps; ++s)
+                rk4(k, h);
+        }
+        for (k = 0; k < count; ++k)
+            glycemia[k] = y[0][k];
+    }
+
+    // reference kernel, one patient at a time. It gives the same glycemia
+    // as evaluate()
+    void evaluateScalar(int count, const int *glucose, const int *insuline,
+            double dt, double *glycemia) {
+        if (count > n)
+            count = n;
+        int substeps;
+        double h = substep(dt, substeps);
+        infusions(count, glucose, insuline, dt / 60);
+        for (int k = 0; k < count; ++k) {
+            for (int s = 0; s < substeps; ++s)
+                rk4(k, h);
+            glycemia[k] = y[0][k];
+        }
+    }
+
+    // state variable v of patient k, in the order G, X, I, S1, S2
+    double state(int v, int k) const {
+        return y[v][k];
+    }
+
+private:
+    // not copyable, the arrays are owned
+    BergmanModel(const BergmanModel &);
+    BergmanModel &operator=(const BergmanModel &);
+
+    double *allocate() {
+        void *q = NULL;
+        if (posix_memalign(&q, BERGMAN_ALIGN, n * sizeof(double)) != 0)
+            return NULL;
+        memset(q, 0, n * sizeof(double));
+        return (double *) q;
+    }
+
+    // substeps of at most hmax seconds in dt, and their length in minutes
+    double substep(double dt, int &substeps) const {
+        substeps = 1;
+        while (dt / substeps > hmax)
+            ++substeps;
+        return dt / 60 / substeps;
+    }
+
+    // infusion rates of patients [0, count) over the next minutes
+    void infusions(int count, const int *glucose, const int *insuline,
+            double minutes) {
+        for (int k = 0; k < count; ++k) {
+            // the doses counted before the first call are not infused
+            if (lastGlucose[k] < 0) {
+                lastGlucose[k] = glucose[k];
+                lastInsuline[k] = insuline[k];
+            }
+            ra[k] = 0;
+            u[k] = 0;
+            if (minutes > 0) {
+                ra[k] = (glucose[k] - lastGlucose[k]) * p.glucoseDose
+                    / p.VG / minutes;
+                u[k] = (insuline[k] - lastInsuline[k]) * p.insulineDose
+                    / minutes;
+            }
+            lastGlucose[k] = glucose[k];
+            lastInsuline[k] = insuline[k];
+        }
+    }
+
+    void derivative(const double *z, double ra, double u, double *dz) const {
+        dz[0] = -(p.p1 + z[1]) * z[0] + p.p1 * p.Gb + ra;
+        dz[1] = -p.p2 * z[1] + p.p3 * (z[2] - p.Ib);
+        dz[2] = z[4] / (p.tmax * p.VI) - p.clearance * (z[2] - p.Ib);
+        dz[3] = u - z[3] / p.tmax;
+        dz[4] = (z[3] - z[4]) / p.tmax;
+    }
+
+    // one classic Runge-Kutta step of h minutes of patient k
+    void rk4(int k, double h) {
+        double z[BERGMAN_STATES];
+        double k1[BERGMAN_STATES], k2[BERGMAN_STATES];
+        double k3[BERGMAN_STATES], k4[BERGMAN_STATES];
+        double t[BERGMAN_STATES];
+
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            z[v] = y[v][k];
+        derivative(z, ra[k], u[k], k1);
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            t[v] = z[v] + h / 2 * k1[v];
+        derivative(t, ra[k], u[k], k2);
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            t[v] = z[v] + h / 2 * k2[v];
+        derivative(t, ra[k], u[k], k3);
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            t[v] = z[v] + h * k3[v];
+        derivative(t, ra[k], u[k], k4);
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            y[v][k] = z[v] + h / 6 * (k1[v] + 2 * k2[v] + 2 * k3[v] + k4[v]);
+    }
+
+    // derivative of the BERGMAN_BLOCK patients of z, with the same
+    // expressions as derivative()
+    void derivativeBlock(double (*z)[BERGMAN_BLOCK], const double *ra,
+            const double *u, double (*dz)[BERGMAN_BLOCK]) const {
+        for (int j = 0; j < BERGMAN_BLOCK; ++j) {
+            dz[0][j] = -(p.p1 + z[1][j]) * z[0][j] + p.p1 * p.Gb + ra[j];
+            dz[1][j] = -p.p2 * z[1][j] + p.p3 * (z[2][j] - p.Ib);
+            dz[2][j] = z[4][j] / (p.tmax * p.VI)
+                - p.clearance * (z[2][j] - p.Ib);
+            dz[3][j] = u[j] - z[3][j] / p.tmax;
+            dz[4][j] = (z[3][j] - z[4][j]) / p.tmax;
+        }
+    }
+
+    // next stage point t = z + a * dz of a block
+    static void stage(double (*z)[BERGMAN_BLOCK], double a,
+            double (*dz)[BERGMAN_BLOCK], double (*t)[BERGMAN_BLOCK]) {
+        for (int v = 0; v < BERGMAN_STATES; ++v) {
+            for (int j = 0; j < BERGMAN_BLOCK; ++j)
+                t[v][j] = z[v][j] + a * dz[v][j];
+        }
+    }
+
+    // one Runge-Kutta step of h minutes of the BERGMAN_BLOCK patients from
+    // first, the stages are computed for the whole block at once
+    void rk4Block(int first, double h) {
+        double z[BERGMAN_STATES][BERGMAN_BLOCK];
+        double k1[BERGMAN_STATES][BERGMAN_BLOCK];
+        double k2[BERGMAN_STATES][BERGMAN_BLOCK];
+        double k3[BERGMAN_STATES][BERGMAN_BLOCK];
+        double k4[BERGMAN_STATES][BERGMAN_BLOCK];
+        double t[BERGMAN_STATES][BERGMAN_BLOCK];
+        const double *r = &ra[first];
+        const double *w = &u[first];
+
+        for (int v = 0; v < BERGMAN_STATES; ++v)
+            memcpy(z[v], &y[v][first], sizeof(z[v]));
+        derivativeBlock(z, r, w, k1);
+        stage(z, h / 2, k1, t);
+        derivativeBlock(t, r, w, k2);
+        stage(z, h / 2, k2, t);
+        derivativeBlock(t, r, w, k3);
+        stage(z, h, k3, t);
+        derivativeBlock(t, r, w, k4);
+        for (int v = 0; v < BERGMAN_STATES; ++v) {
+            double *out = &y[v][first];
+            for (int j = 0; j < BERGMAN_BLOCK; ++j)
+                out[j] = z[v][j] + h / 6 * (k1[v][j] + 2 * k2[v][j]
+                        + 2 * k3[v][j] + k4[v][j]);
+        }
+    }
+
+    int n;
+    double hmax;
+    BergmanParams p;
+    // G, X, I, S1 and S2 of every patient
+    double *y[BERGMAN_STATES];
+    // infusion rates of glucose and insuline until the next call
+    double *ra;
+    double *u;
+    // doses already infused
+    int *lastGlucose;
+    int *lastInsuline;
+};
+
+#endif
@@ -1,70 +1,101 @@
 #ifndef PATIENT_H
 #define PATIENT_H
 
-#include <pthread.h>
+#include <stddef.h>
+
+#include "Trace.h"
+
 class Patient {
 public:
 
     Patient()
-        : glucose(63), insuline(0)
-    {
-        // mutex m_glucose and m_insuline intialisation
-        // the mutexes are used to insure the exclusive access to glucose and
-        // insuline parameters
-        pthread_mutex_init(&m_glucose, NULL);
-        pthread_mutex_init(&m_insuline, NULL);
-    }
+        : state(pack(63, 0)), recorder(NULL)
+    {}
 
-    ~Patient() {
-        // mutex m_glucose and m_insuline destruction
-        pthread_mutex_destroy(&m_glucose);
-        pthread_mutex_destroy(&m_insuline);
+    // record the reads of the controller and the injections, NULL for none
+    void setRecorder(TraceRecorder *r) {
+        recorder = r;
     }
+
     // constants definitions
-    static const double glycemia_ref = 120;
-    static const double glycemia_crit = 60;
+    static constexpr double glycemia_ref = 120;
+    static constexpr double glycemia_crit = 60;
     // foreach glucose injection the quantity injected is glucose_step
-    static const int glucose_step = 1;
+    static constexpr int glucose_step = 1;
     // the quantity of insuline injected in each insuline_injection
-    static const int insuline_step = 1;
-    static const double Kg = 1.6;
-    static const double Ki = 1.36;
-
-    // compute the new glycemia value using mutex for shared variables glucose
-    // and insuline to protect the access to this variables
-    double computeGlycemia() {
-        pthread_mutex_lock(&m_glucose);
-        pthread_mutex_lock(&m_insuline);
-        double glycemia = Kg * glucose - Ki * insuline;
-        pthread_mutex_unlock(&m_glucose);
-        pthread_mutex_unlock(&m_insuline);
+    static constexpr int insuline_step = 1;
+    static constexpr double Kg = 1.6;
+    static constexpr double Ki = 1.36;
 
+    // glycemia of the linear model for the doses given so far
+    static double glycemiaOf(int glucose, int insuline) {
+        return Kg * glucose - Ki * insuline;
+    }
+
+    // compute the new glycemia value from a consistent snapshot of glucose
+    // and insuline, without locking
+    double computeGlycemia() const {
+        int glucose, insuline;
+        snapshot(glucose, insuline);
+        double glycemia = glycemiaOf(glucose, insuline);
+        if (recorder)
+            recorder->record(TRACE_GLYCEMIA, 0, 0, glucose, insuline,
+                    glycemia);
         return glycemia;
     }
 
-    // increment the glucose shared variable using mutex for shared variable
-    // glucose to protect its access
-    void injectGlucose() {
-        pthread_mutex_lock(&m_glucose);
-        glucose += glucose_step;
-        pthread_mutex_unlock(&m_glucose);
+    // modification epoch: it changes at every injection and only then,
+    // glucose and insuline only grow so the packed state never repeats
+    unsigned long long epoch() const {
+        return __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+    }
+
+    // true if the reads of the controller are recorded, each one must then
+    // be made
+    bool traced() const {
+        return recorder != NULL;
+    }
+
+    // read glucose and insuline with a single atomic load
+    void snapshot(int &glucose, int &insuline) const {
+        unsigned long long s = __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+        glucose = (int) (unsigned) s;
+        insuline = (int) (unsigned) (s >> 32);
     }
 
-    // increment the insuline shared variable using mutex for shared variable
-    // insuline to protect its access
-    void injectInsuline() {
-        pthread_mutex_lock(&m_insuline);
-        insuline += insuline_step;
-        pthread_mutex_unlock(&m_insuline);
+    // increment the glucose half of the shared state atomically, return
+    // the glucose after the injection
+    int injectGlucose() {
+        unsigned long long s = __atomic_add_fetch(&state,
+                pack(glucose_step, 0), __ATOMIC_RELEASE);
+        int glucose = (int) (unsigned) s;
+        if (recorder)
+            recorder->record(TRACE_GLUCOSE, 0, 0, glucose, 0, 0);
+        return glucose;
+    }
+
+    // increment the insuline half of the shared state atomically, return
+    // the insuline after the injection
+    int injectInsuline() {
+        unsigned long long s = __atomic_add_fetch(&state,
+                pack(0, insuline_step), __ATOMIC_RELEASE);
+        int insuline = (int) (unsigned) (s >> 32);
+        if (recorder)
+            recorder->record(TRACE_INSULINE, 0, 0, insuline, 0, 0);
+        return insuline;
     }
-    // declaration of two mutex m_glucose and m_insuline
-    pthread_mutex_t m_glucose;
-    pthread_mutex_t m_insuline;
 
 private:
-    // shared variables
-    int glucose;
-    int insuline;
+    // glucose lives in the low 32 bits and insuline in the high 32 bits, both
+    // only grow so an increment of one never carries into the other
+    static unsigned long long pack(int glucose, int insuline) {
+        return (unsigned long long) (unsigned) insuline << 32
+            | (unsigned) glucose;
+    }
+
+    // shared variables glucose and insuline
+    unsigned long long state;
+    TraceRecorder *recorder;
 };
 
 #endif
@@ -0,0 +1,150 @@
+#ifndef PERIODIC_H
+#define PERIODIC_H
+
+#include <string.h>
+#include <iostream>
+
+#include "Clock.h"
+#include "Histogram.h"
+
+// what a periodic task does when a cycle ends after the next release:
+// SKIP waits for the first release still ahead and drops the missed ones,
+// CATCH_UP runs every missed cycle back to back, COMPRESS runs one cycle at
+// once for the missed ones then waits for the next release
+enum Overrun { SKIP, CATCH_UP, COMPRESS, OVERRUNS };
+
+inline const char *overrunName(int id) {
+    static const char *names[OVERRUNS] = { "skip", "catchup", "compress" };
+    return id >= 0 && id < OVERRUNS ? names[id] : "";
+}
+
+// id of the overrun policy called name, -1 if there is none
+inline int findOverrun(const char *name) {
+    for (int id = 0; id < OVERRUNS; ++id) {
+        if (strcmp(name, overrunName(id)) == 0)
+            return id;
+    }
+    return -1;
+}
+
+// counters of a periodic task, times in nanoseconds
+struct TaskStats {
+    TaskStats()
+        : releases(0), misses(0), skipped(0), jitterSum(0), jitterMax(0),
+          execSum(0), execMax(0), execCount(0) {}
+
+    long releases;
+    // cycles ended after their deadline, the next release
+    long misses;
+    // releases dropped by the SKIP and COMPRESS policies
+    long skipped;
+    // delay between the release time and the wakeup of the task
+    long long jitterSum;
+    long long jitterMax;
+    // time between the wakeup and the end of the cycle
+    long long execSum;
+    long long execMax;
+    long execCount;
+};
+
+// Periodic release of a task on absolute times of the monotonic clock. The
+// n-th release is at start + n * period whatever the cycles took, instead
+// of a period after the end of the previous cycle as with usleep, so the
+// work and the wakeup latency of a cycle do not delay the next ones.
+//
+//     PeriodicTask task(period);
+//     while (...) {
+//         task.wait();
+//         ... work of the cycle ...
+//     }
+//
+// A task that waits for something else until its next release, like an
+// actuator for a command, sleeps until deadline() and calls begin() itself.
+class PeriodicTask {
+public:
+    // the first release is a period from now. The release jitter is also
+    // recorded in the histogram jitter if given
+    PeriodicTask(long long periodNs, Overrun policy = SKIP,
+            Histogram *jitter = NULL)
+        : period(periodNs), policy(policy), release(monotonicNs() + periodNs),
+          started(0), running(false), jitter(jitter) {}
+
+    // end the current cycle, sleep until the next release and start it
+    void wait() {
+        finish();
+        sleepUntil(release);
+        begin();
+    }
+
+    // absolute time of the next release
+    long long deadline() const { return release; }
+
+    // start the cycle of the current release, once its time is reached
+    void begin() {
+        started = monotonicNs();
+        long long late = started - release;
+        if (late < 0)
+            late = 0;
+        stats.jitterSum += late;
+        if (late > stats.jitterMax)
+            stats.jitterMax = late;
+        if (jitter)
+            jitter->record(late);
+        ++stats.releases;
+        running = true;
+    }
+
+    // end the current cycle and compute the next release
+    void finish() {
+        if (!running)
+            return;
+        running = false;
+        long long now = monotonicNs();
+        long long exec = now - started;
+        stats.execSum += exec;
+        if (exec > stats.execMax)
+            stats.execMax = exec;
+        ++stats.execCount;
+
+        release += period;
+        if (now <= release)
+            return;
+        ++stats.misses;
+        // releases already passed, including the one just computed
+        long late = (now - release) / period + 1;
+        if (policy == SKIP) {
+            release += late * period;
+            stats.skipped += late;
+        } else if (policy == COMPRESS) {
+            release += (late - 1) * period;
+            stats.skipped += late - 1;
+        }
+        // CATCH_UP keeps the late release, the next cycles start at once
+    }
+
+    const TaskStats &counters() const { return stats; }
+
+    // print the counters on one line, times in us
+    void report(const char *name, std::ostream &os) const {
+        long long n = stats.releases > 0 ? stats.releases : 1;
+        long long m = stats.execCount > 0 ? stats.execCount : 1;
+        os << name << ": " << stats.releases << " releases, jitter mean "
+           << stats.jitterSum / n / 1000 << " us max "
+           << stats.jitterMax / 1000 << " us, exec mean "
+           << stats.execSum / m / 1000 << " us max "
+           << stats.execMax / 1000 << " us, " << stats.misses
+           << " deadline misses, " << stats.skipped << " skipped"
+           << std::endl;
+    }
+
+private:
+    long long period;
+    Overrun policy;
+    long long release;
+    long long started;
+    bool running;
+    Histogram *jitter;
+    TaskStats stats;
+};
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <iostream>
+
+#if defined(__QNX__)
+#include <sys/neutrino.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "Error.h"
+#include "Lock.h"
+
+// stack of a hardened task and the part of it touched before it starts,
+// heap touched and kept by the process. Once locked they count against
+// RLIMIT_MEMLOCK for a user without CAP_IPC_LOCK
+#define RT_STACK_SIZE (256 * 1024)
+#define RT_STACK (32 * 1024)
+#define RT_HEAP (4 * 1024 * 1024)
+// tasks created through one RealTime at most
+#define RT_TASKS 8
+#define RT_PAGE 4096
+
+// The calls that differ between QNX and Linux. They return 0 or the error.
+
+// give the calling thread priority with SCHED_FIFO
+inline int setCurrentPriority(int priority) {
+#if defined(__QNX__)
+    return setprio(0, priority) == -1 ? errno : 0;
+#else
+    sched_param param;
+    param.sched_priority = priority;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+}
+
+// run the calling thread on cpu only, -1 for any
+inline int pinCurrentThread(int cpu) {
+    if (cpu < 0)
+        return 0;
+#if defined(__QNX__)
+    if (ThreadCtl(_NTO_TCTL_RUNMASK, (void *) (uintptr_t) (1u << cpu)) == -1)
+        return errno;
+    return 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// lock the pages of the process, the ones mapped later included
+inline int lockAllMemory() {
+    return mlockall(MCL_CURRENT | MCL_FUTURE) == 0 ? 0 : errno;
+}
+
+// touch RT_STACK bytes below the caller, so the stack of the task is
+// mapped before its first cycle
+inline void __attribute__((noinline)) prefaultStack() {
+    char stack[RT_STACK];
+    volatile char *p = stack;
+    for (int i = 0; i < RT_STACK; i += RT_PAGE)
+        p[i] = 0;
+}
+
+// a task created through RealTime, what it asked for and what the system
+// refused, 0 when applied
+struct RtTask {
+    const char *name;
+    int priority;
+    int cpu;
+    bool prefault;
+    void *(*fn)(void *);
+    void *arg;
+    int schedError;
+    int pinError;
+};
+
+// Scheduling of the tasks of the threaded mode. createTask() gives a task
+// its SCHED_FIFO priority and, when the system refuses it (a Linux user
+// without CAP_SYS_NICE), still starts it with the default policy and keeps
+// the error for report(), instead of leaving the thread uncreated.
+//
+// A hardened RealTime also locks the memory and keeps a heap already
+// mapped (lockMemory), pins the tasks to their cpu and touches their stack
+// before they start, so the control loop takes no page fault.
+class RealTime {
+public:
+    RealTime(bool harden)
+        : harden(harden), nTasks(0), lockError(0), locked(false),
+          mainPriority(-1), mainError(0) {}
+
+    ~RealTime() {
+        if (locked && lockError == 0)
+            munlockall();
+    }
+
+    // give the calling thread priority with SCHED_FIFO
+    void setMainPriority(int priority) {
+        mainPriority = priority;
+        mainError = setCurrentPriority(priority);
+    }
+
+    // error of setMainPriority(), 0 if the priority was applied
+    int mainPriorityError() const {
+        return mainError;
+    }
+
+    // map RT_HEAP bytes of heap that the allocator keeps and lock the
+    // memory of the process, to call before the tasks are created
+    void lockMemory() {
+        if (!harden)
+            return;
+#if defined(__GLIBC__)
+        // freed memory stays in the heap instead of going back to the
+        // system, and no allocation gets its own mapping
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+#endif
+        char *heap = (char *) malloc(RT_HEAP);
+        if (heap) {
+            for (int i = 0; i < RT_HEAP; i += RT_PAGE)
+                heap[i] = 0;
+            free(heap);
+        }
+        lockError = lockAllMemory();
+        locked = true;
+    }
+
+    // create the task name running fn(arg) with priority, on cpu when
+    // hardened (-1 for any). Return the error of pthread_create
+    int createTask(pthread_t *thread, const char *name, int priority,
+            int cpu, void *(*fn)(void *), void *arg) {
+        CHECK(nTasks < RT_TASKS, "Too many real-time tasks");
+        if (nTasks >= RT_TASKS)
+            return EAGAIN;
+        RtTask *task = &tasks[nTasks++];
+        task->name = name;
+        task->priority = priority;
+        task->cpu = harden ? cpu : -1;
+        task->prefault = harden;
+        task->fn = fn;
+        task->arg = arg;
+        task->schedError = 0;
+        task->pinError = 0;
+
+        pthread_attr_t attr;
+        sched_param param;
+        param.sched_priority = priority;
+        int r = pthread_attr_init(&attr);
+        CHECK(r == 0, "Error initialising the attributes of " << name);
+        if (r == 0)
+            r = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (r == 0)
+            r = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        if (r == 0)
+            r = pthread_attr_setschedparam(&attr, &param);
+        // a locked stack of the default size would take most of the
+        // memory a user can lock
+        if (r == 0 && harden)
+            r = pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+        if (r == 0)
+            r = pthread_create(thread, &attr, start, task);
+        if (r != 0) {
+            // the policy or the priority was refused, run without them
+            task->schedError = r;
+            pthread_attr_destroy(&attr);
+            pthread_attr_init(&attr);
+            if (harden)
+                pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+            r = pthread_create(thread, &attr, start, task);
+        }
+        pthread_attr_destroy(&attr);
+        CHECK(r == 0, "Error creating " << name << ": " << strerror(r));
+        return r;
+    }
+
+    // print how each task runs, to call once they ended
+    void report(std::ostream &os) const {
+        if (locked)
+            os << "memory: " << (lockError ? "not locked (" : "locked")
+               << (lockError ? strerror(lockError) : "")
+               << (lockError ? ")" : "") << std::endl;
+        if (mainPriority >= 0) {
+            os << "main: SCHED_FIFO " << mainPriority;
+            if (mainError)
+                os << " refused (" << strerror(mainError) << ")";
+            os << std::endl;
+        }
+        for (int i = 0; i < nTasks; ++i) {
+            const RtTask *t = &tasks[i];
+            os << t->name << ": SCHED_FIFO " << t->priority;
+            if (t->schedError)
+                os << " refused (" << strerror(t->schedError)
+                   << "), default policy";
+            if (t->cpu >= 0) {
+                os << ", cpu " << t->cpu;
+                if (t->pinError)
+                    os << " refused (" << strerror(t->pinError) << ")";
+            }
+            os << std::endl;
+        }
+    }
+
+private:
+    // first function of every task: applies and checks its settings
+    static void *start(void *args) {
+        RtTask *task = (RtTask *) args;
+        int policy;
+        sched_param param;
+        if (task->schedError == 0
+                && pthread_getschedparam(pthread_self(), &policy, &param) == 0
+                && (policy != SCHED_FIFO
+                    || param.sched_priority != task->priority))
+            task->schedError = EPERM;
+        task->pinError = pinCurrentThread(task->cpu);
+        // the locks tell the waits behind a task of lower priority from it,
+        // whether the system applied the priority or not
+        taskPriority() = task->priority;
+        if (task->prefault)
+            prefaultStack();
+        return task->fn(task->arg);
+    }
+
+    bool harden;
+    RtTask tasks[RT_TASKS];
+    int nTasks;
+    int lockError;
+    bool locked;
+    int mainPriority;
+    int mainError;
+};
+
+#endif
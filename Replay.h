@@ -0,0 +1,279 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <iostream>
+
+#include "Clock.h"
+#include "Controller.h"
+#include "EdgeTrigger.h"
+#include "Message.h"
+#include "Patient.h"
+#include "Syringe.h"
+#include "Trace.h"
+
+// mismatches printed by a replay, the others are only counted
+#define REPLAY_REPORTED 10
+// outputs of one controller cycle at most: two commands and an alarm
+#define REPLAY_OUTPUTS 4
+
+// an output the replayed controller expects to find next in the trace
+struct ReplayOutput {
+    TraceKind kind;
+    int device;
+    int code;
+    double value;
+};
+
+// Replay of a trace of the threaded mode. The records are applied in the
+// order of the trace to a controller with the recorded policy and triggers,
+// to the pumps and to a Syringe, and what they produce is compared to what
+// was recorded:
+// - the controller decides on each recorded glycemia and must post the
+//   recorded commands and send the recorded alarms, in the same order
+// - a pump must read a command posted to it, inject only while started and
+//   reach the recorded glucose or insuline count
+// - the syringe must reach the recorded level and active syringe
+// - the frames of each device must follow each other and the pumps must
+//   display the injection state they replayed
+template <class Policy>
+class Replay {
+public:
+    Replay(const TraceHeader &header)
+        : glucoseOut(!header.levelTriggered, header.heartbeat),
+          insulineOut(!header.levelTriggered, header.heartbeat),
+          alarmOut(!header.levelTriggered), head(0), nOutputs(0),
+          glucose(0), insuline(0), mismatches(0), unwritten(0)
+    {
+        for (int d = 0; d < DEVICES; ++d) {
+            injecting[d] = false;
+            posted[d][0] = posted[d][1] = NONE;
+            seq[d] = 0;
+        }
+        // the insuline pump starts injecting, as t_insuline
+        injecting[INSULINE_DEVICE] = true;
+        Patient initial;
+        initial.snapshot(glucose, insuline);
+    }
+
+    // apply record number n of the trace
+    void apply(const TraceRecord &r, long long n) {
+        switch (r.kind) {
+            case TRACE_NONE:
+                ++unwritten;
+                break;
+            case TRACE_GLYCEMIA:
+                decide(r, n);
+                break;
+            case TRACE_POST:
+            case TRACE_RECEIVE:
+                if (r.device != GLUCOSE_DEVICE && r.device != INSULINE_DEVICE)
+                    mismatch(r, n, "command of a device without pump");
+                else if (r.kind == TRACE_POST)
+                    post(r, n);
+                else
+                    receive(r, n);
+                break;
+            case TRACE_GLUCOSE:
+            case TRACE_INSULINE:
+                inject(r, n);
+                break;
+            case TRACE_PUMP:
+                sManager.pump();
+                checkSyringe(r, n);
+                if (r.value != sManager.inspect())
+                    mismatch(r, n, "syringe level differs");
+                break;
+            case TRACE_SWITCH:
+                sManager.syringeSwitch();
+                checkSyringe(r, n);
+                break;
+            case TRACE_RESET:
+                sManager.reset();
+                checkSyringe(r, n);
+                break;
+            case TRACE_STOP:
+                sManager.stop();
+                break;
+            case TRACE_SEND:
+                send(r, n);
+                break;
+            default:
+                mismatch(r, n, "unknown record");
+                break;
+        }
+    }
+
+    long mismatchCount() const { return mismatches; }
+
+    // print the state reached by the replay
+    void report(std::ostream &os) {
+        os << "replayed state: glucose " << glucose << ", insuline "
+           << insuline << ", glycemia "
+           << Patient::glycemiaOf(glucose, insuline)
+           << ", syringe " << sManager.getActiveSyringe() + 1
+           << " active, " << unwritten << " unwritten records" << std::endl;
+    }
+
+private:
+    // the controller decides on the recorded glycemia and queues the
+    // outputs t_controller makes for it
+    void decide(const TraceRecord &r, long long n) {
+        if (nOutputs > 0)
+            mismatch(r, n, "controller outputs missing before this cycle");
+        head = nOutputs = 0;
+        if (r.value != Patient::glycemiaOf(r.a, r.b))
+            mismatch(r, n, "glycemia does not match the doses");
+
+        Decision d = controller.decide(r.value);
+        if (d.glucose == NONE) {
+            if (glucoseOut.idleCycle())
+                expect(TRACE_POST, GLUCOSE_DEVICE, glucoseOut.command(), 0);
+        } else if (glucoseOut.update(d.glucose)) {
+            expect(TRACE_POST, GLUCOSE_DEVICE, d.glucose, 0);
+        }
+        if (d.insuline == NONE) {
+            if (insulineOut.idleCycle())
+                expect(TRACE_POST, INSULINE_DEVICE, insulineOut.command(),
+                        0);
+        } else if (insulineOut.update(d.insuline)) {
+            expect(TRACE_POST, INSULINE_DEVICE, d.insuline, 0);
+        }
+        if (d.alarm != NONE && alarmOut.update(d.alarm))
+            expect(TRACE_SEND, CONTROLLER_DEVICE, d.alarm, r.value);
+    }
+
+    void expect(TraceKind kind, int device, int code, double value) {
+        ReplayOutput o = { kind, device, code, value };
+        outputs[nOutputs++] = o;
+    }
+
+    // the next output of the controller must be r
+    void output(const TraceRecord &r, long long n) {
+        if (head == nOutputs) {
+            mismatch(r, n, "unexpected controller output");
+            return;
+        }
+        const ReplayOutput &o = outputs[head++];
+        if (o.kind != r.kind || o.device != r.device || o.code != r.code
+                || o.value != r.value)
+            mismatch(r, n, "controller output differs");
+        if (head == nOutputs)
+            head = nOutputs = 0;
+    }
+
+    void post(const TraceRecord &r, long long n) {
+        // the halt of the end of the run follows the last cycle
+        if (r.code == HALT) {
+            if (nOutputs > 0)
+                mismatch(r, n, "controller outputs missing before halt");
+        } else {
+            output(r, n);
+        }
+        posted[r.device][1] = posted[r.device][0];
+        posted[r.device][0] = (Message) r.code;
+    }
+
+    // a pump reads the last command or, when the controller recorded a
+    // post it had not made yet, the one before
+    void receive(const TraceRecord &r, long long n) {
+        if (r.code != posted[r.device][0] && r.code != posted[r.device][1])
+            mismatch(r, n, "command read was not posted");
+        if (r.code == START)
+            injecting[r.device] = true;
+        else if (r.code == STOP)
+            injecting[r.device] = false;
+    }
+
+    void inject(const TraceRecord &r, long long n) {
+        int count;
+        if (r.kind == TRACE_GLUCOSE) {
+            if (!injecting[GLUCOSE_DEVICE])
+                mismatch(r, n, "glucose injected while stopped");
+            count = glucose += Patient::glucose_step;
+        } else {
+            if (!injecting[INSULINE_DEVICE])
+                mismatch(r, n, "insuline injected while stopped");
+            count = insuline += Patient::insuline_step;
+        }
+        if (count != r.a)
+            mismatch(r, n, "dose count differs");
+    }
+
+    void checkSyringe(const TraceRecord &r, long long n) {
+        if (r.a != sManager.getActiveSyringe())
+            mismatch(r, n, "active syringe differs");
+    }
+
+    void send(const TraceRecord &r, long long n) {
+        if (r.device >= DEVICES) {
+            mismatch(r, n, "unknown device");
+            return;
+        }
+        if ((unsigned) r.b != seq[r.device] + 1)
+            mismatch(r, n, "frame sequence broken");
+        seq[r.device] = r.b;
+        if (r.device == CONTROLLER_DEVICE && r.code != HALT)
+            output(r, n);
+        if ((r.code == GLUCOSE_START && !injecting[GLUCOSE_DEVICE])
+                || (r.code == GLUCOSE_STOP && injecting[GLUCOSE_DEVICE])
+                || (r.code == INSULINE_START && !injecting[INSULINE_DEVICE])
+                || (r.code == INSULINE_STOP && injecting[INSULINE_DEVICE]))
+            mismatch(r, n, "displayed injection state differs");
+    }
+
+    void mismatch(const TraceRecord &r, long long n, const char *what) {
+        if (mismatches++ < REPLAY_REPORTED)
+            std::cout << "record " << n << " (" << traceKindName(r.kind)
+                      << " code " << (int) r.code << "): " << what
+                      << std::endl;
+    }
+
+    Controller<Policy> controller;
+    EdgeTrigger glucoseOut;
+    EdgeTrigger insulineOut;
+    EdgeTrigger alarmOut;
+    ReplayOutput outputs[REPLAY_OUTPUTS];
+    int head;
+    int nOutputs;
+    // state of the pumps, the last two commands posted to each and the last
+    // frame sequence number of each device
+    bool injecting[DEVICES];
+    Message posted[DEVICES][2];
+    unsigned seq[DEVICES];
+    int glucose;
+    int insuline;
+    Syringe sManager;
+    long mismatches;
+    long long unwritten;
+};
+
+// replay the trace of reader with the controller Policy, print the
+// mismatches and the speed of the replay, return the number of mismatches
+template <class Policy>
+long replayTrace(TraceReader &reader, std::ostream &os) {
+    Replay<Policy> replay(reader.traceHeader());
+    long long start = monotonicNs();
+    const TraceRecord *r;
+    while ((r = reader.next()) != NULL)
+        replay.apply(*r, reader.tell() - 1);
+    long long duration = monotonicNs() - start;
+    if (duration <= 0)
+        duration = 1;
+    os << reader.tell() << " records replayed in " << duration / 1000000
+       << " ms (" << (long long) (reader.tell() * 1e9 / duration)
+       << " records/s), " << replay.mismatchCount() << " mismatches, "
+       << reader.traceHeader().drops << " records dropped by the recorder"
+       << std::endl;
+    replay.report(os);
+    return replay.mismatchCount();
+}
+
+// replay of each policy, indexed by PolicyId
+static long (*const replays[POLICIES])(TraceReader &, std::ostream &) = {
+    replayTrace<BangBang>,
+    replayTrace<Hysteresis>,
+    replayTrace<Pid>,
+    replayTrace<Predictive>,
+};
+
+#endif
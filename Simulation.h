@@ -0,0 +1,243 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <queue>
+#include <vector>
+#include <iostream>
+
+#include "Clock.h"
+#include "Error.h"
+#include "Message.h"
+#include "TimerWheel.h"
+#include "Ward.h"
+
+// maximum number of periodic tasks and of medications of a simulation
+#define SIM_TASKS 8
+#define SIM_DOSES 8
+// resolution of the medication timers, in nanoseconds of virtual time
+#define SIM_TICK 1000000
+// task of the events that advance the timer wheel
+#define SIM_WHEEL -1
+// parameters of the FNV-1a hash of the actuator trace
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// a periodic step of the bed
+struct SimTask {
+    Priority priority;
+    void (*step)(Bed *);
+    long long period;
+};
+
+// a medication given by a timer of the wheel
+struct SimDose {
+    Bed *bed;
+    Message dose;
+    Timer timer;
+};
+
+// release of a task at a virtual time. Releases at the same time run by
+// decreasing priority, then in the order they were scheduled
+struct SimEvent {
+    long long time;
+    int priority;
+    unsigned long long seq;
+    int task;
+
+    bool operator<(const SimEvent &other) const {
+        if (time != other.time)
+            return time > other.time;
+        if (priority != other.priority)
+            return priority < other.priority;
+        return seq > other.seq;
+    }
+};
+
+// Discrete-event simulation of one patient. The tasks of GlycemiaRegulator
+// are replaced by the steps of a bed released from an event queue on a
+// virtual clock, so a run takes as long as the CPU needs and always gives
+// the same output for the same seed.
+class Simulation {
+public:
+    // period is the cycle of the controller, glucose and insuline tasks in
+    // nanoseconds. A non zero seed shifts each task by a random phase
+    Simulation(long long period, int nCycles, unsigned seed, std::ostream &os)
+        : wheel(SIM_TICK), wheelAt(-1), nCycles(nCycles), cycles(0),
+          nTasks(0), nDoses(0), nextSeq(0), halted(false), rng(seed),
+          trace(FNV_OFFSET), os(os)
+    {
+        controller = addTask(VERY_CRITICAL, controllerStep, period);
+        glucose = addTask(VERY_URGENT, glucoseStep, period);
+        insuline = addTask(URGENT, insulineStep, period);
+        syringe = addTask(CRITICAL, syringeStep, 0);
+
+        // the tasks sleep a period before their first cycle
+        for (int i = 0; i < nTasks; ++i) {
+            if (tasks[i].period > 0)
+                schedule(i, period + phase(period));
+        }
+    }
+
+    // give dose every interval nanoseconds starting at first, like the
+    // antibiotic and anticoagulant timers. At most SIM_DOSES doses, their
+    // timers stay linked in the wheel so the array cannot move
+    void addDose(Message dose, long long first, long long interval) {
+        CHECK(nDoses < SIM_DOSES, "Too many simulated doses");
+        if (nDoses >= SIM_DOSES)
+            return;
+        SimDose *d = &doses[nDoses++];
+        d->bed = &bed;
+        d->dose = dose;
+        wheel.schedule(&d->timer, first, interval, giveDose, d);
+        scheduleWheel();
+    }
+
+    // process the events until the controller halts the system
+    void run() {
+        while (!halted && !events.empty()) {
+            SimEvent event = events.top();
+            events.pop();
+            clock.advanceTo(event.time);
+            if (event.task == SIM_WHEEL)
+                releaseWheel(event.time);
+            else
+                release(event.task);
+            display();
+        }
+    }
+
+    // run step instead of controllerStep as the controller task
+    void setController(void (*step)(Bed *)) {
+        tasks[controller].step = step;
+    }
+
+    long long now() const { return clock.now(); }
+
+    // digest of the doses given by the pumps and of their times, two runs
+    // with the same digest injected the patient the same way
+    unsigned long long actuatorTrace() const { return trace; }
+
+    Bed *patientBed() { return &bed; }
+
+private:
+    int addTask(Priority priority, void (*step)(Bed *), long long period) {
+        SimTask task = { priority, step, period };
+        tasks[nTasks] = task;
+        return nTasks++;
+    }
+
+    void schedule(int task, long long time) {
+        SimEvent event = { time, tasks[task].priority, nextSeq++, task };
+        events.push(event);
+    }
+
+    static void giveDose(void *arg, long long time) {
+        (void) time;
+        SimDose *d = (SimDose *) arg;
+        post(d->bed, d->dose);
+    }
+
+    // queue an event at the next expiry of the wheel, the medications are
+    // the least urgent releases of a given time
+    void scheduleWheel() {
+        long long next = wheel.nextExpiry();
+        if (next < 0 || (wheelAt >= 0 && wheelAt <= next))
+            return;
+        wheelAt = next;
+        SimEvent event = { next, WEAK, nextSeq++, SIM_WHEEL };
+        events.push(event);
+    }
+
+    void releaseWheel(long long time) {
+        // an earlier expiry was scheduled after this event was queued
+        if (time != wheelAt)
+            return;
+        wheelAt = -1;
+        wheel.advance(time);
+        scheduleWheel();
+    }
+
+    // run one release of a task and schedule the next one
+    void release(int task) {
+        SimTask *t = &tasks[task];
+        t->step(&bed);
+        if (task == glucose || task == insuline) {
+            int g, i;
+            bed.patient.snapshot(g, i);
+            mix(clock.now());
+            mix(((unsigned long long) i << 32) | (unsigned) g);
+        }
+        // t_syringe wakes up as soon as the insuline task pumped
+        if (bed.pumped)
+            schedule(syringe, clock.now());
+
+        if (task == controller && ++cycles == nCycles) {
+            halt();
+            return;
+        }
+        if (t->period > 0)
+            schedule(task, clock.now() + t->period);
+    }
+
+    // end of the controller loop: stop the actuators and the syringe
+    void halt() {
+        bed.glucoseCmd.post(HALT);
+        bed.insulineCmd.post(HALT);
+        post(&bed, HALT);
+        bed.sManager.stop();
+        halted = true;
+    }
+
+    // print the events of the bed stamped with the virtual time
+    void display() {
+        for (int i = 0; i < bed.nEvents; ++i) {
+            const char *text = messageText(bed.events[i].msg);
+            if (*text)
+                os << "[" << clock.now() / 1000000 << " ms] " << text << "\n";
+        }
+        bed.nEvents = 0;
+    }
+
+    // FNV-1a of the bytes of value into the trace
+    void mix(unsigned long long value) {
+        for (int b = 0; b < 8; ++b) {
+            trace ^= (value >> (8 * b)) & 0xff;
+            trace *= FNV_PRIME;
+        }
+    }
+
+    // random phase in [0, period), 0 when the simulation has no seed
+    long long phase(long long period) {
+        if (rng == 0)
+            return 0;
+        // xorshift, so a seed gives the same phases on every platform
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return rng % period;
+    }
+
+    Bed bed;
+    VirtualClock clock;
+    std::priority_queue<SimEvent> events;
+    SimTask tasks[SIM_TASKS];
+    SimDose doses[SIM_DOSES];
+    TimerWheel wheel;
+    // time of the queued wheel event, -1 if none
+    long long wheelAt;
+    int nCycles;
+    int cycles;
+    int nTasks;
+    int nDoses;
+    int controller;
+    int glucose;
+    int insuline;
+    int syringe;
+    unsigned long long nextSeq;
+    bool halted;
+    unsigned rng;
+    unsigned long long trace;
+    std::ostream &os;
+};
+
+#endif
@@ -3,72 +3,323 @@
 #define SYRINGE_H
 
 #include <pthread.h>
+#include <stddef.h>
+
+#include "Error.h"
+#include "Lock.h"
+#include "Trace.h"
+
+// maximum number of observers of a syringe, of thresholds per observer and
+// of crossings waiting to be read by an observer
+#define SYRINGE_SUBSCRIBERS 2
+#define SYRINGE_THRESHOLDS 4
+#define SYRINGE_PENDING 8
+// tries of levels() on a syringe being written before it takes m_syringe
+#define SYRINGE_READ_TRIES 64
 
 class Syringe {
 public:
-    Syringe() : s_active(0) {
-        // intialise the mutex m_syringe + the shared variables
+    // a watched threshold crossed by the active syringe level
+    struct Crossing {
+        double threshold;
+        double level;
+        int active;
+    };
+
+    Syringe()
+        : s_active(0), levelSeq(0), stopped(false), nSubscribers(0),
+          pumps(0), recorder(NULL)
+    {
+        // intialise the shared variables, m_syringe inherits the priority
+        // of the tasks waiting for it
         s_level[0] = 100;
         s_level[1] = 100;
-        pthread_mutex_init(&m_syringe, NULL);
     }
 
     ~Syringe() {
-        // destroy the mutex m_syringe
-        pthread_mutex_destroy(&m_syringe);
+        // destroy the observers condvars
+        for (int i = 0; i < nSubscribers; ++i)
+            pthread_cond_destroy(&subscribers[i].cv_crossing);
+    }
+
+    // register an observer of the active syringe level, it is woken up only
+    // when the level goes down across one of the thresholds. Return the id
+    // to give to waitCrossing(), -1 if SYRINGE_SUBSCRIBERS observers have
+    // already subscribed
+    int subscribe(const double *thresholds, int n) {
+        m_syringe.lock();
+        CHECK(nSubscribers < SYRINGE_SUBSCRIBERS, "Too many syringe observers");
+        if (nSubscribers >= SYRINGE_SUBSCRIBERS) {
+            m_syringe.unlock();
+            return -1;
+        }
+        int id = nSubscribers++;
+        Subscriber *s = &subscribers[id];
+        s->nThresholds = n < SYRINGE_THRESHOLDS ? n : SYRINGE_THRESHOLDS;
+        for (int i = 0; i < s->nThresholds; ++i)
+            s->thresholds[i] = thresholds[i];
+        s->head = 0;
+        s->count = 0;
+        s->wakeups = 0;
+        s->wake = NULL;
+        pthread_cond_init(&s->cv_crossing, NULL);
+        m_syringe.unlock();
+        return id;
+    }
+
+    // measure m_syringe into stats, NULL for none. Must be set before the
+    // tasks use the syringe
+    void setLockStats(LockStats *stats) {
+        m_syringe.setStats(stats);
+    }
+
+    // record the changes of the syringe to recorder, NULL for none. They are
+    // recorded under m_syringe, in the order they are made
+    void setRecorder(TraceRecorder *r) {
+        recorder = r;
+    }
+
+    // wait until the observer id has a crossing to read. Return false once
+    // the syringe is stopped and every crossing has been read
+    bool waitCrossing(int id, Crossing &crossing) {
+        if (id < 0)
+            return false;
+        Subscriber *s = &subscribers[id];
+        m_syringe.lock();
+        // the predicate makes a crossing notified before the wait not lost
+        while (s->count == 0 && !stopped)
+            m_syringe.wait(&s->cv_crossing);
+        bool found = s->count > 0;
+        if (found) {
+            crossing = s->pending[s->head];
+            s->head = (s->head + 1) % SYRINGE_PENDING;
+            --s->count;
+        }
+        ++s->wakeups;
+        m_syringe.unlock();
+        return found;
+    }
+
+    // take a crossing of the observer id without waiting. Return 1 if one
+    // was read, 0 if there is none yet and -1 once the syringe is stopped
+    // and every crossing has been read
+    int tryCrossing(int id, Crossing &crossing) {
+        if (id < 0)
+            return -1;
+        Subscriber *s = &subscribers[id];
+        m_syringe.lock();
+        int found = s->count > 0 ? 1 : stopped ? -1 : 0;
+        if (found > 0) {
+            crossing = s->pending[s->head];
+            s->head = (s->head + 1) % SYRINGE_PENDING;
+            --s->count;
+            ++s->wakeups;
+        }
+        m_syringe.unlock();
+        return found;
+    }
+
+    // call wake(arg) once, with m_syringe held, at the next crossing of the
+    // observer id or when the syringe stops. For an observer that cannot
+    // block in waitCrossing(), wake must not block either. Return false
+    // without arming if there is already something for tryCrossing()
+    bool armWakeup(int id, void (*wake)(void *), void *arg) {
+        if (id < 0)
+            return false;
+        Subscriber *s = &subscribers[id];
+        m_syringe.lock();
+        bool armed = s->count == 0 && !stopped;
+        if (armed) {
+            s->wake = wake;
+            s->wakeArg = arg;
+        }
+        m_syringe.unlock();
+        return armed;
     }
 
-    // decrement the syringe level when pumping
+    // decrement the syringe level when pumping and notify the observers of
+    // the thresholds crossed
     void pump() {
+        m_syringe.lock();
+        double before = s_level[s_active];
+        beginWrite();
         s_level[s_active] -= s_step;
+        endWrite();
+        ++pumps;
+        if (recorder)
+            recorder->record(TRACE_PUMP, 0, 0, s_active, 0,
+                    s_level[s_active]);
+        for (int i = 0; i < nSubscribers; ++i)
+            notify(&subscribers[i], before, s_level[s_active]);
+        m_syringe.unlock();
     }
 
     double inspect() {
         return s_level[s_active];
     }
 
+    // level of syringe 0 or 1, read without the lock like inspect()
+    double level(int syringe) {
+        return s_level[syringe];
+    }
+
     int getActiveSyringe() {
         return s_active;
     }
 
+    // active syringe and level of both, consistent with each other. They
+    // are read without m_syringe under the seqlock of the writers, and
+    // with it after SYRINGE_READ_TRIES reads overlapped a write, so a
+    // reader of higher priority does not spin on a preempted writer
+    void levels(int &active, double &level0, double &level1) {
+        for (int tries = 0; tries < SYRINGE_READ_TRIES; ++tries) {
+            unsigned before = __atomic_load_n(&levelSeq, __ATOMIC_ACQUIRE);
+            if (before & 1)
+                continue;
+            active = s_active;
+            level0 = s_level[0];
+            level1 = s_level[1];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&levelSeq, __ATOMIC_RELAXED) == before)
+                return;
+        }
+        m_syringe.lock();
+        active = s_active;
+        level0 = s_level[0];
+        level1 = s_level[1];
+        m_syringe.unlock();
+    }
+
     // switch the syringe
     // as we are updating a shared variable, this action is protected by a mutex
     void syringeSwitch() {
-        pthread_mutex_lock(&m_syringe);
+        m_syringe.lock();
+        beginWrite();
         s_active = 1 - s_active;
-        pthread_mutex_unlock(&m_syringe);
+        endWrite();
+        if (recorder)
+            recorder->record(TRACE_SWITCH, 0, 0, s_active, 0, 0);
+        m_syringe.unlock();
     }
 
     // reset the syringe not being used
     // as we are updating a shared variable, this action is protected by a mutex
     void reset() {
-        pthread_mutex_lock(&m_syringe);
+        m_syringe.lock();
+        beginWrite();
         s_level[1-s_active] = 100;
-        pthread_mutex_unlock(&m_syringe);
+        endWrite();
+        if (recorder)
+            recorder->record(TRACE_RESET, 0, 0, s_active, 0, 100);
+        m_syringe.unlock();
     }
 
-    // stop the solution injection
+    // stop the solution injection and wake up the observers
     void stop() {
+        m_syringe.lock();
+        beginWrite();
         s_level[0] = -1;
         s_level[1] = -1;
+        endWrite();
+        stopped = true;
+        if (recorder)
+            recorder->record(TRACE_STOP, 0, 0, s_active, 0, 0);
+        for (int i = 0; i < nSubscribers; ++i) {
+            pthread_cond_signal(&subscribers[i].cv_crossing);
+            wakeup(&subscribers[i]);
+        }
+        m_syringe.unlock();
+    }
+
+    // number of pumps and of wakeups of the observer id so far
+    long pumpCount() {
+        m_syringe.lock();
+        long n = pumps;
+        m_syringe.unlock();
+        return n;
+    }
+
+    long wakeupCount(int id) {
+        if (id < 0)
+            return 0;
+        m_syringe.lock();
+        long n = subscribers[id].wakeups;
+        m_syringe.unlock();
+        return n;
     }
 
     // constants definitions
-    static const double level_critical = 1;
-    static const double level_weak = 5;
+    static constexpr double level_critical = 1;
+    static constexpr double level_weak = 5;
     // the quantity of solution used by the pump each time
-    static const double s_step = 1;
+    static constexpr double s_step = 1;
 
     // declaration of m_syringe mutex to protect the access to shared variables
     // s_level and s_active
-    pthread_mutex_t m_syringe;
+    PiMutex m_syringe;
 
 private:
+    struct Subscriber {
+        double thresholds[SYRINGE_THRESHOLDS];
+        int nThresholds;
+        // crossings not read yet
+        Crossing pending[SYRINGE_PENDING];
+        int head;
+        int count;
+        long wakeups;
+        pthread_cond_t cv_crossing;
+        // one shot wakeup set by armWakeup(), NULL for none
+        void (*wake)(void *);
+        void *wakeArg;
+    };
+
+    // bracket a change of s_level or s_active for levels(), m_syringe held.
+    // levelSeq is odd during the change
+    void beginWrite() {
+        __atomic_store_n(&levelSeq, levelSeq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void endWrite() {
+        __atomic_store_n(&levelSeq, levelSeq + 1, __ATOMIC_RELEASE);
+    }
+
+    // call and disarm the wakeup of s, m_syringe held
+    void wakeup(Subscriber *s) {
+        void (*wake)(void *) = s->wake;
+        if (wake) {
+            s->wake = NULL;
+            wake(s->wakeArg);
+        }
+    }
+
+    // queue a crossing for each threshold in ]after, before], m_syringe held
+    void notify(Subscriber *s, double before, double after) {
+        for (int i = 0; i < s->nThresholds; ++i) {
+            double threshold = s->thresholds[i];
+            if (before > threshold && after <= threshold
+                    && s->count < SYRINGE_PENDING) {
+                Crossing c = { threshold, after, s_active };
+                s->pending[(s->head + s->count) % SYRINGE_PENDING] = c;
+                ++s->count;
+                pthread_cond_signal(&s->cv_crossing);
+                wakeup(s);
+            }
+        }
+    }
+
     // defintion of the shared variable s_level representing the syringe1/2
     // level
     double s_level[2];
     // store the syringe being used, 0 if syringe1, 1 if syringe2
     int s_active;
+    // seqlock of s_level and s_active, see levels()
+    unsigned levelSeq;
+    bool stopped;
+    Subscriber subscribers[SYRINGE_SUBSCRIBERS];
+    int nSubscribers;
+    long pumps;
+    TraceRecorder *recorder;
 };
 
 #endif
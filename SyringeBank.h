@@ -0,0 +1,217 @@
+#ifndef SYRINGE_BANK_H
+#define SYRINGE_BANK_H
+
+#include <stdlib.h>
+#include <iostream>
+
+#include "Error.h"
+
+// size of a cache line, each cartridge has its own
+#define CARTRIDGE_ALIGN 64
+// cartridges of a bank at most, their index fits in half the control word
+#define BANK_CARTRIDGES 0x7ffe
+
+// state of one cartridge of a bank. The level is in doses and may go below
+// zero: a pump that finds the cartridge empty still decrements it and fails
+struct Cartridge {
+    long level;
+    // number of refills and doses drawn before them
+    long refills;
+    long drawn;
+    char pad[CARTRIDGE_ALIGN - 3 * sizeof(long)];
+};
+
+class SyringeBank;
+
+// chooses the cartridge to switch to when the active one is empty
+class SelectionPolicy {
+public:
+    virtual ~SelectionPolicy() {}
+
+    // return the next cartridge to use, or -1 if every cartridge is empty
+    virtual int select(const SyringeBank &bank, int current) = 0;
+};
+
+// Bank of n cartridges pumped without locks. pump() takes a dose from the
+// active cartridge with a single fetch_sub. When the active one is empty
+// the first pump seeing it moves the active index with a compare and swap
+// to the cartridge chosen by the selection policy. reset() refills a
+// cartridge that is not active with an exchange, so each dose is counted
+// exactly once: either by the pump that got it or in the level left at the
+// refill.
+//
+// The active index and the cartridge being refilled share one control
+// word. reset() claims its cartridge with a compare and swap that also
+// checks it is not the active one, and a switch never moves to the
+// cartridge being refilled, so a cartridge cannot be switched in between
+// the check and the refill.
+class SyringeBank {
+public:
+    SyringeBank(int n, long capacity = 100, SelectionPolicy *policy = NULL);
+
+    ~SyringeBank() {
+        free(cartridges);
+        delete defaultPolicy;
+    }
+
+    // take a dose from the active cartridge, return the cartridge it came
+    // from or -1 if the whole bank is empty
+    int pump() {
+        while (true) {
+            int a = activeOf(__atomic_load_n(&control, __ATOMIC_ACQUIRE));
+            long before = __atomic_fetch_sub(&cartridges[a].level, 1,
+                    __ATOMIC_ACQ_REL);
+            if (before >= 1)
+                return a;
+            if (switchCartridge(a) < 0)
+                return -1;
+        }
+    }
+
+    // move the active index away from from, return the active cartridge or
+    // -1 if no cartridge has doses left
+    int switchCartridge(int from) {
+        int next = policy->select(*this, from);
+        if (next < 0)
+            return -1;
+        int c = __atomic_load_n(&control, __ATOMIC_ACQUIRE);
+        while (true) {
+            // another pump may have switched already, then keep its choice
+            if (activeOf(c) != from)
+                return activeOf(c);
+            // next is being refilled, it is full in a few instructions
+            if (refillingOf(c) == next) {
+                c = __atomic_load_n(&control, __ATOMIC_ACQUIRE);
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&control, &c,
+                        pack(next, refillingOf(c)), false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+        }
+        __atomic_fetch_add(&switches, 1, __ATOMIC_RELAXED);
+        return next;
+    }
+
+    // refill cartridge i, refused while it is the active one. One refill
+    // runs at a time
+    bool reset(int i) {
+        int c = __atomic_load_n(&control, __ATOMIC_ACQUIRE);
+        while (true) {
+            if (activeOf(c) == i)
+                return false;
+            if (refillingOf(c) >= 0) {
+                c = __atomic_load_n(&control, __ATOMIC_ACQUIRE);
+                continue;
+            }
+            // i is not active and is now claimed, in one step
+            if (__atomic_compare_exchange_n(&control, &c, pack(activeOf(c), i),
+                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+        }
+        long before = __atomic_exchange_n(&cartridges[i].level, capacity,
+                __ATOMIC_ACQ_REL);
+        // the doses drawn since the previous refill
+        __atomic_fetch_add(&cartridges[i].drawn,
+                capacity - (before > 0 ? before : 0), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cartridges[i].refills, 1, __ATOMIC_RELAXED);
+        // release i, the active index may have moved meanwhile
+        c = __atomic_load_n(&control, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&control, &c,
+                    pack(activeOf(c), -1), false, __ATOMIC_ACQ_REL,
+                    __ATOMIC_ACQUIRE)) {}
+        return true;
+    }
+
+    // doses left in cartridge i
+    long level(int i) const {
+        long l = __atomic_load_n(&cartridges[i].level, __ATOMIC_ACQUIRE);
+        return l > 0 ? l : 0;
+    }
+
+    // doses drawn from the bank, refills included
+    long drawn() const {
+        long total = 0;
+        for (int i = 0; i < n; ++i) {
+            total += __atomic_load_n(&cartridges[i].drawn, __ATOMIC_ACQUIRE);
+            total += capacity - level(i);
+        }
+        return total;
+    }
+
+    int activeCartridge() const {
+        return activeOf(__atomic_load_n(&control, __ATOMIC_ACQUIRE));
+    }
+
+    int size() const { return n; }
+    long switchCount() const { return switches; }
+
+private:
+    // the active cartridge in the low half of the control word, the one
+    // being refilled plus one in the high half, 0 for none
+    static int pack(int active, int refilling) {
+        return (refilling + 1) << 16 | active;
+    }
+    static int activeOf(int c) { return c & 0xffff; }
+    static int refillingOf(int c) { return (c >> 16) - 1; }
+
+    Cartridge *cartridges;
+    int n;
+    long capacity;
+    // active cartridge and cartridge being refilled
+    int control;
+    long switches;
+    SelectionPolicy *policy;
+    SelectionPolicy *defaultPolicy;
+};
+
+// next cartridge with doses left after the current one
+class RoundRobin : public SelectionPolicy {
+public:
+    int select(const SyringeBank &bank, int current) {
+        for (int i = 1; i <= bank.size(); ++i) {
+            int c = (current + i) % bank.size();
+            if (bank.level(c) > 0)
+                return c;
+        }
+        return -1;
+    }
+};
+
+// cartridge with the most doses left
+class FullestFirst : public SelectionPolicy {
+public:
+    int select(const SyringeBank &bank, int current) {
+        int best = -1;
+        long bestLevel = 0;
+        for (int c = 0; c < bank.size(); ++c) {
+            if (c != current && bank.level(c) > bestLevel) {
+                best = c;
+                bestLevel = bank.level(c);
+            }
+        }
+        return best;
+    }
+};
+
+inline SyringeBank::SyringeBank(int n, long capacity, SelectionPolicy *policy)
+    : n(n), capacity(capacity), control(pack(0, -1)), switches(0),
+      policy(policy), defaultPolicy(NULL)
+{
+    CHECK(n <= BANK_CARTRIDGES, "Too many cartridges in a bank");
+    if (this->n > BANK_CARTRIDGES)
+        this->n = BANK_CARTRIDGES;
+    void *p = NULL;
+    if (posix_memalign(&p, CARTRIDGE_ALIGN, this->n * sizeof(Cartridge)) != 0)
+        p = NULL;
+    cartridges = (Cartridge *) p;
+    for (int i = 0; i < this->n; ++i) {
+        cartridges[i].level = capacity;
+        cartridges[i].refills = 0;
+        cartridges[i].drawn = 0;
+    }
+    if (policy == NULL)
+        this->policy = defaultPolicy = new RoundRobin;
+}
+
+#endif
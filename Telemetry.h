@@ -0,0 +1,206 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <pthread.h>
+#include <fstream>
+#include <iostream>
+
+#include "Clock.h"
+#include "Error.h"
+#include "Histogram.h"
+
+// priorities are below this value, one residency histogram each
+#define TELEMETRY_PRIORITIES 32
+// message codes are below this value, one drop and coalesce counter each
+#define TELEMETRY_MESSAGES 32
+
+// actuators timed from the decision of the controller to the injection
+enum Actuator { GLUCOSE_PUMP, INSULINE_PUMP, ACTUATORS };
+
+// periodic tasks with a release jitter histogram
+enum TaskId { CONTROLLER_TASK, GLUCOSE_TASK, INSULINE_TASK, TASK_IDS };
+
+// Measures of the threaded mode, always on: every update is a clock read and
+// a few relaxed atomic adds. The exporter reads them from its own thread.
+struct Telemetry {
+    Telemetry() : drops(0), backlogMax(0) {
+        for (int a = 0; a < ACTUATORS; ++a)
+            decidedNs[a] = 0;
+        for (int m = 0; m < TELEMETRY_MESSAGES; ++m)
+            messageDrops[m] = coalesces[m] = 0;
+    }
+
+    // the controller posted START to actuator a
+    void decided(Actuator a) {
+        __atomic_store_n(&decidedNs[a], monotonicNs(), __ATOMIC_RELAXED);
+    }
+
+    // time of the last START posted to actuator a
+    long long decision(Actuator a) const {
+        return __atomic_load_n(&decidedNs[a], __ATOMIC_RELAXED);
+    }
+
+    // the actuator injected, decision is the time of the START it acts on
+    void acted(Actuator a, long long decision) {
+        latency[a].record(monotonicNs() - decision);
+    }
+
+    // a message of priority was received sentNs after its send
+    void received(int priority, long long sentNs) {
+        if (priority >= 0 && priority < TELEMETRY_PRIORITIES)
+            residency[priority].record(monotonicNs() - sentNs);
+    }
+
+    // n messages could not be sent
+    void dropped(int n = 1) {
+        __atomic_fetch_add(&drops, n, __ATOMIC_RELAXED);
+    }
+
+    // a frame of the message code was dropped by the backpressure of the
+    // display channel
+    void droppedMessage(int code) {
+        if (code >= 0 && code < TELEMETRY_MESSAGES)
+            __atomic_fetch_add(&messageDrops[code], 1, __ATOMIC_RELAXED);
+        dropped();
+    }
+
+    // a frame of the message code replaced one of the same message that was
+    // waiting to be sent
+    void coalesced(int code) {
+        if (code >= 0 && code < TELEMETRY_MESSAGES)
+            __atomic_fetch_add(&coalesces[code], 1, __ATOMIC_RELAXED);
+    }
+
+    // a writer keeps n frames waiting for room in the display channel
+    void backlog(int n) {
+        long max = __atomic_load_n(&backlogMax, __ATOMIC_RELAXED);
+        while (n > max && !__atomic_compare_exchange_n(&backlogMax, &max,
+                    (long) n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    }
+
+    // one JSON line with every counter and histogram
+    void writeJson(std::ostream &os) const {
+        static const char *actuators[ACTUATORS] = { "glucose", "insuline" };
+        static const char *tasks[TASK_IDS] = {
+            "controller", "glucose", "insuline"
+        };
+        os << "{\"time_ns\":" << monotonicNs() << ",\"check_failures\":"
+           << __atomic_load_n(&checkFailures(), __ATOMIC_RELAXED)
+           << ",\"drops\":" << __atomic_load_n(&drops, __ATOMIC_RELAXED)
+           << ",\"backlog_max\":"
+           << __atomic_load_n(&backlogMax, __ATOMIC_RELAXED)
+           << ",\"drops_by_message\":";
+        writeCounters(messageDrops, os);
+        os << ",\"coalesced_by_message\":";
+        writeCounters(coalesces, os);
+        os << ",\"decision_latency\":{";
+        for (int a = 0; a < ACTUATORS; ++a) {
+            os << (a ? "," : "") << "\"" << actuators[a] << "\":";
+            latency[a].writeJson(os);
+        }
+        os << "},\"queue_residency\":{";
+        bool first = true;
+        for (int p = 0; p < TELEMETRY_PRIORITIES; ++p) {
+            if (residency[p].count() == 0)
+                continue;
+            os << (first ? "" : ",") << "\"" << p << "\":";
+            residency[p].writeJson(os);
+            first = false;
+        }
+        os << "},\"release_jitter\":{";
+        for (int t = 0; t < TASK_IDS; ++t) {
+            os << (t ? "," : "") << "\"" << tasks[t] << "\":";
+            jitter[t].writeJson(os);
+        }
+        os << "}}\n";
+    }
+
+    // counters of the messages that are not 0, as a JSON object
+    static void writeCounters(const long *counters, std::ostream &os) {
+        os << "{";
+        bool first = true;
+        for (int m = 0; m < TELEMETRY_MESSAGES; ++m) {
+            long n = __atomic_load_n(&counters[m], __ATOMIC_RELAXED);
+            if (n == 0)
+                continue;
+            os << (first ? "" : ",") << "\"" << m << "\":" << n;
+            first = false;
+        }
+        os << "}";
+    }
+
+    Histogram latency[ACTUATORS];
+    Histogram residency[TELEMETRY_PRIORITIES];
+    Histogram jitter[TASK_IDS];
+    long drops;
+    // frames dropped and coalesced per message code, most frames waiting in
+    // a writer
+    long messageDrops[TELEMETRY_MESSAGES];
+    long coalesces[TELEMETRY_MESSAGES];
+    long backlogMax;
+    long long decidedNs[ACTUATORS];
+};
+
+// Appends the telemetry as one JSON line every period to path, which may be
+// a regular file or a named pipe read by a local collector. A last line is
+// written when the exporter is destroyed.
+class TelemetryExporter {
+public:
+    TelemetryExporter(const Telemetry *telemetry, const char *path,
+            long long periodNs)
+        : telemetry(telemetry), out(path, std::ios::app), period(periodNs),
+          stopping(false)
+    {
+        CHECK(out, "Error opening telemetry file " << path);
+        pthread_mutex_init(&m_stop, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cv_stop, &attr);
+        pthread_condattr_destroy(&attr);
+        int r = pthread_create(&th_exporter, NULL, run, this);
+        CHECK(r == 0, "Error creating telemetry thread");
+    }
+
+    ~TelemetryExporter() {
+        pthread_mutex_lock(&m_stop);
+        stopping = true;
+        pthread_cond_signal(&cv_stop);
+        pthread_mutex_unlock(&m_stop);
+        pthread_join(th_exporter, NULL);
+        telemetry->writeJson(out);
+        out.flush();
+        pthread_cond_destroy(&cv_stop);
+        pthread_mutex_destroy(&m_stop);
+    }
+
+private:
+    static void *run(void *args) {
+        TelemetryExporter *e = (TelemetryExporter *) args;
+        long long next = monotonicNs() + e->period;
+        pthread_mutex_lock(&e->m_stop);
+        while (!e->stopping) {
+            timespec ts = toTimespec(next);
+            if (pthread_cond_timedwait(&e->cv_stop, &e->m_stop, &ts) == 0)
+                continue;
+            next += e->period;
+            // write without the lock, so stopping never waits for the disk
+            pthread_mutex_unlock(&e->m_stop);
+            e->telemetry->writeJson(e->out);
+            e->out.flush();
+            pthread_mutex_lock(&e->m_stop);
+        }
+        pthread_mutex_unlock(&e->m_stop);
+        return NULL;
+    }
+
+    const Telemetry *telemetry;
+    std::ofstream out;
+    long long period;
+    bool stopping;
+    pthread_mutex_t m_stop;
+    pthread_cond_t cv_stop;
+    pthread_t th_exporter;
+};
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <pthread.h>
+
+#include "Clock.h"
+#include "Error.h"
+#include "Periodic.h"
+
+// a wheel level has 64 slots, 5 levels cover 2^30 ticks
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 5
+
+// a one shot or periodic timer, owned by the caller and linked in a slot
+// of the wheel while it is scheduled
+struct Timer {
+    Timer() : next(NULL), prev(NULL), expires(0), interval(0),
+              fn(NULL), arg(NULL), pending(false) {}
+
+    Timer *next;
+    Timer *prev;
+    // expiry and period in ticks, interval 0 for a one shot timer
+    unsigned long long expires;
+    unsigned long long interval;
+    // called with arg and the expiry time in nanoseconds
+    void (*fn)(void *arg, long long time);
+    void *arg;
+    bool pending;
+};
+
+// Hierarchical timer wheel. Timers due in less than 64 ticks sit in the
+// first level, one slot per tick; farther timers sit in coarser levels and
+// are cascaded down as the wheel turns. schedule() and cancel() are O(1).
+// The wheel has no clock of its own: advance() fires every timer due up to
+// the given time, so it runs the same on the monotonic or a virtual clock.
+// It is not thread safe, TimerService adds the locking and the thread.
+class TimerWheel {
+public:
+    TimerWheel(long long tickNs, long long startNs = 0)
+        : tickNs(tickNs), current(startNs / tickNs), count(0)
+    {
+        for (int l = 0; l < WHEEL_LEVELS; ++l) {
+            occupied[l] = 0;
+            for (int s = 0; s < WHEEL_SLOTS; ++s) {
+                slots[l][s].next = &slots[l][s];
+                slots[l][s].prev = &slots[l][s];
+            }
+        }
+    }
+
+    // call fn(arg, time) at firstNs then every intervalNs (0 for once)
+    void schedule(Timer *t, long long firstNs, long long intervalNs,
+            void (*fn)(void *, long long), void *arg) {
+        if (t->pending)
+            cancel(t);
+        t->fn = fn;
+        t->arg = arg;
+        t->expires = (firstNs + tickNs - 1) / tickNs;
+        t->interval = (intervalNs + tickNs - 1) / tickNs;
+        insert(t);
+    }
+
+    // stop a timer, periodic or not
+    void cancel(Timer *t) {
+        t->interval = 0;
+        if (!t->pending)
+            return;
+        unlink(t);
+    }
+
+    // fire every timer due up to nowNs, in expiry order
+    void advance(long long nowNs) {
+        unsigned long long target = nowNs / tickNs;
+        while (current < target) {
+            if (count == 0) {
+                current = target;
+                break;
+            }
+            // jump to the next tick with a timer in the first level or to
+            // the next cascade, whichever comes first
+            unsigned long long next = (current | WHEEL_MASK) + 1;
+            unsigned s = current & WHEEL_MASK;
+            if (s != WHEEL_MASK) {
+                unsigned long long ahead = occupied[0] & (~0ULL << (s + 1));
+                if (ahead)
+                    next = (current & ~(unsigned long long) WHEEL_MASK)
+                        + __builtin_ctzll(ahead);
+            }
+            if (next > target) {
+                current = target;
+                break;
+            }
+            current = next;
+            if ((current & WHEEL_MASK) == 0)
+                cascade(1);
+            fire(current & WHEEL_MASK);
+        }
+    }
+
+    // time of the earliest pending timer in nanoseconds, -1 if none
+    long long nextExpiry() const {
+        unsigned long long best = 0;
+        bool found = false;
+        for (int l = 0; l < WHEEL_LEVELS; ++l) {
+            for (int s = 0; s < WHEEL_SLOTS; ++s) {
+                if (!(occupied[l] & (1ULL << s)))
+                    continue;
+                const Timer *head = &slots[l][s];
+                for (const Timer *t = head->next; t != head; t = t->next) {
+                    if (!found || t->expires < best) {
+                        best = t->expires;
+                        found = true;
+                    }
+                }
+            }
+        }
+        return found ? (long long) best * tickNs : -1;
+    }
+
+    long long now() const { return current * tickNs; }
+    long size() const { return count; }
+
+private:
+    // a timer scheduled or rearmed in the past fires on the next tick
+    void insert(Timer *t) {
+        if (t->expires <= current)
+            t->expires = current + 1;
+        place(t);
+    }
+
+    // link t in the slot of its expiry. A timer cascaded down when it is
+    // due on the current tick goes to the first level slot of that tick,
+    // which fire() runs right after the cascade
+    void place(Timer *t) {
+        unsigned long long delta = t->expires - current;
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1
+                && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+            ++level;
+        unsigned s = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+        // append, so timers of a slot fire in the order they were scheduled
+        Timer *head = &slots[level][s];
+        t->next = head;
+        t->prev = head->prev;
+        head->prev->next = t;
+        head->prev = t;
+        occupied[level] |= 1ULL << s;
+        t->pending = true;
+        ++count;
+    }
+
+    void unlink(Timer *t) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        // the slot is empty when its head points to itself
+        if (t->next == t->prev && t->next->next == t->next)
+            clearSlot(t->next);
+        t->next = t->prev = NULL;
+        t->pending = false;
+        --count;
+    }
+
+    // clear the occupied bit of an empty slot given its head
+    void clearSlot(Timer *head) {
+        for (int l = 0; l < WHEEL_LEVELS; ++l) {
+            if (head >= &slots[l][0] && head < &slots[l][WHEEL_SLOTS]) {
+                occupied[l] &= ~(1ULL << (head - &slots[l][0]));
+                return;
+            }
+        }
+    }
+
+    // move the timers of the current slot of level down to lower levels,
+    // and the level above when this one wrapped
+    void cascade(int level) {
+        if (level >= WHEEL_LEVELS)
+            return;
+        unsigned s = (current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        if (s == 0)
+            cascade(level + 1);
+
+        Timer *head = &slots[level][s];
+        Timer *t = head->next;
+        head->next = head->prev = head;
+        occupied[level] &= ~(1ULL << s);
+        while (t != head) {
+            Timer *next = t->next;
+            --count;
+            place(t);
+            t = next;
+        }
+    }
+
+    void fire(unsigned s) {
+        Timer *head = &slots[0][s];
+        while (head->next != head) {
+            Timer *t = head->next;
+            unlink(t);
+            long long time = (long long) t->expires * tickNs;
+            t->fn(t->arg, time);
+            // rearm a periodic timer unless the callback did it or cancelled
+            if (t->interval > 0 && !t->pending) {
+                t->expires += t->interval;
+                insert(t);
+            }
+        }
+    }
+
+    long long tickNs;
+    // last tick processed
+    unsigned long long current;
+    long count;
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long long occupied[WHEEL_LEVELS];
+};
+
+// Drives a timer wheel on the monotonic clock from one thread. Every timer
+// callback runs on that thread, instead of a thread per POSIX timer expiry.
+class TimerService {
+public:
+    TimerService(long long tickNs)
+        : wheel(tickNs, 0), tickNs(tickNs), start(monotonicNs()),
+          stopping(false)
+    {
+        pthread_mutex_init(&m_wheel, NULL);
+        int r = pthread_create(&th_timer, NULL, run, this);
+        CHECK(r == 0, "Error creating timer thread");
+    }
+
+    ~TimerService() {
+        stopping = true;
+        pthread_join(th_timer, NULL);
+        pthread_mutex_destroy(&m_wheel);
+    }
+
+    // call fn(arg, time) firstNs from now then every intervalNs
+    void schedule(Timer *t, long long firstNs, long long intervalNs,
+            void (*fn)(void *, long long), void *arg) {
+        pthread_mutex_lock(&m_wheel);
+        wheel.schedule(t, elapsed() + firstNs, intervalNs, fn, arg);
+        pthread_mutex_unlock(&m_wheel);
+    }
+
+    void cancel(Timer *t) {
+        pthread_mutex_lock(&m_wheel);
+        wheel.cancel(t);
+        pthread_mutex_unlock(&m_wheel);
+    }
+
+    // time since the service started, the time base of the callbacks
+    long long elapsed() const { return monotonicNs() - start; }
+
+private:
+    static void *run(void *args) {
+        TimerService *service = (TimerService *) args;
+        // one tick per period on absolute deadlines, a late wakeup does
+        // not shift the next ones
+        PeriodicTask task(service->tickNs);
+        while (!service->stopping) {
+            task.wait();
+            pthread_mutex_lock(&service->m_wheel);
+            service->wheel.advance(service->elapsed());
+            pthread_mutex_unlock(&service->m_wheel);
+        }
+        return NULL;
+    }
+
+    TimerWheel wheel;
+    long long tickNs;
+    long long start;
+    volatile bool stopping;
+    pthread_mutex_t m_wheel;
+    pthread_t th_timer;
+};
+
+#endif
@@ -0,0 +1,398 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "Clock.h"
+#include "Error.h"
+
+// "GTRC", at the start of every trace file
+#define TRACE_MAGIC 0x43525447
+#define TRACE_VERSION 1
+// bytes before the first record, one page so the segments are page aligned
+#define TRACE_HEADER 4096
+// records per mapped segment of the recorder (32 MB), segments per trace
+// at most, and records between two entries of the index
+#define TRACE_SEGMENT (1 << 20)
+#define TRACE_SEGMENTS 16384
+#define TRACE_INDEX_STRIDE 65536
+// records per window mapped by the reader (2 MB)
+#define TRACE_WINDOW (1 << 16)
+
+// what a record of the trace is about
+enum TraceKind {
+    // a slot never written, when the recorder did not close the trace
+    TRACE_NONE,
+    // the controller read the patient: a glucose, b insuline, value the
+    // glycemia
+    TRACE_GLYCEMIA,
+    // an injection, a is the glucose or insuline count after it
+    TRACE_GLUCOSE,
+    TRACE_INSULINE,
+    // a pump of the syringe: a the active syringe, value its level after
+    TRACE_PUMP,
+    // a switch of syringe and a reset of the inactive one, a the active one
+    TRACE_SWITCH,
+    TRACE_RESET,
+    TRACE_STOP,
+    // a command posted to the pump device and a command read by it
+    TRACE_POST,
+    TRACE_RECEIVE,
+    // a frame of the display channel: a its priority, b its sequence number
+    // and value its payload
+    TRACE_SEND
+};
+
+// one event of the trace, written to the file as is
+struct TraceRecord {
+    // monotonic time of the event in nanoseconds
+    long long time;
+    double value;
+    int a;
+    int b;
+    unsigned short kind;
+    unsigned char device;
+    // the Message of a command or a frame
+    unsigned char code;
+    unsigned pad;
+};
+
+// an entry of the index: the record number every TRACE_INDEX_STRIDE
+// records and its time
+struct TraceIndex {
+    long long time;
+    long long record;
+};
+
+// at the start of the file, written again when the recorder is closed
+struct TraceHeader {
+    unsigned magic;
+    unsigned version;
+    unsigned recordSize;
+    // PolicyId of the controller, level triggered commands and heartbeat
+    int policy;
+    int levelTriggered;
+    int heartbeat;
+    long long startNs;
+    // records written and offset of the index, 0 if the trace was not closed
+    long long records;
+    long long indexOffset;
+    long long indexEntries;
+    // records that could not be written
+    long long drops;
+};
+
+inline const char *traceKindName(int kind) {
+    static const char *names[] = {
+        "none", "glycemia", "glucose", "insuline", "pump", "switch", "reset",
+        "stop", "post", "receive", "send"
+    };
+    return kind >= 0 && kind <= TRACE_SEND ? names[kind] : "?";
+}
+
+// Recorder of every state transition and message of the threaded mode to a
+// memory mapped file. A record takes a slot with one atomic add and is
+// copied to the mapping: no lock and no system call, except for the thread
+// reaching a segment not mapped yet. The recorder maps the next segment
+// when half of the current one is taken, and unmaps a segment once all its
+// slots are written, so only about two segments are mapped whatever the
+// size of the trace. The order of the slots is the order of the events of
+// each thread, and of the events recorded under a same lock.
+class TraceRecorder {
+public:
+    TraceRecorder(const char *path, int policy, bool levelTriggered,
+            int heartbeat)
+        : next(0), drops(0)
+    {
+        segments = new char *[TRACE_SEGMENTS];
+        done = new int[TRACE_SEGMENTS];
+        for (int s = 0; s < TRACE_SEGMENTS; ++s) {
+            segments[s] = NULL;
+            done[s] = 0;
+        }
+        pthread_mutex_init(&m_map, NULL);
+        memset(&header, 0, sizeof(header));
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        header.recordSize = sizeof(TraceRecord);
+        header.policy = policy;
+        header.levelTriggered = levelTriggered;
+        header.heartbeat = heartbeat;
+        header.startNs = monotonicNs();
+
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0, "Error opening trace " << path);
+        if (fd >= 0) {
+            writeAt(&header, sizeof(header), 0);
+            map(0);
+        }
+    }
+
+    // unmap the segments, write the index and the final header. The
+    // recording threads must have stopped
+    ~TraceRecorder() {
+        long long n = next < (long long) TRACE_SEGMENTS * TRACE_SEGMENT
+            ? next : (long long) TRACE_SEGMENTS * TRACE_SEGMENT;
+        for (int s = 0; s < TRACE_SEGMENTS; ++s) {
+            if (segments[s])
+                munmap(segments[s], segmentBytes());
+        }
+        if (fd >= 0) {
+            header.records = n;
+            header.drops = drops;
+            header.indexOffset = TRACE_HEADER + n * sizeof(TraceRecord);
+            CHECK(ftruncate(fd, header.indexOffset) == 0,
+                    "Error truncating trace");
+            writeIndex();
+            writeAt(&header, sizeof(header), 0);
+            close(fd);
+        }
+        pthread_mutex_destroy(&m_map);
+        delete[] done;
+        delete[] segments;
+    }
+
+    // append an event, return false if it was dropped
+    bool record(TraceKind kind, int device, int code, int a, int b,
+            double value) {
+        long long k = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+        int s = k / TRACE_SEGMENT;
+        int offset = k % TRACE_SEGMENT;
+        if (s >= TRACE_SEGMENTS || fd < 0) {
+            __atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        if (offset == TRACE_SEGMENT / 2 && s + 1 < TRACE_SEGMENTS)
+            map(s + 1);
+        char *base = __atomic_load_n(&segments[s], __ATOMIC_ACQUIRE);
+        if (base == NULL && (base = map(s)) == NULL) {
+            __atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+            written(s);
+            return false;
+        }
+        TraceRecord *r = (TraceRecord *) base + offset;
+        r->time = monotonicNs();
+        r->value = value;
+        r->a = a;
+        r->b = b;
+        r->kind = kind;
+        r->device = device;
+        r->code = code;
+        r->pad = 0;
+        written(s);
+        return true;
+    }
+
+    long long recordCount() const {
+        return __atomic_load_n(&next, __ATOMIC_RELAXED);
+    }
+
+    long dropCount() const {
+        return __atomic_load_n(&drops, __ATOMIC_RELAXED);
+    }
+
+private:
+    static size_t segmentBytes() {
+        return (size_t) TRACE_SEGMENT * sizeof(TraceRecord);
+    }
+
+    // map segment s, growing the file, return NULL on error
+    char *map(int s) {
+        pthread_mutex_lock(&m_map);
+        char *base = segments[s];
+        if (base == NULL) {
+            off_t offset = TRACE_HEADER + (off_t) s * segmentBytes();
+            struct stat st;
+            if (fstat(fd, &st) == 0
+                    && st.st_size < offset + (off_t) segmentBytes())
+                CHECK(ftruncate(fd, offset + segmentBytes()) == 0,
+                        "Error growing trace");
+            void *p = mmap(NULL, segmentBytes(), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, offset);
+            CHECK(p != MAP_FAILED, "Error mapping trace");
+            if (p != MAP_FAILED) {
+                base = (char *) p;
+                __atomic_store_n(&segments[s], base, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&m_map);
+        return base;
+    }
+
+    // a slot of segment s is written, unmap the segment after its last one
+    void written(int s) {
+        if (__atomic_add_fetch(&done[s], 1, __ATOMIC_ACQ_REL) < TRACE_SEGMENT)
+            return;
+        pthread_mutex_lock(&m_map);
+        if (segments[s]) {
+            munmap(segments[s], segmentBytes());
+            segments[s] = NULL;
+        }
+        pthread_mutex_unlock(&m_map);
+    }
+
+    // one entry every TRACE_INDEX_STRIDE records, from the time of the
+    // records read back from the file
+    void writeIndex() {
+        header.indexEntries = 0;
+        off_t at = header.indexOffset;
+        for (long long k = 0; k < header.records; k += TRACE_INDEX_STRIDE) {
+            TraceRecord r;
+            if (pread(fd, &r, sizeof(r), TRACE_HEADER + k * sizeof(r))
+                    != (ssize_t) sizeof(r))
+                break;
+            TraceIndex entry = { r.time, k };
+            if (!writeAt(&entry, sizeof(entry), at))
+                break;
+            at += sizeof(entry);
+            ++header.indexEntries;
+        }
+    }
+
+    bool writeAt(const void *data, size_t size, off_t offset) {
+        const char *p = (const char *) data;
+        while (size > 0) {
+            ssize_t r = pwrite(fd, p, size, offset);
+            if (r < 0 && errno == EINTR)
+                continue;
+            CHECK(r > 0, "Error writing trace");
+            if (r <= 0)
+                return false;
+            p += r;
+            size -= r;
+            offset += r;
+        }
+        return true;
+    }
+
+    TraceHeader header;
+    int fd;
+    // mapped segments, NULL once unmapped, and slots written in each
+    char **segments;
+    int *done;
+    long long next;
+    long drops;
+    pthread_mutex_t m_map;
+};
+
+// Sequential reader of a trace. Records are read through a window of
+// TRACE_WINDOW records mapped at a time, so a trace of any size is read
+// with a few MB of memory. A trace whose recorder did not close has no
+// index, its records are read up to the end of the file.
+class TraceReader {
+public:
+    TraceReader(const char *path)
+        : window(NULL), windowFirst(0), windowSize(0), position(0), records(0)
+    {
+        fd = open(path, O_RDONLY);
+        CHECK(fd >= 0, "Error opening trace " << path);
+        if (fd < 0)
+            return;
+        if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+                || header.magic != TRACE_MAGIC
+                || header.version != TRACE_VERSION
+                || header.recordSize != sizeof(TraceRecord)) {
+            std::cerr << path << " is not a trace of this version"
+                      << std::endl;
+            close(fd);
+            fd = -1;
+            return;
+        }
+        records = header.records;
+        if (records == 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > TRACE_HEADER)
+                records = (st.st_size - TRACE_HEADER) / sizeof(TraceRecord);
+        }
+        for (long long e = 0; e < header.indexEntries; ++e) {
+            TraceIndex entry;
+            if (pread(fd, &entry, sizeof(entry),
+                    header.indexOffset + e * sizeof(entry))
+                    != (ssize_t) sizeof(entry))
+                break;
+            index.push_back(entry);
+        }
+    }
+
+    ~TraceReader() {
+        unmap();
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool valid() const { return fd >= 0; }
+    const TraceHeader &traceHeader() const { return header; }
+    long long recordCount() const { return records; }
+
+    // the next record, NULL at the end of the trace
+    const TraceRecord *next() {
+        if (position >= records)
+            return NULL;
+        if (position >= windowFirst + windowSize && !mapWindow(position))
+            return NULL;
+        return &window[position++ - windowFirst];
+    }
+
+    // number of the record next() returns
+    long long tell() const { return position; }
+
+    // go to the first record at or after time with the index, at the start
+    // if the trace has no index. Records are only about sorted by time
+    // between threads, the position is the index entry before time
+    void seek(long long time) {
+        long long record = 0;
+        for (size_t e = 0; e < index.size() && index[e].time <= time; ++e)
+            record = index[e].record;
+        position = record;
+        const TraceRecord *r;
+        while ((r = next()) != NULL && r->time < time) {}
+        if (r)
+            --position;
+    }
+
+private:
+    // map the window holding record first, aligned on TRACE_WINDOW
+    bool mapWindow(long long first) {
+        unmap();
+        windowFirst = first - first % TRACE_WINDOW;
+        windowSize = std::min((long long) TRACE_WINDOW, records - windowFirst);
+        off_t offset = TRACE_HEADER + windowFirst * sizeof(TraceRecord);
+        void *p = mmap(NULL, windowSize * sizeof(TraceRecord), PROT_READ,
+                MAP_SHARED, fd, offset);
+        CHECK(p != MAP_FAILED, "Error mapping trace");
+        if (p == MAP_FAILED) {
+            windowSize = 0;
+            return false;
+        }
+        madvise(p, windowSize * sizeof(TraceRecord), MADV_SEQUENTIAL);
+        window = (const TraceRecord *) p;
+        return true;
+    }
+
+    void unmap() {
+        if (window)
+            munmap((void *) window, windowSize * sizeof(TraceRecord));
+        window = NULL;
+        windowSize = 0;
+    }
+
+    int fd;
+    TraceHeader header;
+    std::vector<TraceIndex> index;
+    const TraceRecord *window;
+    long long windowFirst;
+    long long windowSize;
+    long long position;
+    long long records;
+};
+
+#endif
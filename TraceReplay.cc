@@ -0,0 +1,58 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "Controller.h"
+#include "Message.h"
+#include "Replay.h"
+#include "Trace.h"
+
+// Offline replay of a trace of GlycemiaRegulator --record. The records are
+// read through a window of the memory mapped file, a trace bigger than the
+// memory replays at the speed of the disk.
+//
+//     TraceReplay <file>              replay the trace and diff the state
+//     TraceReplay <file> <ms> [n]     print n records from ms after the
+//                                     start, found with the index
+
+#define DUMP_RECORDS 20
+
+// print n records from time ms of the trace
+int dump(TraceReader &reader, long long ms, long n) {
+    const TraceHeader &header = reader.traceHeader();
+    reader.seek(header.startNs + ms * 1000000);
+    const TraceRecord *r;
+    for (long i = 0; i < n && (r = reader.next()) != NULL; ++i) {
+        printf("%lld [%.3f ms] %s", reader.tell() - 1,
+                (r->time - header.startNs) / 1e6, traceKindName(r->kind));
+        if (r->kind == TRACE_POST || r->kind == TRACE_RECEIVE
+                || r->kind == TRACE_SEND)
+            printf(" device %d code %d %s", r->device, r->code,
+                    messageText((Message) r->code));
+        printf(" a %d b %d value %.2f\n", r->a, r->b, r->value);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: TraceReplay <file> [<ms> [n]]" << std::endl;
+        return 1;
+    }
+    TraceReader reader(argv[1]);
+    if (!reader.valid())
+        return 1;
+    if (argc > 2)
+        return dump(reader, atoll(argv[2]),
+                argc > 3 ? atol(argv[3]) : DUMP_RECORDS);
+
+    int policy = reader.traceHeader().policy;
+    if (policy < 0 || policy >= POLICIES) {
+        std::cerr << "Unknown policy " << policy << " in " << argv[1]
+                  << std::endl;
+        return 1;
+    }
+    std::cout << reader.recordCount() << " records, policy "
+              << policyName(policy) << std::endl;
+    return replays[policy](reader, std::cout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,587 @@
+#ifndef WARD_H
+#define WARD_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <iostream>
+
+#include "Clock.h"
+#include "Controller.h"
+#include "EdgeTrigger.h"
+#include "Error.h"
+#include "EventLog.h"
+#include "GlycemiaStats.h"
+#include "LiveState.h"
+#include "Message.h"
+#include "Patient.h"
+#include "Periodic.h"
+#include "Syringe.h"
+#include "WorkStealing.h"
+
+// number of display events a bed can buffer between two display steps
+#define BED_EVENTS 16
+// number of beds a worker takes from the ward at once
+#define WARD_CHUNK 64
+// jobs per worker and per cycle the stealing workers aim at, and failed
+// takes of an idle worker before it yields
+#define STEAL_JOBS 8
+#define STEAL_SPINS 64
+
+// an event waiting for the display step and its value, see payloadName,
+// taken when the event was posted
+struct BedEvent {
+    double value;
+    Message msg;
+};
+
+// one Patient/Syringe pair with the state that the dedicated tasks used to
+// keep on their own stack
+struct Bed {
+    Bed()
+        : id(0), glucoseSeen(0), insulineSeen(0),
+          glucoseInjecting(false), insulineInjecting(true), pumped(false),
+          nEvents(0), verbose(false), log(NULL)
+    {}
+
+    // edge or level triggered commands, with a heartbeat of the pumps every
+    // heartbeat cycles (0 for none)
+    void setTrigger(bool edge, int heartbeat) {
+        glucoseOut = EdgeTrigger(edge, heartbeat);
+        insulineOut = EdgeTrigger(edge, heartbeat);
+        alarmOut = EdgeTrigger(edge);
+    }
+
+    int id;
+    Patient patient;
+    Syringe sManager;
+    // commands posted by the controller and the version last read by the
+    // glucose and insuline steps
+    Mailbox<Message> glucoseCmd;
+    Mailbox<Message> insulineCmd;
+    unsigned glucoseSeen;
+    unsigned insulineSeen;
+    bool glucoseInjecting;
+    bool insulineInjecting;
+    // state of the control policy and its last decision
+    ControlState control;
+    DecisionCache decided;
+    // glycemia read by the controller step
+    GlycemiaStats stats;
+    // last commands of the controller to the pumps and the display
+    EdgeTrigger glucoseOut;
+    EdgeTrigger insulineOut;
+    EdgeTrigger alarmOut;
+    // set when the insuline step pumped since the last syringe step
+    bool pumped;
+    // events waiting for the display step
+    BedEvent events[BED_EVENTS];
+    int nEvents;
+    bool verbose;
+    // binary log of the events, printed when NULL
+    EventLog *log;
+};
+
+// add a message and its value for the display step of the bed, the oldest
+// events are kept when the buffer is full
+inline void post(Bed *bed, Message msg, double value = 0) {
+    if (bed->nEvents < BED_EVENTS) {
+        BedEvent e = { value, msg };
+        bed->events[bed->nEvents++] = e;
+    }
+}
+
+// send the commands of the controller to the pumps and the display, the
+// triggers drop the ones already sent. A pump without command gets its
+// heartbeat, an alarm carries the glycemia it was decided on
+inline void command(Bed *bed, const Decision &d, double glycemia) {
+    if (d.glucose == NONE) {
+        if (bed->glucoseOut.idleCycle())
+            bed->glucoseCmd.post((Message) bed->glucoseOut.command());
+    } else if (bed->glucoseOut.update(d.glucose)) {
+        bed->glucoseCmd.post(d.glucose);
+    }
+    if (d.insuline == NONE) {
+        if (bed->insulineOut.idleCycle())
+            bed->insulineCmd.post((Message) bed->insulineOut.command());
+    } else if (bed->insulineOut.update(d.insuline)) {
+        bed->insulineCmd.post(d.insuline);
+    }
+    if (d.alarm != NONE && bed->alarmOut.update(d.alarm))
+        post(bed, d.alarm, glycemia);
+}
+
+// controller step with the control law of Policy, as t_controller. A
+// patient that did not change since the last step is not decided again
+template <class Policy>
+inline void policyStep(Bed *bed) {
+    double glycemia;
+    Decision d = decideCached<Policy>(bed->control, bed->decided,
+            bed->patient, glycemia);
+    command(bed, d, glycemia);
+    bed->stats.add(glycemia);
+}
+
+// controller step of the default policy
+inline void controllerStep(Bed *bed) {
+    policyStep<BangBang>(bed);
+}
+
+// controller step of each policy, indexed by PolicyId
+static void (*const policySteps[POLICIES])(Bed *) = {
+    policyStep<BangBang>,
+    policyStep<Hysteresis>,
+    policyStep<Pid>,
+    policyStep<Predictive>,
+};
+
+// syringe step, same switch/reset rules as t_syringe. It only looks at the
+// level after a pump
+inline void syringeStep(Bed *bed) {
+    if (!bed->pumped)
+        return;
+    bed->pumped = false;
+
+    Syringe *sManager = &bed->sManager;
+    double level = sManager->inspect();
+    int s_active = sManager->getActiveSyringe();
+    if (level == Syringe::level_critical) {
+        post(bed, s_active == 0 ? SYRINGE_1_CRITICAL : SYRINGE_2_CRITICAL,
+                level);
+        sManager->syringeSwitch();
+        post(bed, SWITCH);
+        sManager->reset();
+        post(bed, RESET);
+    } else if (level == Syringe::level_weak) {
+        post(bed, s_active == 0 ? SYRINGE_1_LOW : SYRINGE_2_LOW, level);
+    }
+}
+
+// glucose step, same behaviour as one cycle of t_glucose
+inline void glucoseStep(Bed *bed) {
+    Message msg = NONE;
+    bed->glucoseCmd.read(msg, bed->glucoseSeen);
+    // only a change of the injection is displayed, like t_glucose
+    if (msg == START) {
+        if (!bed->glucoseInjecting)
+            post(bed, GLUCOSE_START);
+        bed->glucoseInjecting = true;
+    } else if (msg == STOP) {
+        if (bed->glucoseInjecting)
+            post(bed, GLUCOSE_STOP);
+        bed->glucoseInjecting = false;
+    }
+
+    if (bed->glucoseInjecting)
+        bed->patient.injectGlucose();
+}
+
+// insuline step, same behaviour as one cycle of t_insuline
+inline void insulineStep(Bed *bed) {
+    Message msg = NONE;
+    bed->insulineCmd.read(msg, bed->insulineSeen);
+    if (msg == START) {
+        if (!bed->insulineInjecting)
+            post(bed, INSULINE_START);
+        bed->insulineInjecting = true;
+    } else if (msg == STOP) {
+        if (bed->insulineInjecting)
+            post(bed, INSULINE_STOP);
+        bed->insulineInjecting = false;
+    }
+
+    if (bed->insulineInjecting) {
+        bed->sManager.pump();
+        bed->pumped = true;
+        bed->patient.injectInsuline();
+    }
+}
+
+// display step, logs the buffered events or prints them prefixed by the
+// bed id
+inline void displayStep(Bed *bed) {
+    if (bed->log) {
+        for (int i = 0; i < bed->nEvents; ++i) {
+            const BedEvent &e = bed->events[i];
+            if (*messageText(e.msg))
+                bed->log->log(bed->id, e.msg, e.value);
+        }
+    } else if (bed->verbose) {
+        for (int i = 0; i < bed->nEvents; ++i) {
+            const char *text = messageText(bed->events[i].msg);
+            if (*text)
+                std::cout << "[bed " << bed->id << "] " << text << "\n";
+        }
+    }
+    bed->nEvents = 0;
+}
+
+// the steps of a bed, in the same order as the priorities of the tasks
+struct Step {
+    Priority priority;
+    void (*run)(Bed *);
+};
+
+static const Step wardSteps[] = {
+    { VERY_CRITICAL, controllerStep },
+    { CRITICAL, syringeStep },
+    { VERY_URGENT, glucoseStep },
+    { URGENT, insulineStep },
+    { NORMAL, displayStep },
+};
+
+static const int nWardSteps = sizeof(wardSteps) / sizeof(wardSteps[0]);
+
+class Ward;
+
+// a worker of a ward and its index, for its deques
+struct WardWorker {
+    Ward *ward;
+    int index;
+    pthread_t thread;
+};
+
+// Hosts many beds in one process. A fixed pool of workers runs every bed
+// through all its steps once per cycle, so the number of threads does not
+// depend on the number of patients. The events go to log if given.
+//
+// By default a worker takes chunks of beds and runs all the steps of each.
+// With setStealing(true), a step of a chunk is a job in the lane of its
+// priority: the controller steps of every bed go before any display step,
+// the next step of a chunk is queued by the worker that ran the previous
+// one, and an idle worker steals the jobs of the others.
+class Ward {
+public:
+    Ward(int nBeds, int nWorkers, bool verbose = false, EventLog *log = NULL)
+        : nBeds(nBeds), nWorkers(nWorkers), live(NULL), queues(NULL),
+          chunk(WARD_CHUNK), nextBed(0), stopping(false), remaining(0),
+          controllersLeft(0), cycleStart(0), controllersNs(0), inversions(0),
+          cycles(0), totalNs(0), minNs(0), maxNs(0), doneSum(0), doneMax(0)
+    {
+        for (int s = 0; s < nWardSteps; ++s)
+            steps[s] = wardSteps[s];
+        for (int l = 0; l < STEAL_LANES; ++l) {
+            laneStep[l] = -1;
+            waiting[l] = 0;
+        }
+        for (int s = 0; s < nWardSteps; ++s)
+            laneStep[laneOf(steps[s].priority)] = s;
+        beds = new Bed[nBeds];
+        for (int i = 0; i < nBeds; ++i) {
+            beds[i].id = i;
+            beds[i].verbose = verbose;
+            beds[i].log = log;
+        }
+
+        // the workers and the thread calling cycle() meet on both barriers
+        pthread_barrier_init(&b_start, NULL, nWorkers + 1);
+        pthread_barrier_init(&b_end, NULL, nWorkers + 1);
+        workers = new WardWorker[nWorkers];
+        for (int i = 0; i < nWorkers; ++i) {
+            workers[i].ward = this;
+            workers[i].index = i;
+            int r = pthread_create(&workers[i].thread, NULL, worker,
+                    &workers[i]);
+            CHECK(r == 0, "Error creating ward worker");
+        }
+    }
+
+    ~Ward() {
+        stopping = true;
+        pthread_barrier_wait(&b_start);
+        for (int i = 0; i < nWorkers; ++i)
+            pthread_join(workers[i].thread, NULL);
+        pthread_barrier_destroy(&b_start);
+        pthread_barrier_destroy(&b_end);
+        delete[] workers;
+        delete queues;
+        delete[] beds;
+    }
+
+    // run every step of every bed once and record the time it took
+    void cycle() {
+        long long start = monotonicNs();
+        cycleStart = start;
+        int nChunks = (nBeds + chunk - 1) / chunk;
+        controllersLeft = nChunks;
+        if (queues) {
+            // the workers are stopped, their deques can be filled from here
+            remaining = (long) nChunks * nWardSteps;
+            // a chunk the deque cannot take runs here, before the cycle
+            for (int c = 0; c < nChunks; ++c) {
+                if (!queues->push(c % nWorkers, laneOf(steps[0].priority), c))
+                    runJob(c % nWorkers, c, 0);
+            }
+        } else {
+            nextBed = 0;
+            // every step of every chunk waits to start
+            for (int l = 0; l < STEAL_LANES; ++l)
+                waiting[l] = 0;
+            for (int s = 0; s < nWardSteps; ++s)
+                waiting[laneOf(steps[s].priority)] += nChunks;
+        }
+        pthread_barrier_wait(&b_start);
+        pthread_barrier_wait(&b_end);
+        long long duration = monotonicNs() - start;
+
+        doneSum += controllersNs;
+        if (controllersNs > doneMax)
+            doneMax = controllersNs;
+        if (cycles == 0 || duration < minNs)
+            minNs = duration;
+        if (duration > maxNs)
+            maxNs = duration;
+        totalNs += duration;
+        ++cycles;
+    }
+
+    // run nCycles cycles, one every period seconds (0 to run them back to
+    // back), then stop the syringes as t_controller does
+    void run(int nCycles, double period) {
+        // the cycles are released on absolute deadlines from the first
+        // one, the wakeup latency does not add up
+        PeriodicTask task((long long) (period * 1000000000LL));
+        for (int i = 0; i < nCycles; ++i) {
+            cycle();
+            if (period > 0)
+                task.wait();
+        }
+        for (int i = 0; i < nBeds; ++i) {
+            post(&beds[i], HALT);
+            displayStep(&beds[i]);
+            beds[i].sManager.stop();
+        }
+    }
+
+    // print the controller cycle time of the whole ward, when the last
+    // controller step of a cycle ended, the priority inversions and the
+    // share of the controller steps served from the decision cache
+    void report(std::ostream &os) const {
+        long long n = cycles ? cycles : 1;
+        os << nBeds << " patients, " << nWorkers << " workers"
+           << (queues ? " stealing, " : ", ")
+           << cycles << " cycles: min " << minNs / 1000 << " us, mean "
+           << totalNs / n / 1000 << " us, max " << maxNs / 1000
+           << " us, controllers done mean " << doneSum / n / 1000
+           << " us max " << doneMax / 1000 << " us, "
+           << inversionCount() << " inversions, " << stealCount()
+           << " steals, " << cachedDecisions() * 100.0 / (n * nBeds)
+           << "% decisions cached" << std::endl;
+    }
+
+    // steps of a chunk as jobs of work stealing deques, or chunks of beds
+    // run through all their steps. Must be called between cycles
+    void setStealing(bool on) {
+        delete queues;
+        queues = NULL;
+        chunk = WARD_CHUNK;
+        if (!on)
+            return;
+        // enough jobs for every worker to steal some, up to WARD_CHUNK beds
+        chunk = nBeds / (nWorkers * STEAL_JOBS);
+        if (chunk < 1)
+            chunk = 1;
+        if (chunk > WARD_CHUNK)
+            chunk = WARD_CHUNK;
+        // a chunk is queued once at a time, so a deque of one slot per
+        // chunk is never full
+        queues = new StealQueues(nWorkers, (nBeds + chunk - 1) / chunk);
+    }
+
+    // steps started while a step of a higher priority was waiting, counted
+    // per chunk
+    long inversionCount() const {
+        long n = inversions;
+        if (queues) {
+            for (int w = 0; w < nWorkers; ++w)
+                n += queues->workerCounters(w).inversions;
+        }
+        return n;
+    }
+
+    long stealCount() const {
+        long n = 0;
+        if (queues) {
+            for (int w = 0; w < nWorkers; ++w)
+                n += queues->workerCounters(w).steals;
+        }
+        return n;
+    }
+
+    // controller step of every bed, controllerStep by default. Must be
+    // called between cycles, the last decisions are dropped
+    void setController(void (*step)(Bed *)) {
+        steps[0].run = step;
+        for (int i = 0; i < nBeds; ++i)
+            beds[i].decided.invalidate();
+    }
+
+    // controller steps served from the last decision of their bed
+    long cachedDecisions() const {
+        long n = 0;
+        for (int i = 0; i < nBeds; ++i)
+            n += beds[i].decided.hits;
+        return n;
+    }
+
+    // add the glycemia statistics of every bed to total. Must be called
+    // between cycles
+    void mergeStats(GlycemiaStats &total) const {
+        for (int i = 0; i < nBeds; ++i)
+            total.merge(beds[i].stats);
+    }
+
+    // publish the state of bed i to slot i of live after each cycle, NULL
+    // to stop
+    void setLive(LiveState *l) {
+        live = l;
+    }
+
+    Bed *bed(int i) { return &beds[i]; }
+    int size() const { return nBeds; }
+
+    long long meanCycleNs() const { return cycles ? totalNs / cycles : 0; }
+    long long maxCycleNs() const { return maxNs; }
+    long long meanControllersNs() const {
+        return cycles ? doneSum / cycles : 0;
+    }
+
+private:
+    static void *worker(void *args) {
+        WardWorker *w = (WardWorker *) args;
+        Ward *ward = w->ward;
+        while (true) {
+            pthread_barrier_wait(&ward->b_start);
+            if (ward->stopping)
+                return NULL;
+            if (ward->queues)
+                ward->stealBeds(w->index);
+            else
+                ward->runBeds();
+            pthread_barrier_wait(&ward->b_end);
+        }
+    }
+
+    // take chunks of beds until the whole ward has been stepped
+    void runBeds() {
+        while (true) {
+            int first = __sync_fetch_and_add(&nextBed, WARD_CHUNK);
+            if (first >= nBeds)
+                return;
+            int last = first + WARD_CHUNK < nBeds ? first + WARD_CHUNK : nBeds;
+            for (int i = first; i < last; ++i) {
+                for (int s = 0; s < nWardSteps; ++s) {
+                    if (i == first)
+                        started(s);
+                    steps[s].run(&beds[i]);
+                }
+                if (live)
+                    live->publish(i, liveSnapshot(beds[i].patient,
+                            beds[i].sManager));
+            }
+            controllersDone();
+        }
+    }
+
+    // take jobs until every step of every chunk has run
+    void stealBeds(int worker) {
+        int idle = 0;
+        while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) > 0) {
+            int job;
+            int lane = queues->take(worker, job);
+            if (lane < 0) {
+                // the jobs left are running on the other workers
+                if (++idle % STEAL_SPINS == 0)
+                    sched_yield();
+                continue;
+            }
+            idle = 0;
+            runJob(worker, job, laneStep[lane]);
+        }
+    }
+
+    // run step s of chunk job, then queue its next step in the deque of
+    // worker. The steps a full deque cannot take run here in turn. Each
+    // step is counted in remaining once done
+    void runJob(int worker, int job, int s) {
+        int first = job * chunk;
+        int last = first + chunk < nBeds ? first + chunk : nBeds;
+        for (; ; ++s) {
+            for (int i = first; i < last; ++i)
+                steps[s].run(&beds[i]);
+            if (s == 0)
+                controllersDone();
+            // the next step is queued before the job is counted as done,
+            // so the workers cannot see the cycle end before it runs
+            bool next = s + 1 < nWardSteps;
+            bool queued = next && queues->push(worker,
+                    laneOf(steps[s + 1].priority), job);
+            if (!next && live) {
+                for (int i = first; i < last; ++i)
+                    live->publish(i, liveSnapshot(beds[i].patient,
+                            beds[i].sManager));
+            }
+            __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELEASE);
+            if (!next || queued)
+                return;
+        }
+    }
+
+    // step s of a chunk starts, on its first bed. Count an inversion if a
+    // step of a higher priority of any chunk is still waiting, as
+    // StealQueues::take does for the jobs
+    void started(int s) {
+        int lane = laneOf(steps[s].priority);
+        __atomic_sub_fetch(&waiting[lane], 1, __ATOMIC_RELAXED);
+        for (int h = 0; h < lane; ++h) {
+            if (__atomic_load_n(&waiting[h], __ATOMIC_RELAXED) > 0) {
+                __atomic_add_fetch(&inversions, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+
+    // a chunk ran its controller steps, record the time of the last one
+    void controllersDone() {
+        if (__atomic_sub_fetch(&controllersLeft, 1, __ATOMIC_ACQ_REL) == 0)
+            controllersNs = monotonicNs() - cycleStart;
+    }
+
+    Bed *beds;
+    Step steps[nWardSteps];
+    // step of each lane of the deques, -1 for none
+    int laneStep[STEAL_LANES];
+    int nBeds;
+    int nWorkers;
+    LiveState *live;
+    WardWorker *workers;
+    pthread_barrier_t b_start;
+    pthread_barrier_t b_end;
+    // deques of the workers when stealing, NULL otherwise
+    StealQueues *queues;
+    // beds per chunk
+    int chunk;
+    // index of the next bed to hand out to a worker
+    int nextBed;
+    volatile bool stopping;
+    // jobs of the cycle not done yet, when stealing
+    long remaining;
+    // chunks whose controller steps did not run yet, time of the start of
+    // the cycle and time when they all ran
+    long controllersLeft;
+    long long cycleStart;
+    long long controllersNs;
+    // steps of the chunks not started yet per lane, and steps started
+    // while one of a higher lane was waiting, without stealing
+    long waiting[STEAL_LANES];
+    long inversions;
+
+    // controller cycle time statistics
+    long long cycles;
+    long long totalNs;
+    long long minNs;
+    long long maxNs;
+    long long doneSum;
+    long long doneMax;
+};
+
+#endif
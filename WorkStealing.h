@@ -0,0 +1,195 @@
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <sched.h>
+
+#include "Channel.h"
+#include "Error.h"
+
+// lanes of the deques of a worker, one per level of Priority
+#define STEAL_LANES 6
+
+// lane of a priority, 0 for the highest
+inline int laneOf(Priority priority) {
+    switch (priority) {
+        case VERY_CRITICAL: return 0;
+        case CRITICAL: return 1;
+        case VERY_URGENT: return 2;
+        case URGENT: return 3;
+        case NORMAL: return 4;
+        default: return 5;
+    }
+}
+
+// Chase-Lev deque of jobs of a fixed capacity, a power of two. The owner
+// pushes and pops at the bottom without lock, the other workers steal at
+// the top with a compare and swap, so they only meet on the last job.
+class StealDeque {
+public:
+    StealDeque() : top(0), bottom(0), jobs(NULL), mask(0) {}
+
+    ~StealDeque() {
+        delete[] jobs;
+    }
+
+    void init(long capacity) {
+        long size = 1;
+        while (size < capacity)
+            size <<= 1;
+        jobs = new int[size];
+        mask = size - 1;
+    }
+
+    // owner only. Return false without queuing job if the deque is full,
+    // a job not taken yet is never overwritten
+    bool push(int job) {
+        long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+        long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        if (b - t > mask)
+            return false;
+        __atomic_store_n(&jobs[b & mask], job, __ATOMIC_RELAXED);
+        __atomic_store_n(&bottom, b + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // owner only, the newest job
+    bool pop(int &job) {
+        long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+        if (t > b) {
+            __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        job = __atomic_load_n(&jobs[b & mask], __ATOMIC_RELAXED);
+        if (t == b) {
+            // the last job, a thief may be taking it
+            bool won = __atomic_compare_exchange_n(&top, &t, t + 1, false,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+            __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+            return won;
+        }
+        return true;
+    }
+
+    // any worker, the oldest job. False if empty or lost to another taker
+    bool steal(int &job) {
+        long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+        if (t >= b)
+            return false;
+        job = __atomic_load_n(&jobs[t & mask], __ATOMIC_RELAXED);
+        return __atomic_compare_exchange_n(&top, &t, t + 1, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+
+    bool empty() const {
+        return __atomic_load_n(&top, __ATOMIC_ACQUIRE)
+            >= __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+    }
+
+private:
+    // not copyable, the jobs are owned
+    StealDeque(const StealDeque &);
+    StealDeque &operator=(const StealDeque &);
+
+    // taken at the top by the thieves, on their own cache line
+    long top;
+    char pad[CACHE_LINE - sizeof(long)];
+    long bottom;
+    int *jobs;
+    long mask;
+};
+
+// counters of a worker, on their own cache line
+struct StealCounters {
+    long jobs;
+    long steals;
+    // jobs started while a job of a higher lane was waiting
+    long inversions;
+    char pad[CACHE_LINE - 3 * sizeof(long)];
+};
+
+// Deques of a pool of workers, one per lane and per worker. A worker takes
+// the highest lane that has a job anywhere: its own newest job first, else
+// the oldest one of another worker, before it looks at the lane below. A
+// job of a higher lane thus never waits behind a lower one that is not
+// running yet, without any real-time priority of the threads. The number
+// of jobs waiting in each lane tells when a worker takes a job while a
+// higher one waits, a priority inversion.
+class StealQueues {
+public:
+    StealQueues(int nWorkers, long capacity) : nWorkers(nWorkers) {
+        deques = new StealDeque[nWorkers * STEAL_LANES];
+        for (int i = 0; i < nWorkers * STEAL_LANES; ++i)
+            deques[i].init(capacity);
+        counters = new StealCounters[nWorkers];
+        for (int w = 0; w < nWorkers; ++w)
+            counters[w].jobs = counters[w].steals = counters[w].inversions = 0;
+        for (int l = 0; l < STEAL_LANES; ++l)
+            waiting[l] = 0;
+    }
+
+    ~StealQueues() {
+        delete[] deques;
+        delete[] counters;
+    }
+
+    // queue job in lane of worker, from that worker or while it is
+    // stopped. Return false if the deque is full, the caller runs the job
+    bool push(int worker, int lane, int job) {
+        __atomic_add_fetch(&waiting[lane], 1, __ATOMIC_RELAXED);
+        if (deque(worker, lane)->push(job))
+            return true;
+        __atomic_sub_fetch(&waiting[lane], 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    // take a job for worker, return its lane or -1 if none was found
+    int take(int worker, int &job) {
+        StealCounters *c = &counters[worker];
+        for (int l = 0; l < STEAL_LANES; ++l) {
+            if (__atomic_load_n(&waiting[l], __ATOMIC_RELAXED) == 0)
+                continue;
+            bool found = deque(worker, l)->pop(job);
+            // the victims are tried from the next worker on, so the
+            // thieves spread over them
+            for (int i = 1; !found && i < nWorkers; ++i) {
+                found = deque((worker + i) % nWorkers, l)->steal(job);
+                if (found)
+                    ++c->steals;
+            }
+            if (!found)
+                continue;
+            __atomic_sub_fetch(&waiting[l], 1, __ATOMIC_RELAXED);
+            ++c->jobs;
+            for (int h = 0; h < l; ++h) {
+                if (__atomic_load_n(&waiting[h], __ATOMIC_RELAXED) > 0) {
+                    ++c->inversions;
+                    break;
+                }
+            }
+            return l;
+        }
+        return -1;
+    }
+
+    const StealCounters &workerCounters(int worker) const {
+        return counters[worker];
+    }
+
+private:
+    StealDeque *deque(int worker, int lane) {
+        return &deques[worker * STEAL_LANES + lane];
+    }
+
+    int nWorkers;
+    StealDeque *deques;
+    StealCounters *counters;
+    // jobs pushed and not taken yet, per lane
+    long waiting[STEAL_LANES];
+};
+
+#endif